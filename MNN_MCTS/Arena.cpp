@@ -0,0 +1,346 @@
+//To be compiled as g++ -ffast-math -O3 -std=c++11 -pthread -o Arena Arena.cpp MCTS.cpp Tree.cpp Pipeline.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp net.c samples.c -lz
+//Usage: ./Arena <new networks> <old networks> [number of threads] [maximum number of games]
+
+//Match between two generations of the networks (<name>_network_<generation>.txt, as in PlayGame), to decide whether the new one
+//is promoted. The games are played concurrently on several threads, the new networks playing white in the even games and black in
+//the odd ones. After each game a sequential probability ratio test (SPRT) compares the hypotheses that the new networks are
+//SPRT_ELO0 or SPRT_ELO1 Elo stronger than the old ones, and the match stops as soon as one of them is accepted, with error rates
+//SPRT_ALPHA and SPRT_BETA, or after MAX_GAMES games.
+//The exit status is 0 if the new networks are accepted, 2 if they are rejected or the match is inconclusive.
+
+#include "Chess.hpp"
+#include "Tree.hpp"
+#include "MCTS.hpp"
+#include "Pipeline.hpp"
+#include "net.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <cmath>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <array>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+
+#define MAX_N_MOVES 600
+#define MAX_GAMES 400
+#define N_THREADS 8
+#define SHOW_GAMES 0
+
+//Limits of the search of each move (time in seconds, 0 for no time limit)
+#define MOVE_TIME 0.
+#define EARLY_STOP 1
+
+//Evaluation of the leaves shared by all the games (0 evaluators to let each game evaluate its own leaves)
+#define N_EVALUATORS 2
+#define EVALUATION_BATCH_SIZE 64
+#define EVALUATION_MAX_WAIT 0.001
+
+//Resign the decided games and draw the long balanced ones (see AdjudicationRules in MCTS.hpp), always resigning
+#define ADJUDICATION 1
+
+//Hypotheses of the SPRT on the Elo difference of the new networks, and error rates
+#define SPRT_ELO0 0.
+#define SPRT_ELO1 10.
+#define SPRT_ALPHA 0.05
+#define SPRT_BETA 0.05
+
+#define ARENA_REJECTED 2
+
+//Play with the multi-head networks multi_network_<generation>.txt, which replace the seven networks (see MULTI_HEAD in Orchestrator)
+#define MULTI_HEAD 0
+
+
+//Networks of a generation, the heads of multi with MULTI_HEAD
+struct Networks {
+	NN* net1;
+	std::array<NN*, 6> nets2;
+	multi_net multi;
+};
+
+
+//State shared by the threads
+struct ArenaContext {
+	//New and old networks
+	Networks players[2];
+	SearchLimits limits;
+	AdjudicationRules rules;
+	BranchCollector* collector;
+	LeafEvaluator* evaluator;
+	unsigned int seed;
+	int maxGames;
+
+	//Next game to play
+	std::atomic<int> nextGame;
+	//Set when the SPRT has come to a decision
+	std::atomic<bool> stop;
+
+	//Wins, draws and losses of the new networks
+	int results[3];
+	//Log-likelihood ratio of the SPRT and its decision (1 accepted, -1 rejected, 0 none yet)
+	double llr;
+	int decision;
+	std::mutex resultsMutex;
+};
+
+
+void loadNetworks(Networks &networks, std::string generation) {
+	const char* names[7] = {"pieces", "pawn", "rook", "knight", "bishop", "queen", "king"};
+	const int types[6] = {PAWN, ROOK, KNIGHT, BISHOP, QUEEN, KING};
+	char name[100];
+
+	if(MULTI_HEAD == 1) {
+		snprintf(name, sizeof(name), "multi_network_%s.txt", generation.c_str());
+		load_multi_net(&networks.multi, name);
+		if(networks.multi.nheads != 7) {
+			printf("Error, the multi-head network has %d heads instead of 7.\n", networks.multi.nheads);
+			exit(EXIT_FAILURE);
+		}
+		networks.net1 = &networks.multi.heads[0];
+		for(int i=0;i<6;i++) {
+			networks.nets2[types[i]] = &networks.multi.heads[i + 1];
+		}
+		return;
+	}
+
+	networks.net1 = new NN();
+	snprintf(name, sizeof(name), "%s_network_%s.txt", names[0], generation.c_str());
+	load_net(networks.net1, name);
+
+	for(int i=0;i<6;i++) {
+		networks.nets2[types[i]] = new NN();
+		snprintf(name, sizeof(name), "%s_network_%s.txt", names[i + 1], generation.c_str());
+		load_net(networks.nets2[types[i]], name);
+	}
+}
+
+void deleteNetworks(Networks &networks) {
+	if(MULTI_HEAD == 1) {
+		free_multi_net(&networks.multi);
+		return;
+	}
+	for(int i=0;i<6;i++) {
+		delete networks.nets2[i];
+	}
+	delete networks.net1;
+}
+
+
+//Score and its variance per game, from the results of the new networks
+void getScore(int results[3], double &score, double &variance) {
+	int n = results[0] + results[1] + results[2];
+
+	score = (results[0] + 0.5 * results[1]) / n;
+	variance = (results[0] * pow(1. - score, 2) + results[1] * pow(0.5 - score, 2) + results[2] * pow(score, 2)) / n;
+}
+
+double eloToScore(double elo) {
+	return 1. / (1. + pow(10., -elo / 400.));
+}
+
+double scoreToElo(double score) {
+	//Avoid infinite differences when one of the networks won all the games
+	score = std::min(std::max(score, 1e-3), 1. - 1e-3);
+	return -400. * log10(1. / score - 1.);
+}
+
+//Log-likelihood ratio of the hypotheses elo1 and elo0, in the normal approximation of the trinomial distribution of the results
+double getLLR(int results[3], double elo0, double elo1) {
+	int n = results[0] + results[1] + results[2];
+	double score, variance;
+
+	getScore(results, score, variance);
+	if(variance <= 0.) {
+		return 0.;
+	}
+
+	double s0 = eloToScore(elo0);
+	double s1 = eloToScore(elo1);
+	return n * (s1 - s0) * (2. * score - s0 - s1) / (2. * variance);
+}
+
+//Elo difference of the new networks and its 95% confidence interval
+void getElo(int results[3], double &elo, double &lower, double &upper) {
+	int n = results[0] + results[1] + results[2];
+	double score, variance;
+
+	getScore(results, score, variance);
+	double error = 1.96 * sqrt(variance / n);
+	elo = scoreToElo(score);
+	lower = scoreToElo(score - error);
+	upper = scoreToElo(score + error);
+}
+
+
+//Plays a game, returns its winner (0 if it was abandoned because the match is over)
+int playGame(ArenaContext *context, int game, bool &abandoned) {
+	//The new networks play white in the even games
+	int newPlayer = (game % 2 == 0) ? 0 : 1;
+	MCTS* Players[2];
+	for(int i=0;i<2;i++) {
+		Networks &networks = context->players[(i == newPlayer) ? 0 : 1];
+		Players[i] = new MCTS(new ChessState(), networks.net1, networks.nets2, false, context->seed + 2 * game + i);
+		Players[i]->setCollector(context->collector);
+		if(context->evaluator != NULL) {
+			Players[i]->enablePipeline(context->evaluator);
+		}
+	}
+	Adjudicator adjudicator(context->rules, context->seed + game);
+
+	ChessState* currentState = Players[0]->getTree().getRoot()->getState();
+	int Nmoves = 0;
+	int player = 0;
+	abandoned = false;
+	while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
+		if(context->stop == true) {
+			abandoned = true;
+			break;
+		}
+
+		//Only the player to move thinks
+		SearchStatistics statistics = Players[player]->search(context->limits);
+		if(adjudicator.update(currentState->getPlayer(), statistics.rootValue, Nmoves) == true) {
+			break;
+		}
+		currentState = Players[player]->playBestMove();
+
+		//The other player needs the moves from its root to follow the game
+		player = (player + 1) % 2;
+		if(Players[player]->getTree().getRoot()->isLeaf() == true) {
+			Players[player]->search(SearchLimits(0., 1, 0, false));
+		}
+		Players[player]->playMove(currentState);
+
+		Nmoves++;
+	}
+
+	int winner = currentState->getWinner();
+	if(adjudicator.getTermination() != GAME_PLAYED) {
+		winner = adjudicator.getWinner();
+	}
+
+	delete Players[0];
+	delete Players[1];
+
+	return winner;
+}
+
+
+//Loop of the threads: play games until the SPRT decides or all the games have been played
+void playGames(ArenaContext *context) {
+	int game;
+
+	while(((game = context->nextGame++) < context->maxGames) && (context->stop == false)) {
+		bool abandoned;
+		int winner = playGame(context, game, abandoned);
+		if(abandoned == true) {
+			return;
+		}
+
+		//Result from the point of view of the new networks, white in the even games
+		int newWinner = (game % 2 == 0) ? winner : -winner;
+
+		std::lock_guard<std::mutex> lock(context->resultsMutex);
+		if(context->stop == true) {
+			return;
+		}
+		context->results[1 - newWinner]++;
+
+		double elo, lower, upper;
+		getElo(context->results, elo, lower, upper);
+		context->llr = getLLR(context->results, SPRT_ELO0, SPRT_ELO1);
+		std::cout << "Game " << (game+1) << ": +" << context->results[0] << " =" << context->results[1] << " -" << context->results[2];
+		std::cout << ", Elo " << elo << " [" << lower << ", " << upper << "], LLR " << context->llr << "\n";
+
+		if(context->llr >= log((1. - SPRT_BETA) / SPRT_ALPHA)) {
+			context->decision = 1;
+			context->stop = true;
+		}
+		else if(context->llr <= log(SPRT_BETA / (1. - SPRT_ALPHA))) {
+			context->decision = -1;
+			context->stop = true;
+		}
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	ArenaContext context;
+	int nThreads = N_THREADS;
+
+	if(argc < 3) {
+		printf("Error, give the numbers of the networks to use as a parameter!\n");
+		exit(EXIT_FAILURE);
+	}
+	context.maxGames = MAX_GAMES;
+	if(argc > 3) {
+		nThreads = atoi(argv[3]);
+	}
+	if(argc > 4) {
+		context.maxGames = atoi(argv[4]);
+	}
+	if((nThreads < 1) || (context.maxGames < 1)) {
+		printf("Error, the number of threads and of games must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	context.seed = time(0);
+	loadNetworks(context.players[0], argv[1]);
+	loadNetworks(context.players[1], argv[2]);
+
+	context.limits = SearchLimits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+	context.rules = (ADJUDICATION == 1) ? AdjudicationRules(MCTS_RESIGN_THRESHOLD, MCTS_RESIGN_MOVES, 0., MCTS_DRAW_THRESHOLD, MCTS_DRAW_MOVES, MCTS_DRAW_AFTER_MOVE) : AdjudicationRules(0., 0, 0., 0., 0, 0);
+	context.collector = new BranchCollector();
+	context.evaluator = NULL;
+	if(N_EVALUATORS > 0) {
+		context.evaluator = new LeafEvaluator(N_EVALUATORS, EVALUATION_BATCH_SIZE, EVALUATION_MAX_WAIT);
+	}
+	context.nextGame = 0;
+	context.stop = false;
+	for(int i=0;i<3;i++) {
+		context.results[i] = 0;
+	}
+	context.llr = 0.;
+	context.decision = 0;
+
+	std::cout << "Networks " << argv[1] << " against " << argv[2] << ": up to " << context.maxGames << " games on " << nThreads << " threads, SPRT elo0 = " << SPRT_ELO0 << ", elo1 = " << SPRT_ELO1 << " (seed " << context.seed << ").\n";
+
+	//Play the games
+	std::vector<std::thread> threads;
+	for(int i=0;i<nThreads;i++) {
+		threads.push_back(std::thread(playGames, &context));
+	}
+	for(int i=0;i<nThreads;i++) {
+		threads[i].join();
+	}
+
+	int nGames = context.results[0] + context.results[1] + context.results[2];
+	if(nGames > 0) {
+		double elo, lower, upper;
+		getElo(context.results, elo, lower, upper);
+		std::cout << "\n\nResults of " << argv[1] << " after " << nGames << " games: +" << context.results[0] << " =" << context.results[1] << " -" << context.results[2] << "\n";
+		std::cout << "Elo difference: " << elo << " (95% confidence: " << lower << ", " << upper << ")\n";
+	}
+	if(context.decision == 1) {
+		std::cout << "SPRT: the new networks are accepted (LLR " << context.llr << ").\n";
+	}
+	else if(context.decision == -1) {
+		std::cout << "SPRT: the new networks are rejected (LLR " << context.llr << ").\n";
+	}
+	else {
+		std::cout << "SPRT: inconclusive after " << nGames << " games (LLR " << context.llr << ").\n";
+	}
+
+	delete context.evaluator;
+	delete context.collector;
+	deleteNetworks(context.players[0]);
+	deleteNetworks(context.players[1]);
+
+	if(context.decision != 1) {
+		exit(ARENA_REJECTED);
+	}
+}
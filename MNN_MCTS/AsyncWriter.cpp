@@ -0,0 +1,130 @@
+#include <deque>
+#include <string>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include "AsyncWriter.hpp"
+
+
+//CONSTRUCTORS
+AsyncWriter::AsyncWriter(size_t capacity) : capacity(capacity), running(true), busy(false), submitted(0), completed(0), blocked(0), maxQueueLength(0), blockedTime(0.), workTime(0.) {
+  this->thread = std::thread(&AsyncWriter::work, this);
+}
+
+AsyncWriter::AsyncWriter(void) : AsyncWriter(ASYNC_WRITER_QUEUE_SIZE) { }
+
+
+//Loop of the writer thread: run the tasks in the order of submission
+void AsyncWriter::work(void) {
+  while(true) {
+    std::function<void(void)> task;
+
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->notEmpty.wait(lock, [this]{ return (this->tasks.size() > 0) || (this->running == false); });
+
+      if(this->tasks.size() == 0) {
+        return;
+      }
+
+      task = this->tasks.front();
+      this->tasks.pop_front();
+      this->busy = true;
+    }
+    this->notFull.notify_one();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    task();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->busy = false;
+      this->completed++;
+      this->workTime += elapsed;
+    }
+    this->idle.notify_all();
+  }
+}
+
+
+//TASKS
+//Blocks while the queue is full
+void AsyncWriter::submit(std::function<void(void)> task) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+
+  if(this->tasks.size() >= this->capacity) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    this->notFull.wait(lock, [this]{ return this->tasks.size() < this->capacity; });
+    this->blocked++;
+    this->blockedTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  this->tasks.push_back(task);
+  this->submitted++;
+  if(this->tasks.size() > this->maxQueueLength) {
+    this->maxQueueLength = this->tasks.size();
+  }
+
+  lock.unlock();
+  this->notEmpty.notify_one();
+}
+
+//Waits until all the tasks submitted have been completed
+void AsyncWriter::drain(void) {
+  std::unique_lock<std::mutex> lock(this->mutex);
+  this->idle.wait(lock, [this]{ return (this->tasks.size() == 0) && (this->busy == false); });
+}
+
+
+//STATISTICS
+long AsyncWriter::getNumberOfTasks(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->submitted;
+}
+
+long AsyncWriter::getNumberOfBlockedSubmissions(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->blocked;
+}
+
+size_t AsyncWriter::getMaxQueueLength(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->maxQueueLength;
+}
+
+double AsyncWriter::getBlockedTime(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->blockedTime;
+}
+
+double AsyncWriter::getWorkTime(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->workTime;
+}
+
+std::string AsyncWriter::getStatistics(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  std::ostringstream statistics;
+
+  statistics << "Output tasks: " << this->submitted << " submitted, " << this->completed << " completed in " << this->workTime << " s; ";
+  statistics << "longest queue " << this->maxQueueLength << " of " << this->capacity << ", " << this->blocked << " submissions blocked for " << this->blockedTime << " s.\n";
+
+  return statistics.str();
+}
+
+
+//DESTRUCTOR
+AsyncWriter::~AsyncWriter(void) {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->running = false;
+  }
+  this->notEmpty.notify_all();
+
+  //The tasks left are completed before the thread stops
+  this->thread.join();
+}
@@ -0,0 +1,85 @@
+/*
+    AsyncWriter.hpp:
+        Library for the output of the training data on a background thread.
+        The search threads hand their output (the samples of a TrainingSet, the records of a GameRecordWriter, the lines of the logs) to
+        the AsyncWriter as tasks, which its thread serializes, compresses and writes in order. The queue of the tasks is bounded: when it is
+        full, submit blocks until the thread catches up, so that a slow disk slows down the games instead of filling the memory.
+        The AsyncWriter has to be deleted, which completes the tasks left, before the objects used by its tasks.
+
+        @author: Massimiliano Chiappini
+        @contact: massimilianochiappini@gmail.com
+        @version: 0.2
+*/
+
+
+
+#ifndef ASYNCWRITER_HPP
+#define ASYNCWRITER_HPP
+
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+#define ASYNC_WRITER_QUEUE_SIZE 256
+
+
+
+
+class AsyncWriter {
+  private:
+    std::deque<std::function<void(void)>> tasks;
+    size_t capacity;
+
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::condition_variable idle;
+    bool running;
+    bool busy;
+
+    //Statistics
+    long submitted;
+    long completed;
+    long blocked;
+    size_t maxQueueLength;
+    double blockedTime;
+    double workTime;
+
+    std::thread thread;
+
+    void work(void);
+
+
+  public:
+    //CONSTRUCTORS
+    AsyncWriter(size_t);
+    AsyncWriter(void);
+
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+
+    //TASKS
+    void submit(std::function<void(void)>);
+    void drain(void);
+
+
+    //STATISTICS
+    long getNumberOfTasks(void);
+    long getNumberOfBlockedSubmissions(void);
+    size_t getMaxQueueLength(void);
+    double getBlockedTime(void);
+    double getWorkTime(void);
+    std::string getStatistics(void);
+
+
+    //DESTRUCTOR
+    ~AsyncWriter(void);
+};
+
+
+#endif
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <unordered_map>
 #include "Chess.hpp"
+#include "Profiler.hpp"
 
 
 #define DEBUG_MODE 0
@@ -135,21 +136,31 @@ int ChessState::getWinner(void) {
 }
 
 
-//Checks if this is the final state
-bool ChessState::isFinalState(void) {
-	//If a three-fold repetition happend, or if the counter to draw reached 50, the game is over
+//Counts the repetitions of the current board among the previous ones
+int ChessState::countRepetitions(void) {
 	if(this->previousBoards.size() == 8) {
 		if(this->board == this->previousBoards[3]) {
 	        if (this->board == this->previousBoards[7]) {
-				//A three-fold repetition happened
-				this->Repetition = 3;
-				return true;
+				return 3;
 			}
 			else {
-				this->Repetition = 2;
+				return 2;
 			}
 		}
 	}
+
+	return this->Repetition;
+}
+
+
+//Checks if this is the final state
+bool ChessState::isFinalState(void) {
+	//If a three-fold repetition happend, or if the counter to draw reached 50, the game is over
+	this->Repetition = this->countRepetitions();
+	if(this->Repetition == 3) {
+		//A three-fold repetition happened
+		return true;
+	}
 	if(this->CounterToDraw == MAX_COUNTER_TO_DRAW) {
 		return true;
 	}
@@ -217,8 +228,57 @@ std::array<int,2> ChessState::getKingPositions(void) {
 }
 
 
+//Random keys of the Zobrist hashing, generated once with a splitmix64 sequence
+static std::array<uint64_t, (64 * N_CHESS_PIECES + 8)> createZobristKeys(void) {
+    std::array<uint64_t, (64 * N_CHESS_PIECES + 8)> keys;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+    for(int i=0;i<keys.size();i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        keys[i] = z ^ (z >> 31);
+    }
+
+    return keys;
+}
+
+static const std::array<uint64_t, (64 * N_CHESS_PIECES + 8)> ZOBRIST_KEYS = createZobristKeys();
+
+
+//Key identifying the position: two states with the same key get the same network inputs and follow the same rules
+uint64_t ChessState::getPositionKey(void) {
+    uint64_t key = 0;
+
+    for(int square=0;square<64;square++) {
+        if(this->board[square] != empty) {
+            key ^= ZOBRIST_KEYS[N_CHESS_PIECES * square + this->board[square]];
+        }
+    }
+
+    if(this->player == -1) {
+        key ^= ZOBRIST_KEYS[64 * N_CHESS_PIECES];
+    }
+    for(int color=0;color<2;color++) {
+        for(int side=0;side<2;side++) {
+            if(this->possibleCastling[color][side]) {
+                key ^= ZOBRIST_KEYS[64 * N_CHESS_PIECES + 1 + 2 * color + side];
+            }
+        }
+    }
+
+    //The counters are mixed in with a multiplicative hash
+    key ^= ((uint64_t)this->countRepetitions() * 0xD6E8FEB86659FD93ULL);
+    key ^= ((uint64_t)(this->Nmove + 1) * 0xA0761D6478BD642FULL);
+    key ^= ((uint64_t)(this->CounterToDraw + 1) * 0xE7037ED1A0B428DBULL);
+
+    return key;
+}
+
+
 //All the legal moves from this state have to be built
 std::vector<ChessMove> ChessState::computeLegalMoves(void) {
+    PROFILE_PHASE(PHASE_LEGAL_MOVES);
     int i, j, n;
     int check;
     std::vector<ChessMove> possibleMoves;
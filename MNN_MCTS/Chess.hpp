@@ -5,6 +5,8 @@
         It contains a method to determine if the state is a final state of the game, and eventually who is the winner.
         Also, the method simulateGame performs a random game simulation starting from the current state, and the returns the reward.
         It contains a routine to graphically print the state in the console and a destructor.
+        The position key is a Zobrist hash of everything the networks and the rules see of the position (board, player, castling, repetitions,
+        move number and counter to draw), used to merge the transpositions in the MCTS.
 
         @author: Massimiliano Chiappini 
         @contact: massimilianochiappini@gmail.com
@@ -23,6 +25,7 @@
 #include <string>
 #include <array>
 #include <unordered_map>
+#include <cstdint>
 
 
 
@@ -124,6 +127,9 @@ class ChessState {
 
     //Have the legal moves been computed yet?
     bool computedLegalMoves;
+
+    //Number of times the current board has been repeated (1, 2 or 3)
+    int countRepetitions(void);
     
     
     
@@ -162,6 +168,7 @@ class ChessState {
     std::vector<ChessMove> getLegalMoves(void);
     ChessBoard getBoard();
 	std::array<int,2> getKingPositions(void);
+    uint64_t getPositionKey(void);
   
 
     //MCTS FUNCTIONS
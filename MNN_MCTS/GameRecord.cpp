@@ -0,0 +1,358 @@
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include <zlib.h>
+#include "Chess.hpp"
+#include "MCTS.hpp"
+#include "TrainingSet.hpp"
+#include "GameRecord.hpp"
+#include "samples.h"
+
+
+//VARIABLE LENGTH INTEGERS
+static void putVarint(std::vector<unsigned char> &buffer, uint32_t value) {
+  while(value >= 0x80) {
+    buffer.push_back((unsigned char)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back((unsigned char)value);
+}
+
+static uint32_t getVarint(const unsigned char *&p, const unsigned char *end) {
+  uint32_t value = 0;
+  int shift = 0;
+
+  while(true) {
+    if((p == end) || (shift > 28)) {
+      throw std::runtime_error("Corrupted game record.");
+    }
+    unsigned char byte = *(p++);
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    if((byte & 0x80) == 0) {
+      return value;
+    }
+    shift += 7;
+  }
+}
+
+
+
+
+//GAME RECORD
+GameRecord::GameRecord(void) : winner(0), termination(GAME_PLAYED) { }
+
+void GameRecord::addPosition(std::vector<int> &visits, int move) {
+  this->visits.push_back(visits);
+  this->moves.push_back(move);
+}
+
+int GameRecord::getNumberOfPositions(void) {
+  return this->moves.size();
+}
+
+void GameRecord::clear(void) {
+  this->moves.clear();
+  this->visits.clear();
+  this->winner = 0;
+  this->termination = GAME_PLAYED;
+}
+
+
+
+
+//GAME RECORD WRITER
+//CONSTRUCTORS
+GameRecordWriter::GameRecordWriter(std::string fileName, int compression) : fileName(fileName), compression(compression), async(NULL), games(0), bytes(0), compressedBytes(0) {
+  //The games are appended only to a file of the same version, which the reader parses with the layout given by its header
+  if((this->file = fopen(fileName.c_str(), "rb")) != NULL) {
+    uint32_t header[2];
+    size_t read = fread(header, sizeof(uint32_t), 2, this->file);
+
+    fclose(this->file);
+    if(read != 0) {
+      if((read != 2) || (header[0] != GAME_RECORD_MAGIC)) {
+        throw std::runtime_error(fileName + " is not a file of game records.");
+      }
+      if(header[1] != GAME_RECORD_VERSION) {
+        throw std::runtime_error(fileName + " holds game records of version " + std::to_string(header[1]) + " instead of " + std::to_string(GAME_RECORD_VERSION) + ": replay or move it before writing new games.");
+      }
+    }
+  }
+
+  if((this->file = fopen(fileName.c_str(), "ab")) == NULL) {
+    throw std::runtime_error("Error opening the file " + fileName + " of the game records.");
+  }
+
+  //A new file starts with its header, otherwise the games are appended
+  fseek(this->file, 0, SEEK_END);
+  if(ftell(this->file) == 0) {
+    uint32_t header[2] = {GAME_RECORD_MAGIC, GAME_RECORD_VERSION};
+    fwrite(header, sizeof(uint32_t), 2, this->file);
+  }
+}
+
+GameRecordWriter::GameRecordWriter(std::string fileName) : GameRecordWriter(fileName, GAME_RECORD_COMPRESSION) { }
+
+
+//SET/GET methods
+std::string GameRecordWriter::getFileName(void) {
+  return this->fileName;
+}
+
+long GameRecordWriter::getNumberOfGames(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->games;
+}
+
+double GameRecordWriter::getCompressionRatio(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  if(this->compressedBytes == 0) {
+    return 1.;
+  }
+  return (double)this->bytes / this->compressedBytes;
+}
+
+void GameRecordWriter::setAsyncWriter(AsyncWriter *async) {
+  this->async = async;
+}
+
+
+//OUTPUT
+void GameRecordWriter::write(GameRecord &record) {
+  if(this->async != NULL) {
+    GameRecord *copy = new GameRecord(record);
+
+    this->async->submit([this, copy]() {
+      this->append(*copy);
+      delete copy;
+    });
+  }
+  else {
+    this->append(record);
+  }
+}
+
+void GameRecordWriter::append(GameRecord &record) {
+  std::vector<unsigned char> payload;
+
+  payload.push_back((unsigned char)((record.winner + 1) | (record.termination << 2)));
+  putVarint(payload, record.getNumberOfPositions());
+  for(int i=0;i<record.getNumberOfPositions();i++) {
+    putVarint(payload, record.visits[i].size());
+    putVarint(payload, record.moves[i]);
+    for(int j=0;j<record.visits[i].size();j++) {
+      putVarint(payload, record.visits[i][j]);
+    }
+  }
+
+  uint32_t rawSize = payload.size();
+
+  //The compressed payload is kept only when it is smaller
+  if(this->compression > 0) {
+    uLongf compressedSize = compressBound(payload.size());
+    std::vector<unsigned char> compressed(compressedSize);
+
+    if((compress2(&(compressed[0]), &compressedSize, &(payload[0]), payload.size(), this->compression) == Z_OK) && (compressedSize < payload.size())) {
+      compressed.resize(compressedSize);
+      payload.swap(compressed);
+    }
+  }
+
+  uint32_t size = payload.size();
+  uint32_t checksum = crc32_update(0, &(payload[0]), payload.size());
+
+  //The game is appended as a whole
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->buffer.insert(this->buffer.end(), (unsigned char*)&size, (unsigned char*)&size + sizeof(uint32_t));
+  this->buffer.insert(this->buffer.end(), (unsigned char*)&rawSize, (unsigned char*)&rawSize + sizeof(uint32_t));
+  this->buffer.insert(this->buffer.end(), payload.begin(), payload.end());
+  this->buffer.insert(this->buffer.end(), (unsigned char*)&checksum, (unsigned char*)&checksum + sizeof(uint32_t));
+  this->games++;
+  this->bytes += rawSize;
+  this->compressedBytes += size;
+
+  if(this->buffer.size() >= GAME_RECORD_BUFFER_SIZE) {
+    this->flushBuffer();
+  }
+}
+
+void GameRecordWriter::flush(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->flushBuffer();
+}
+
+void GameRecordWriter::flushBuffer(void) {
+  if(this->buffer.size() == 0) {
+    return;
+  }
+
+  if(fwrite(&(this->buffer[0]), 1, this->buffer.size(), this->file) != this->buffer.size()) {
+    throw std::runtime_error("Error writing the game records in " + this->fileName + ".");
+  }
+  fflush(this->file);
+  this->buffer.clear();
+}
+
+
+//DESTRUCTOR
+GameRecordWriter::~GameRecordWriter(void) {
+  this->flushBuffer();
+  fclose(this->file);
+}
+
+
+
+
+//GAME RECORD READER
+//CONSTRUCTORS
+GameRecordReader::GameRecordReader(std::string fileName) : fileName(fileName) {
+  uint32_t header[2];
+
+  if((this->file = fopen(fileName.c_str(), "rb")) == NULL) {
+    throw std::runtime_error("Error opening the file " + fileName + " of the game records.");
+  }
+  if((fread(header, sizeof(uint32_t), 2, this->file) != 2) || (header[0] != GAME_RECORD_MAGIC)) {
+    fclose(this->file);
+    throw std::runtime_error(fileName + " is not a file of game records.");
+  }
+  //The games of the first version are not compressed
+  if((header[1] < 1) || (header[1] > GAME_RECORD_VERSION)) {
+    fclose(this->file);
+    throw std::runtime_error(fileName + " has an unknown version of the game records.");
+  }
+  this->version = header[1];
+}
+
+
+//INPUT
+bool GameRecordReader::next(GameRecord &record) {
+  uint32_t size, rawSize, checksum;
+
+  if(fread(&size, sizeof(uint32_t), 1, this->file) != 1) {
+    return false;
+  }
+  rawSize = size;
+  if((this->version > 1) && (fread(&rawSize, sizeof(uint32_t), 1, this->file) != 1)) {
+    throw std::runtime_error("Truncated game record in " + this->fileName + ".");
+  }
+
+  std::vector<unsigned char> payload(size);
+  if((size == 0) || (fread(&(payload[0]), 1, size, this->file) != size) || (fread(&checksum, sizeof(uint32_t), 1, this->file) != 1)) {
+    throw std::runtime_error("Truncated game record in " + this->fileName + ".");
+  }
+  if(crc32_update(0, &(payload[0]), size) != checksum) {
+    throw std::runtime_error("Wrong checksum of a game record in " + this->fileName + ".");
+  }
+
+  if(rawSize != size) {
+    uLongf uncompressedSize = rawSize;
+    std::vector<unsigned char> uncompressed(rawSize);
+
+    if((uncompress(&(uncompressed[0]), &uncompressedSize, &(payload[0]), size) != Z_OK) || (uncompressedSize != rawSize)) {
+      throw std::runtime_error("Corrupted game record in " + this->fileName + ".");
+    }
+    payload.swap(uncompressed);
+    size = rawSize;
+  }
+
+  const unsigned char *p = &(payload[0]);
+  const unsigned char *end = p + size;
+
+  record.clear();
+  //The games before the third version were never adjudicated
+  record.winner = (int)(*p & 3) - 1;
+  record.termination = (this->version >= 3) ? (int)(*p >> 2) : GAME_PLAYED;
+  p++;
+  int nPositions = getVarint(p, end);
+  for(int i=0;i<nPositions;i++) {
+    int nMoves = getVarint(p, end);
+    int move = getVarint(p, end);
+    std::vector<int> visits(nMoves);
+    for(int j=0;j<nMoves;j++) {
+      visits[j] = getVarint(p, end);
+    }
+    record.addPosition(visits, move);
+  }
+
+  return true;
+}
+
+
+//DESTRUCTOR
+GameRecordReader::~GameRecordReader(void) {
+  fclose(this->file);
+}
+
+
+
+
+//REPLAY
+//Probabilities to play the moves, as in Node::getPlayProbability
+std::vector<double> getPlayProbabilities(std::vector<int> &visits) {
+  std::vector<double> probabilities;
+  double Normalization1 = 0;
+  double Normalization2 = 0;
+
+  for(int i=0;i<visits.size();i++) {
+    Normalization1 += visits[i];
+  }
+  for(int i=0;i<visits.size();i++) {
+    probabilities.push_back(pow((visits[i] / Normalization1), (1. / MCTS_tau)));
+    Normalization2 += probabilities[i];
+  }
+  for(int i=0;i<visits.size();i++) {
+    probabilities[i] /= Normalization2;
+  }
+
+  return probabilities;
+}
+
+
+//Plays the game again, printing in the training set the samples of its positions and z
+void replayGame(GameRecord &record, TrainingSet *trainingSet) {
+  ChessState *state = new ChessState();
+  std::vector<int> players;
+
+  for(int i=0;i<record.getNumberOfPositions();i++) {
+    std::vector<ChessMove> legalMoves = state->getLegalMoves();
+
+    bool target = (record.visits[i].size() > 0);
+
+    if((target && (legalMoves.size() != record.visits[i].size())) || (record.moves[i] < 0) || (record.moves[i] >= legalMoves.size())) {
+      for(std::vector<ChessMove>::iterator move = legalMoves.begin(); move != legalMoves.end(); ++move) {
+        delete (*move).finalState;
+      }
+      delete state;
+      throw std::runtime_error("The game record does not match the legal moves of its positions.");
+    }
+
+    if(target) {
+      std::vector<double> probabilities = getPlayProbabilities(record.visits[i]);
+      trainingSet->printPosition(state, probabilities);
+    }
+    else {
+      trainingSet->printValuePosition(state);
+    }
+    players.push_back(state->getPlayer());
+
+    //Move to the position reached by the move played, the other ones are not needed
+    ChessState *nextState = legalMoves[record.moves[i]].finalState;
+    for(int j=0;j<legalMoves.size();j++) {
+      if(j != record.moves[i]) {
+        delete legalMoves[j].finalState;
+      }
+    }
+    delete state;
+    state = nextState;
+  }
+
+  delete state;
+
+  for(int i=0;i<players.size();i++) {
+    trainingSet->printZ((double)(players[i] * record.winner));
+  }
+}
@@ -0,0 +1,153 @@
+/*
+    GameRecord.hpp:
+        Library for the compact records of the self-play games.
+        A GameRecord stores only what the datasets of a game are made of: for each position the number of visits of its legal moves at the
+        root of the search and the move played, and the winner of the game. The positions, the inputs of the networks, their targets and z
+        are regenerated by replayGame, which plays the moves again through ChessState and prints the samples in a TrainingSet.
+
+        The records are appended to a binary file by a GameRecordWriter, shared by all the games of a run. After a header (magic number and
+        version), each game is stored as the size of its payload, the size of the payload before compression, the payload (compressed with
+        zlib when it is smaller) and its CRC32. The uncompressed payload holds the winner and how the game ended (in the same byte), the
+        number of positions and, for each position, the number of legal moves, the index of the move played and the visits of the legal
+        moves as variable length integers. A position recorded without visits is not a target of the probabilities (it was searched only
+        to play the game, see MCTS::setRecordTarget): when the game is replayed it gives only the sample of the value of the first network.
+        With an AsyncWriter, the records are encoded, compressed and written by its thread.
+        The games are appended to an existing file only if its header has the current version: a file of another version is refused.
+
+        @author: Massimiliano Chiappini
+        @contact: massimilianochiappini@gmail.com
+        @version: 0.2
+*/
+
+
+
+#ifndef GAMERECORD_HPP
+#define GAMERECORD_HPP
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+#include "Chess.hpp"
+#include "TrainingSet.hpp"
+#include "AsyncWriter.hpp"
+
+
+#define GAME_RECORD_MAGIC 0x524D4E4DU
+#define GAME_RECORD_VERSION 4
+#define GAME_RECORD_BUFFER_SIZE (1 << 20)
+#define GAME_RECORD_COMPRESSION 6
+
+//How a game ended: played until its final state or the limit of moves, resigned, adjudicated as a draw
+#define GAME_PLAYED 0
+#define GAME_RESIGNED 1
+#define GAME_DRAW_ADJUDICATED 2
+
+
+
+
+//GAME RECORD
+struct GameRecord {
+    //Index of the move played among the legal moves of each position
+    std::vector<int> moves;
+    //Visits of the legal moves of each position, in the order of ChessState::getLegalMoves (none if the position is not a target)
+    std::vector<std::vector<int>> visits;
+    //Winner of the game (1 white, -1 black, 0 draw or unfinished game)
+    int winner;
+    int termination;
+
+    GameRecord(void);
+
+    void addPosition(std::vector<int>&, int);
+    int getNumberOfPositions(void);
+    void clear(void);
+};
+
+
+
+
+//GAME RECORD WRITER
+class GameRecordWriter {
+  private:
+    FILE *file;
+    std::string fileName;
+    //zlib level (0 not to compress)
+    int compression;
+    //Background output (NULL to write in the calling thread)
+    AsyncWriter *async;
+
+    //Games not written yet
+    std::vector<unsigned char> buffer;
+    long games;
+    long bytes;
+    long compressedBytes;
+
+    std::mutex mutex;
+
+    void append(GameRecord&);
+    void flushBuffer(void);
+
+
+  public:
+    //CONSTRUCTORS
+    GameRecordWriter(std::string, int);
+    GameRecordWriter(std::string);
+
+    GameRecordWriter(const GameRecordWriter&) = delete;
+    GameRecordWriter& operator=(const GameRecordWriter&) = delete;
+
+
+    //SET/GET methods
+    std::string getFileName(void);
+    long getNumberOfGames(void);
+    double getCompressionRatio(void);
+    void setAsyncWriter(AsyncWriter*);
+
+
+    //OUTPUT
+    void write(GameRecord&);
+    void flush(void);
+
+
+    //DESTRUCTOR
+    ~GameRecordWriter(void);
+};
+
+
+
+
+//GAME RECORD READER
+class GameRecordReader {
+  private:
+    FILE *file;
+    std::string fileName;
+    int version;
+
+
+  public:
+    //CONSTRUCTORS
+    GameRecordReader(std::string);
+
+    GameRecordReader(const GameRecordReader&) = delete;
+    GameRecordReader& operator=(const GameRecordReader&) = delete;
+
+
+    //INPUT
+    //Returns false when all the games have been read
+    bool next(GameRecord&);
+
+
+    //DESTRUCTOR
+    ~GameRecordReader(void);
+};
+
+
+
+
+//REPLAY
+std::vector<double> getPlayProbabilities(std::vector<int>&);
+void replayGame(GameRecord&, TrainingSet*);
+
+
+#endif
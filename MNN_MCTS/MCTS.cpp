@@ -1,26 +1,155 @@
 #include <vector>
+#include <algorithm>
 #include <random>
 #include <stdexcept>
 #include <cmath>
 #include <cfloat>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <chrono>
+#include <sstream>
 #include "Chess.hpp"
 #include "Tree.hpp"
+#include "Pipeline.hpp"
+#include "TrainingSet.hpp"
+#include "GameRecord.hpp"
 #include "MCTS.hpp"
 #include "net.h"
+#include "Profiler.hpp"
 
 
 #define DEBUG_MODE 0
 
 
-MCTS::MCTS(Tree tree, bool toTrain) : tree(tree), toTrain(toTrain) { }
+SearchLimits::SearchLimits(double maxTime, int maxSweeps, long maxNodes, bool earlyStop) : maxTime(maxTime), maxSweeps(maxSweeps), maxNodes(maxNodes), earlyStop(earlyStop) { }
 
-MCTS::MCTS(Tree tree) : tree(tree), toTrain(false) { }
+SearchLimits::SearchLimits(double maxTime, int maxSweeps, long maxNodes) : SearchLimits(maxTime, maxSweeps, maxNodes, true) { }
 
-MCTS::MCTS(ChessState *state, NN *net1, std::array<NN*, 6> nets2, bool toTrain) : tree(Tree(state, net1, nets2)), toTrain(toTrain) { }
+SearchLimits::SearchLimits(void) : SearchLimits(0., MCTS_NUMBER_OF_SWEEPS, 0, true) { }
 
-MCTS::MCTS(ChessState *state, NN *net1, std::array<NN*, 6> nets2) : tree(Tree(state, net1, nets2)), toTrain(false) { }
+
+SearchStatistics::SearchStatistics(void) : sweeps(0), nodes(0), elapsedTime(0.), sweepsPerSecond(0.), bestVisits(0), secondVisits(0), stoppedEarly(false), rootValue(0.) { }
+
+
+AdjudicationRules::AdjudicationRules(double resignThreshold, int resignMoves, double noResignFraction, double drawThreshold, int drawMoves, int drawAfterMove) : resignThreshold(resignThreshold), resignMoves(resignMoves), noResignFraction(noResignFraction), drawThreshold(drawThreshold), drawMoves(drawMoves), drawAfterMove(drawAfterMove) { }
+
+AdjudicationRules::AdjudicationRules(void) : AdjudicationRules(MCTS_RESIGN_THRESHOLD, MCTS_RESIGN_MOVES, MCTS_NO_RESIGN_FRACTION, MCTS_DRAW_THRESHOLD, MCTS_DRAW_MOVES, MCTS_DRAW_AFTER_MOVE) { }
+
+
+//Whether the game is played without resignations depends only on the seed
+Adjudicator::Adjudicator(AdjudicationRules rules, unsigned int seed) : rules(rules), drawValues(0), winner(0), termination(GAME_PLAYED), wouldResign(0) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<double> distribution(0., 1.);
+
+  this->noResign = (rules.resignMoves > 0) && (distribution(generator) < rules.noResignFraction);
+  this->lowValues[0] = 0;
+  this->lowValues[1] = 0;
+}
+
+bool Adjudicator::update(int player, double value, int move) {
+  int index = (player == 1) ? 0 : 1;
+
+  //Resignation of the player to move
+  if(this->rules.resignMoves > 0) {
+    if(value < -this->rules.resignThreshold) {
+      this->lowValues[index]++;
+    }
+    else {
+      this->lowValues[index] = 0;
+    }
+
+    if(this->lowValues[index] >= this->rules.resignMoves) {
+      if(this->noResign == false) {
+        this->winner = -player;
+        this->termination = GAME_RESIGNED;
+        return true;
+      }
+      if(this->wouldResign == 0) {
+        this->wouldResign = player;
+      }
+    }
+  }
+
+  //Draw of a long, balanced game
+  if(this->rules.drawMoves > 0) {
+    if((move >= this->rules.drawAfterMove) && (fabs(value) < this->rules.drawThreshold)) {
+      this->drawValues++;
+    }
+    else {
+      this->drawValues = 0;
+    }
+
+    if(this->drawValues >= this->rules.drawMoves) {
+      this->winner = 0;
+      this->termination = GAME_DRAW_ADJUDICATED;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Adjudicator::isNoResignGame(void) {
+  return this->noResign;
+}
+
+int Adjudicator::getWinner(void) {
+  return this->winner;
+}
+
+int Adjudicator::getTermination(void) {
+  return this->termination;
+}
+
+int Adjudicator::getWouldResign(void) {
+  return this->wouldResign;
+}
+
+
+AdjudicationStatistics::AdjudicationStatistics(void) : games(0), resigned(0), drawsAdjudicated(0), noResignGames(0), wouldResign(0), falsePositives(0) { }
+
+void AdjudicationStatistics::add(Adjudicator &adjudicator, int winner) {
+  this->games++;
+  if(adjudicator.getTermination() == GAME_RESIGNED) {
+    this->resigned++;
+  }
+  else if(adjudicator.getTermination() == GAME_DRAW_ADJUDICATED) {
+    this->drawsAdjudicated++;
+  }
+
+  //A resignation would have been wrong if the player who would have resigned did not lose
+  if(adjudicator.isNoResignGame() == true) {
+    this->noResignGames++;
+    if(adjudicator.getWouldResign() != 0) {
+      this->wouldResign++;
+      if(winner != -adjudicator.getWouldResign()) {
+        this->falsePositives++;
+      }
+    }
+  }
+}
+
+std::string AdjudicationStatistics::getSummary(void) {
+  std::ostringstream summary;
+
+  summary << "Adjudication: " << this->resigned << " of " << this->games << " games resigned, " << this->drawsAdjudicated << " adjudicated as draws; ";
+  summary << this->falsePositives << " wrong resignations out of " << this->wouldResign << " in " << this->noResignGames << " games played without resignations.\n";
+
+  return summary.str();
+}
+
+
+MCTS::MCTS(Tree tree, bool toTrain) : tree(tree), toTrain(toTrain), trainingSet(NULL), ownsTrainingSet(false), recorder(NULL), recordTarget(true), evaluator(NULL), ownsEvaluator(false), evaluatedLeaves(NULL), collisions(0) { }
+
+MCTS::MCTS(Tree tree) : tree(tree), toTrain(false), trainingSet(NULL), ownsTrainingSet(false), recorder(NULL), recordTarget(true), evaluator(NULL), ownsEvaluator(false), evaluatedLeaves(NULL), collisions(0) { }
+
+MCTS::MCTS(ChessState *state, NN *net1, std::array<NN*, 6> nets2, bool toTrain) : tree(Tree(state, net1, nets2)), toTrain(toTrain), trainingSet(NULL), ownsTrainingSet(false), recorder(NULL), recordTarget(true), evaluator(NULL), ownsEvaluator(false), evaluatedLeaves(NULL), collisions(0) { }
+
+MCTS::MCTS(ChessState *state, NN *net1, std::array<NN*, 6> nets2) : tree(Tree(state, net1, nets2)), toTrain(false), trainingSet(NULL), ownsTrainingSet(false), recorder(NULL), recordTarget(true), evaluator(NULL), ownsEvaluator(false), evaluatedLeaves(NULL), collisions(0) { }
+
+//The random generator of the tree is seeded explicitly, for games played concurrently or to be reproduced
+MCTS::MCTS(ChessState *state, NN *net1, std::array<NN*, 6> nets2, bool toTrain, unsigned int seed) : tree(Tree(state, net1, nets2, seed)), toTrain(toTrain), trainingSet(NULL), ownsTrainingSet(false), recorder(NULL), recordTarget(true), evaluator(NULL), ownsEvaluator(false), evaluatedLeaves(NULL), collisions(0) { }
 
 
 Tree MCTS::getTree(void) {
@@ -28,9 +157,47 @@ Tree MCTS::getTree(void) {
 }
 
 
+//The pruned branches will be freed by the collector instead of the thread playing the moves
+void MCTS::setCollector(BranchCollector *collector) {
+  this->tree.setCollector(collector);
+}
+
+
+//The datasets are collected in the given training set instead of one owned by the MCTS
+void MCTS::setTrainingSet(TrainingSet *trainingSet) {
+  if(this->ownsTrainingSet == true) {
+    delete this->trainingSet;
+  }
+
+  this->trainingSet = trainingSet;
+  this->ownsTrainingSet = false;
+}
+
+void MCTS::setGameRecorder(GameRecordWriter *recorder) {
+  this->recorder = recorder;
+}
+
+//Unless one has been given, the datasets go to a training set writing in the TrainingSet directory
+TrainingSet* MCTS::getTrainingSet(void) {
+  if(this->trainingSet == NULL) {
+    this->trainingSet = new TrainingSet();
+    this->ownsTrainingSet = true;
+  }
+
+  return this->trainingSet;
+}
+
+
+//Merge the positions reached through different move orders
+void MCTS::enableTranspositions(void) {
+  this->tree.enableTranspositions();
+}
+
+
 //In the selection step, a path along the tree is followed through the states of highest UCT until a leaf is reached. The pointer to the (most promising) leaf is returned.
 Node* MCTS::selection(Node* currentNode) {
   //std::cout << "Selection.\n";
+  PROFILE_PHASE(PHASE_SELECTION);
   Node* nextNode;
   
   //Until a leaf is not reached
@@ -48,6 +215,7 @@ Node* MCTS::selection(Node* currentNode) {
 //In the expansion, the tree is eventually expanded 
 void MCTS::expansion(Node* currentNode) {
   //std::cout << "Expansion.\n";
+  PROFILE_PHASE(PHASE_EXPANSION);
   //The current node is a leaf state.
   //If it is a final state, nothing is done
   if(currentNode->getState()->isFinalState() == false) {
@@ -59,14 +227,12 @@ void MCTS::expansion(Node* currentNode) {
 
 //The result of the simulation from the leaf is backpropagated across the tree
 void MCTS::backPropagation(Node* currentNode) {
-  std::vector<double> netOutput;
+  PROFILE_PHASE(PHASE_BACKPROPAGATION);
   double v;
     
   if(currentNode->getState()->isFinalState() == false) {
-    std::vector<double> firstNetworkInput = currentNode->getState()->getFirstNetworkInput();
-    std::vector<double> p1 = std::vector<double>(get_output_size(this->tree.getNetwork1()), 0.);
-    predict(this->tree.getNetwork1(), &(firstNetworkInput[0]), &(p1[0]));
-    v = p1[get_output_size(this->tree.getNetwork1()) - 1];
+    //The value has already been given by the network during the expansion
+    v = currentNode->getValue();
   }
   else {
     v = currentNode->getPlayer() * currentNode->getState()->getWinner();
@@ -114,15 +280,251 @@ void MCTS::sweep(void) {
 }
 
 
+//Visits of the two most visited children of the root
+void MCTS::countRootVisits(int &best, int &second) {
+  std::vector<Node*> children = this->tree.getRoot()->getChildren();
+
+  best = 0;
+  second = 0;
+  for(std::vector<Node*>::iterator child = children.begin(); child != children.end(); ++child) {
+    if((*child)->getNumberOfVisits() > best) {
+      second = best;
+      best = (*child)->getNumberOfVisits();
+    }
+    else if((*child)->getNumberOfVisits() > second) {
+      second = (*child)->getNumberOfVisits();
+    }
+  }
+}
+
+
+//Performs sweeps until a limit is reached or until the most visited move at the root is decided
+SearchStatistics MCTS::search(SearchLimits limits) {
+  SearchStatistics statistics;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  long startingNodes = this->tree.getNumberOfCreatedNodes();
+
+  if((limits.maxTime <= 0) && (limits.maxSweeps <= 0) && (limits.maxNodes <= 0)) {
+    throw std::runtime_error("Search requested without any limit.");
+  }
+
+  while(true) {
+    //Perform the sweeps up to the next check
+    int nSweeps = MCTS_CHECK_INTERVAL;
+    if((limits.maxSweeps > 0) && ((limits.maxSweeps - statistics.sweeps) < nSweeps)) {
+      nSweeps = limits.maxSweeps - statistics.sweeps;
+    }
+
+    if(this->evaluator != NULL) {
+      this->pipelinedSweeps(nSweeps);
+    }
+    else {
+      for(int i=0;i<nSweeps;i++) {
+        this->sweep();
+      }
+    }
+    statistics.sweeps += nSweeps;
+    statistics.nodes = this->tree.getNumberOfCreatedNodes() - startingNodes;
+    statistics.elapsedTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    //Check the limits
+    if((limits.maxSweeps > 0) && (statistics.sweeps >= limits.maxSweeps)) {
+      break;
+    }
+    if((limits.maxNodes > 0) && (statistics.nodes >= limits.maxNodes)) {
+      break;
+    }
+    if((limits.maxTime > 0) && (statistics.elapsedTime >= limits.maxTime)) {
+      break;
+    }
+
+    //Sweeps that can still be performed within the limits
+    double remainingSweeps = DBL_MAX;
+    if(limits.maxSweeps > 0) {
+      remainingSweeps = limits.maxSweeps - statistics.sweeps;
+    }
+    if((limits.maxTime > 0) && (statistics.elapsedTime > 0)) {
+      remainingSweeps = std::min(remainingSweeps, (limits.maxTime - statistics.elapsedTime) * statistics.sweeps / statistics.elapsedTime);
+    }
+
+    //If the most visited move cannot be overtaken anymore, there is no point in going on
+    if(limits.earlyStop) {
+      int best, second;
+      int nChildren = this->tree.getRoot()->getNumberOfChildren();
+      this->countRootVisits(best, second);
+
+      if(((nChildren == 1) || ((best - second) > remainingSweeps)) && (nChildren > 0)) {
+        statistics.stoppedEarly = true;
+        break;
+      }
+    }
+  }
+
+  //Final statistics, the action of the root is the one of the player who moved to it
+  this->countRootVisits(statistics.bestVisits, statistics.secondVisits);
+  if(this->tree.getRoot()->getNumberOfVisits() > 0) {
+    statistics.rootValue = -this->tree.getRoot()->getMeanAction();
+  }
+  if(statistics.elapsedTime > 0) {
+    statistics.sweepsPerSecond = statistics.sweeps / statistics.elapsedTime;
+  }
+  PROFILE_SEARCH(statistics.sweeps, statistics.nodes, statistics.elapsedTime);
+
+  return statistics;
+}
+
+
+//PIPELINED MCTS
+//The networks are evaluated by a pool of threads owned by this MCTS
+void MCTS::enablePipeline(int nEvaluators, int batchSize) {
+  this->enablePipeline(new LeafEvaluator(nEvaluators, batchSize));
+  this->ownsEvaluator = true;
+}
+
+//The networks are evaluated by a pool of threads, possibly shared with other MCTS
+void MCTS::enablePipeline(LeafEvaluator *evaluator) {
+  if(this->ownsEvaluator == true) {
+    delete this->evaluator;
+  }
+  if(this->evaluatedLeaves == NULL) {
+    this->evaluatedLeaves = new LockFreeQueue<LeafEvaluation*>(PIPELINE_QUEUE_SIZE);
+  }
+
+  this->evaluator = evaluator;
+  this->ownsEvaluator = false;
+}
+
+
+//Performs nSweeps sweeps, keeping up to MCTS_MAX_IN_FLIGHT leaves in the evaluation queue while the tree is traversed
+void MCTS::pipelinedSweeps(int nSweeps) {
+  int launched = 0;
+  int completed = 0;
+  int inFlight = 0;
+  Node* root = this->tree.getRoot();
+  LeafEvaluation *evaluation;
+
+  if(this->evaluator == NULL) {
+    throw std::runtime_error("Pipelined sweeps requested without an evaluator.");
+  }
+
+  while(completed < nSweeps) {
+    //Selection: push new leaves until the queue is full or a pending leaf is selected again
+    while((launched < nSweeps) && (inFlight < MCTS_MAX_IN_FLIGHT)) {
+      Node* leaf = this->selection(root);
+
+      if(leaf->isPending()) {
+        //Wait for the evaluations already queued before selecting again
+        this->collisions++;
+        break;
+      }
+
+      launched++;
+
+      //Final states do not need the networks
+      if(leaf->getState()->isFinalState()) {
+        this->backPropagation(leaf);
+        completed++;
+        continue;
+      }
+
+      //Apply the virtual loss along the path, and send the leaf to the evaluators
+      for(Node* node = leaf; node != root; node = node->getParent()) {
+        node->addVirtualLoss(MCTS_VIRTUAL_LOSS);
+      }
+      leaf->setPending(true);
+
+      EvaluationRequest request;
+      request.evaluation = new LeafEvaluation(leaf);
+      request.replyTo = this->evaluatedLeaves;
+      this->evaluator->submit(request);
+      inFlight++;
+    }
+
+    //Expansion and backpropagation of the leaves evaluated in the meanwhile
+    bool progress = false;
+    while(this->evaluatedLeaves->pop(evaluation)) {
+      Node* leaf = evaluation->leaf;
+
+      for(Node* node = leaf; node != root; node = node->getParent()) {
+        node->revertVirtualLoss(MCTS_VIRTUAL_LOSS);
+      }
+      leaf->setPending(false);
+
+      leaf->buildChildren(evaluation);
+      this->backPropagation(leaf);
+
+      delete evaluation;
+      inFlight--;
+      completed++;
+      progress = true;
+    }
+
+    //Sleep until an evaluated leaf comes back
+    if((progress == false) && (inFlight > 0)) {
+      this->evaluatedLeaves->waitUntil(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(PIPELINE_IDLE_WAIT)));
+    }
+  }
+}
+
+
+int MCTS::getNumberOfCollisions(void) {
+  return this->collisions;
+}
+
+
+//The position of the next move played is a target for the networks, or it was searched only to play the game
+void MCTS::setRecordTarget(bool recordTarget) {
+  this->recordTarget = recordTarget;
+}
+
+
+//Print the input and target output for the networks of the root, or only the input of the first network for its value if the
+//root is not a target
+void MCTS::printDatasets(void) {
+  if(this->toTrain == false) {
+    return;
+  }
+
+  if(this->recordTarget == true) {
+    this->tree.getRoot()->printNetworkDatasets(this->getTrainingSet());
+  }
+  else {
+    this->getTrainingSet()->printValuePosition(this->tree.getRoot()->getState());
+  }
+}
+
+
+//Records the visits of the moves from the root and the move played
+void MCTS::recordMove(Node *moveToPlay) {
+  if(this->recorder == NULL) {
+    return;
+  }
+
+  //The positions which are not targets are recorded without visits, only to replay the game
+  if(this->recordTarget == false) {
+    std::vector<int> noVisits;
+    this->record.addPosition(noVisits, moveToPlay->getMoveIndex());
+    return;
+  }
+
+  //The visits are stored in the order of the legal moves, from which the children are built
+  std::vector<Node*> children = this->tree.getRoot()->getChildren();
+  std::vector<int> visits(this->tree.getRoot()->getState()->getLegalMoves().size(), 0);
+  for(int i=0;i<children.size();i++) {
+    visits[children[i]->getMoveIndex()] = children[i]->getNumberOfVisits();
+  }
+
+  this->record.addPosition(visits, moveToPlay->getMoveIndex());
+}
+
+
 //Force to play a move (typically, a move played by the opponent in his turn)
 void MCTS::playMove(ChessState *state) {
-  if(this->toTrain == true) {
-  	//Print the input and target output for the network
-  	this->tree.getRoot()->printNetworkDatasets();
-  }
+  this->printDatasets();
 
   //Look for the move to play in all the children of the current state
   Node* moveToPlay = this->tree.getRoot()->getChildByState(state);
+  this->recordMove(moveToPlay);
   //Prune the other branches
   this->tree.getRoot()->pruneOtherBranches(moveToPlay);
   //Play the move
@@ -132,13 +534,11 @@ void MCTS::playMove(ChessState *state) {
 
 //Play the best move given the current exploration of the tree
 ChessState* MCTS::playBestMove(void) {
-  if(this->toTrain == true) {
-  	//Print the input and target output for the network
-  	this->tree.getRoot()->printNetworkDatasets();
-  }
+  this->printDatasets();
 
   //Pick the child node to play of the current root, and select it as the new root
   Node* moveToPlay = this->tree.getRoot()->getChildToPlay();
+  this->recordMove(moveToPlay);
 
   if(DEBUG_MODE) {
   	std::cout << "Making the move n. " << moveToPlay->getId() << " of the piece " << moveToPlay->getPiece() << " in square " << moveToPlay->getStartingSquare() << ".\n\n";
@@ -154,13 +554,11 @@ ChessState* MCTS::playBestMove(void) {
 
 //Plays a random move 
 ChessState* MCTS::playRandomMove(void) {
-  if(this->toTrain == true) {
-  	//Print the input and target output for the network
-  	this->tree.getRoot()->printNetworkDatasets();
-  }
+  this->printDatasets();
 
   //Pick the best child node of the current root, and select it as the new root
   Node* moveToPlay = this->tree.getRoot()->getRandomChild();
+  this->recordMove(moveToPlay);
 
   if(DEBUG_MODE) {
   	std::cout << "Making the move n. " << moveToPlay->getId() << " of the piece " << moveToPlay->getPiece() << " in square " << moveToPlay->getStartingSquare() << ".\n\n";
@@ -176,10 +574,7 @@ ChessState* MCTS::playRandomMove(void) {
 
 //Play the move explored with highest frequency
 ChessState* MCTS::playHighestFrequencyMove(void) {
-  if(this->toTrain == true) {
-  	//Print the input and target output for the network
-  	this->tree.getRoot()->printNetworkDatasets();
-  }
+  this->printDatasets();
    
 
   std::vector<Node*> children = this->tree.getRoot()->getChildren();
@@ -190,6 +585,7 @@ ChessState* MCTS::playHighestFrequencyMove(void) {
       moveToPlay = children[i];
     }
   }
+  this->recordMove(moveToPlay);
 
   if(DEBUG_MODE) {
   	std::cout << "Making the move n. " << moveToPlay->getId() << " of the piece " << moveToPlay->getPiece() << " in square " << moveToPlay->getStartingSquare() << ".\n\n";
@@ -204,12 +600,24 @@ ChessState* MCTS::playHighestFrequencyMove(void) {
 
 
 void MCTS::printBoardEvaluations(void) {
-  std::ofstream zfile;
-    
-  zfile.open("TrainingSet/z.dat", std::ios::out | std::ios::app);
+  this->printBoardEvaluations(this->tree.getRoot()->getState()->getWinner(), GAME_PLAYED);
+}
 
+//The game may have been adjudicated before its final state: z is given by the adjudicated winner
+void MCTS::printBoardEvaluations(int w, int termination) {
   Node* currentState = this->tree.getRoot();
-  int w = currentState->getState()->getWinner();
+
+  if(this->recorder != NULL) {
+    this->record.winner = w;
+    this->record.termination = termination;
+    this->recorder->write(this->record);
+    this->record.clear();
+  }
+  if(this->toTrain == false) {
+    return;
+  }
+
+  TrainingSet *trainingSet = this->getTrainingSet();
 
   std::vector<int> z;
   z.push_back(currentState->getPlayer() * w);
@@ -219,13 +627,25 @@ void MCTS::printBoardEvaluations(void) {
   }
 
   for(int i=(z.size() - 1);i>0;i--) {
-    zfile << (double)z[i] << "\n";
+    trainingSet->printZ((double)z[i]);
   }
-  
-  zfile.close();
+
+  //The game is over: write its datasets
+  trainingSet->flush();
 }
 
 
 MCTS::~MCTS(void) {
   this->getTree().deleteTree();
+  this->tree.disableTranspositions();
+
+  if(this->ownsEvaluator == true) {
+    delete this->evaluator;
+  }
+  if(this->evaluatedLeaves != NULL) {
+    delete this->evaluatedLeaves;
+  }
+  if(this->ownsTrainingSet == true) {
+    delete this->trainingSet;
+  }
 }
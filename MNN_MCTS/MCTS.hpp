@@ -7,7 +7,24 @@
             - Expansion: the children fo the current leaf are created, expanding the tree.
             - Backpropagation: The evaluation of the current state by the neural network is backpropagated along the tree.
 
+        In the pipelined mode (enablePipeline), the sweeps push their leaves to a pool of evaluator threads (see Pipeline.hpp) instead of
+        evaluating them, using a virtual loss to diversify the paths, and complete the expansion and backpropagation when the results come back.
+
+        The routine search performs sweeps until one of the limits (time, sweeps, created nodes) is reached, or until the most visited move
+        at the root cannot be overtaken anymore with the sweeps left, and returns the statistics of the search.
+
         The routines playMove and playBestMove choose one of the possible moves from the current root and move the root of the tree.
+        When training, the datasets of the played moves are collected in a TrainingSet, written when the game ends (printBoardEvaluations).
+        With setRecordTarget(false) the next move is played without being a target (for example after a cheap search, in the playout
+        cap randomization of the self play): it gives only the sample of the value of the first network, with z as target and no
+        probabilities.
+        With a GameRecordWriter, the visits of the legal moves and the moves played are recorded instead, from which the datasets can be
+        regenerated later (see GameRecord.hpp).
+        An Adjudicator ends the self-play games whose outcome is already clear from the value of the root: the player to move resigns
+        when its value stays low for a few moves, and a long game whose value stays close to zero is declared a draw. A random fraction
+        of the games is played to the end anyway, to count how often a resignation would have been wrong.
+        The branches which are not played are deleted immediately, or handed to a BranchCollector if one is set (see Tree.hpp).
+        With enableTranspositions the tree becomes a DAG, in which the nodes of the same position share their statistics (see Tree.hpp).
 
         @author: Massimiliano Chiappini 
         @contact: massimilianochiappini@gmail.com
@@ -22,8 +39,15 @@
 
 #include "Chess.hpp"
 #include "Tree.hpp"
+#include "Pipeline.hpp"
+#include "TrainingSet.hpp"
+#include "GameRecord.hpp"
 #include "net.h"
 
+#include <random>
+#include <atomic>
+#include <string>
+
 
 #define MCTS_CP 1.414
 #define MCTS_tau 1.
@@ -35,12 +59,151 @@
 
 #define SECOND_NET_TRESHOLD 0.001
 
+//Number of sweeps between two checks of the limits of a search
+#define MCTS_CHECK_INTERVAL 16
+
+#define MCTS_VIRTUAL_LOSS 1.
+#define MCTS_MAX_IN_FLIGHT 32
+
+//Default rules of the adjudication
+#define MCTS_RESIGN_THRESHOLD 0.9
+#define MCTS_RESIGN_MOVES 3
+#define MCTS_NO_RESIGN_FRACTION 0.1
+#define MCTS_DRAW_THRESHOLD 0.05
+#define MCTS_DRAW_MOVES 40
+#define MCTS_DRAW_AFTER_MOVE 150
+
+
+//Limits of a search, a limit lower or equal to zero is not applied
+struct SearchLimits {
+    //Wall-clock time, in seconds
+    double maxTime;
+    int maxSweeps;
+    //Nodes created during the search
+    long maxNodes;
+    //Stop when the most visited move cannot be overtaken anymore
+    bool earlyStop;
+
+    //Constructors
+    SearchLimits(double, int, long, bool);
+    SearchLimits(double, int, long);
+    SearchLimits(void);
+};
+
+
+//Statistics of a search
+struct SearchStatistics {
+    int sweeps;
+    long nodes;
+    double elapsedTime;
+    double sweepsPerSecond;
+    //Visits of the two most visited moves at the root
+    int bestVisits;
+    int secondVisits;
+    //Did the search stop before hitting its limits
+    bool stoppedEarly;
+    //Value of the root for the player to move, from -1 to 1
+    double rootValue;
+
+    //Constructor
+    SearchStatistics(void);
+};
+
+
+//Rules to end a game before its final state, a number of moves lower or equal to zero disables the rule
+struct AdjudicationRules {
+    //The player to move resigns after resignMoves consecutive searches with a root value below -resignThreshold
+    double resignThreshold;
+    int resignMoves;
+    //Fraction of the games in which nobody resigns
+    double noResignFraction;
+    //Draw after drawMoves consecutive moves with a root value within drawThreshold from zero, from move drawAfterMove on
+    double drawThreshold;
+    int drawMoves;
+    int drawAfterMove;
+
+    //Constructors
+    AdjudicationRules(double, int, double, double, int, int);
+    AdjudicationRules(void);
+};
+
+
+//Adjudication of a game, updated after each full search (the values of the fast searches of the playout cap randomization are too noisy)
+class Adjudicator {
+  private:
+    AdjudicationRules rules;
+    //Is this one of the games played without resignations
+    bool noResign;
+
+    //Consecutive low values of each player (white, black) and consecutive values close to zero
+    int lowValues[2];
+    int drawValues;
+
+    int winner;
+    int termination;
+    //Player who would have resigned first in a game without resignations (0 if none)
+    int wouldResign;
+
+  public:
+    //CONSTRUCTORS
+    Adjudicator(AdjudicationRules, unsigned int);
+
+    //Returns true when the game is over: player to move, value of the root for it and number of the move
+    bool update(int, double, int);
+
+    bool isNoResignGame(void);
+    int getWinner(void);
+    int getTermination(void);
+    int getWouldResign(void);
+};
+
+
+//Outcomes of the adjudications of a run, shared by its games
+struct AdjudicationStatistics {
+    std::atomic<int> games;
+    std::atomic<int> resigned;
+    std::atomic<int> drawsAdjudicated;
+    //Games without resignations, in which someone would have resigned, and in which that player did not lose
+    std::atomic<int> noResignGames;
+    std::atomic<int> wouldResign;
+    std::atomic<int> falsePositives;
+
+    //Constructor
+    AdjudicationStatistics(void);
+
+    //Adds a game, with its final winner
+    void add(Adjudicator&, int);
+    std::string getSummary(void);
+};
+
 
 //Class which performs the Monte Carlo tree search
 class MCTS {
   private:
     Tree tree;
     bool toTrain;
+
+    //Datasets for the training of the networks
+    TrainingSet *trainingSet;
+    bool ownsTrainingSet;
+
+    //Compact record of the game
+    GameRecordWriter *recorder;
+    GameRecord record;
+
+    //Is the next move a target for the probabilities of the networks
+    bool recordTarget;
+
+    //Pipelined mode
+    LeafEvaluator *evaluator;
+    bool ownsEvaluator;
+    LockFreeQueue<LeafEvaluation*> *evaluatedLeaves;
+    int collisions;
+
+    void countRootVisits(int&, int&);
+    TrainingSet* getTrainingSet(void);
+    void printDatasets(void);
+    void recordMove(Node*);
   
   
   public:
@@ -49,10 +212,19 @@ class MCTS {
     MCTS(Tree);
     MCTS(ChessState*, NN*, std::array<NN*, 6>, bool);
     MCTS(ChessState*, NN*, std::array<NN*, 6>);
+    MCTS(ChessState*, NN*, std::array<NN*, 6>, bool, unsigned int);
 
 
     //SET/GET methods
     Tree getTree(void);
+
+    void setCollector(BranchCollector*);
+
+    void enableTranspositions(void);
+
+    void setTrainingSet(TrainingSet*);
+    void setGameRecorder(GameRecordWriter*);
+    void setRecordTarget(bool);
   
   
     //MCTS
@@ -64,6 +236,15 @@ class MCTS {
     
     void backPropagation(Node*);
 
+    SearchStatistics search(SearchLimits);
+
+
+    //Pipelined MCTS
+    void enablePipeline(int, int);
+    void enablePipeline(LeafEvaluator*);
+    void pipelinedSweeps(int);
+    int getNumberOfCollisions(void);
+
     
     //Gameplay
     void playMove(ChessState*);
@@ -74,6 +255,7 @@ class MCTS {
 
     //Network training
     void printBoardEvaluations(void);
+    void printBoardEvaluations(int, int);
 
 
     //Destructor
@@ -0,0 +1,315 @@
+//To be compiled as g++ -ffast-math -O3 -std=c++11 -pthread -o Orchestrator Orchestrator.cpp MCTS.cpp Tree.cpp Pipeline.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp net.c samples.c -lz
+//Usage: ./Orchestrator [number of threads] [generation of the current networks]
+
+//Long-running training loop, in which the self play never stops. The self-play threads play games with the current generation of
+//the networks and write their samples in the replay buffer (ReplayBuffer, see replay.h), tagged with the generation which played
+//them. Every SAMPLES_PER_GENERATION new samples of the first network, the main thread trains a new generation from the replay buffer
+//(trainGeneration) and tests it against the current one (Arena), while the self play goes on. A promoted generation replaces the
+//current one with an atomic swap of the shared networks: the games already started end with the networks they started with, which
+//are freed by the last of them, and the next games use the new ones.
+//The loop stops when the file STOP_FILE is created.
+
+#include "Chess.hpp"
+#include "Tree.hpp"
+#include "MCTS.hpp"
+#include "TrainingSet.hpp"
+#include "Pipeline.hpp"
+#include "AsyncWriter.hpp"
+#include "net.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <array>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <random>
+
+
+#define MAX_N_MOVES 400
+#define N_THREADS 8
+#define STOP_FILE "STOP"
+#define REPLAY_BUFFER_DIRECTORY "ReplayBuffer"
+
+//Limits of the search of each move, playout cap randomization and adjudication, as in ParallelSelfPlay
+#define MOVE_TIME 0.
+#define EARLY_STOP 0
+#define FULL_SEARCH_FRACTION 1
+#define FAST_SEARCH_SWEEPS 64
+#define ADJUDICATION 0
+
+//Evaluation of the leaves shared by all the games
+#define N_EVALUATORS 2
+#define EVALUATION_BATCH_SIZE 64
+#define EVALUATION_MAX_WAIT 0.001
+
+//New samples of the first network between two trainings, and threads and games of the arena matches
+#define SAMPLES_PER_GENERATION 200000
+#define ARENA_THREADS 4
+#define ARENA_GAMES 400
+
+//Play and train the multi-head network multi_network.txt, which replaces the seven networks (see multi_net in net.h and
+//trainGeneration multi), with MULTI_HEAD also in the Arena: its first head is the first network and the next ones the networks
+//of the pieces, which share the evaluations of its trunk
+#define MULTI_HEAD 0
+
+//Seconds between two checks of the main thread
+#define CHECK_INTERVAL 10
+
+//Pending writes of the AsyncWriter before the games wait for it
+#define ASYNC_QUEUE_SIZE 256
+
+
+const std::array<std::string,7> NETWORK_FILES = {"pieces", "pawn", "rook", "knight", "bishop", "queen", "king"};
+
+
+//Networks of a generation, shared by the games which use them: the heads of multi with MULTI_HEAD
+struct Generation {
+	int number;
+	NN* net1;
+	std::array<NN*, 6> nets2;
+	multi_net multi;
+
+	//Loads the networks <name>_network<suffix>.txt, or multi_network<suffix>.txt
+	Generation(int number, std::string suffix) : number(number) {
+		const int types[6] = {PAWN, ROOK, KNIGHT, BISHOP, QUEEN, KING};
+
+		if(MULTI_HEAD == 1) {
+			load_multi_net(&(this->multi), (char*)("multi_network" + suffix + ".txt").c_str());
+			if(this->multi.nheads != 7) {
+				printf("Error, the multi-head network has %d heads instead of 7.\n", this->multi.nheads);
+				exit(EXIT_FAILURE);
+			}
+			this->net1 = &(this->multi.heads[0]);
+			for(int i=0;i<6;i++) {
+				this->nets2[types[i]] = &(this->multi.heads[i + 1]);
+			}
+			return;
+		}
+		this->net1 = new NN();
+		load_net(this->net1, (char*)(NETWORK_FILES[0] + "_network" + suffix + ".txt").c_str());
+		for(int i=0;i<6;i++) {
+			this->nets2[types[i]] = new NN();
+			load_net(this->nets2[types[i]], (char*)(NETWORK_FILES[i + 1] + "_network" + suffix + ".txt").c_str());
+		}
+	}
+
+	//The weights are freed too, since the generations are swapped for the whole run
+	~Generation(void) {
+		if(MULTI_HEAD == 1) {
+			free_multi_net(&(this->multi));
+			return;
+		}
+		for(int i=0;i<6;i++) {
+			free_net(this->nets2[i]);
+			delete this->nets2[i];
+		}
+		free_net(this->net1);
+		delete this->net1;
+	}
+};
+
+
+//State shared by the threads
+struct OrchestratorContext {
+	//Current generation, swapped atomically (std::atomic_load/std::atomic_store)
+	std::shared_ptr<Generation> current;
+
+	SearchLimits limits;
+	SearchLimits fastLimits;
+	AdjudicationRules rules;
+	BranchCollector* collector;
+	LeafEvaluator* evaluator;
+	DatasetWriter* writer;
+	AsyncWriter* async;
+	unsigned int seed;
+
+	std::atomic<int> nextGame;
+	std::atomic<bool> stop;
+
+	std::ofstream monitor;
+	std::mutex outputMutex;
+};
+
+
+void log(OrchestratorContext *context, std::string line) {
+	std::lock_guard<std::mutex> lock(context->outputMutex);
+	std::cout << line;
+	context->monitor << line;
+	context->monitor.flush();
+}
+
+//Copies the networks <name>_network<from>.txt to <name>_network<to>.txt, or multi_network<from>.txt with MULTI_HEAD
+bool copyNetworks(std::string from, std::string to) {
+	for(int i=0;i<((MULTI_HEAD == 1) ? 1 : 7);i++) {
+		std::string name = (MULTI_HEAD == 1) ? "multi" : NETWORK_FILES[i];
+		std::ifstream source((name + "_network" + from + ".txt").c_str(), std::ios::binary);
+		std::ofstream destination((name + "_network" + to + ".txt").c_str(), std::ios::binary);
+		if((source.good() == false) || (destination.good() == false)) {
+			return false;
+		}
+		destination << source.rdbuf();
+	}
+
+	return true;
+}
+
+//Runs a command, returns its exit status (-1 if it did not exit normally)
+int runCommand(std::string command) {
+	int status = system(command.c_str());
+
+	if((status == -1) || (WIFEXITED(status) == 0)) {
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+
+//Loop of the self-play threads: play games with the current networks until the orchestrator stops
+void playGames(OrchestratorContext *context) {
+	while(context->stop == false) {
+		int game = context->nextGame++;
+		std::shared_ptr<Generation> generation = std::atomic_load(&(context->current));
+		ChessState* currentState = new ChessState();
+
+		MCTS* neoCortex = new MCTS(currentState, generation->net1, generation->nets2, true, context->seed + game);
+		neoCortex->setCollector(context->collector);
+		neoCortex->enablePipeline(context->evaluator);
+		TrainingSet* trainingSet = new TrainingSet(context->writer);
+		trainingSet->setAsyncWriter(context->async);
+		trainingSet->setGeneration(generation->number);
+		neoCortex->setTrainingSet(trainingSet);
+
+		std::mt19937 generator(context->seed + game + 1000000007U);
+		std::uniform_real_distribution<double> distribution(0., 1.);
+		Adjudicator adjudicator(context->rules, generator());
+
+		int Nmoves = 0;
+		while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
+			bool full = (distribution(generator) < FULL_SEARCH_FRACTION);
+			SearchStatistics statistics = neoCortex->search(full ? context->limits : context->fastLimits);
+			neoCortex->setRecordTarget(full);
+			if(full && adjudicator.update(currentState->getPlayer(), statistics.rootValue, Nmoves) == true) {
+				break;
+			}
+
+			currentState = neoCortex->playBestMove();
+			Nmoves++;
+		}
+
+		int winner = currentState->getWinner();
+		if(adjudicator.getTermination() != GAME_PLAYED) {
+			winner = adjudicator.getWinner();
+		}
+		neoCortex->printBoardEvaluations(winner, adjudicator.getTermination());
+
+		delete neoCortex;
+		delete trainingSet;
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	OrchestratorContext context;
+	int nThreads = N_THREADS;
+	int generation = 0;
+
+	if(argc > 1) {
+		nThreads = atoi(argv[1]);
+	}
+	if(argc > 2) {
+		generation = atoi(argv[2]);
+	}
+	if((nThreads < 1) || (generation < 0)) {
+		printf("Error, the number of threads must be positive and the generation not negative.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	context.seed = time(0);
+	context.monitor.open("monitor.out", std::ios::out | std::ios::app);
+
+	//The current networks (<name>_network.txt) are the generation given, saved also as <name>_network_<generation>.txt for the arena
+	if(copyNetworks("", "_" + std::to_string(generation)) == false) {
+		printf("Error copying the current networks.\n");
+		exit(EXIT_FAILURE);
+	}
+	std::atomic_store(&(context.current), std::make_shared<Generation>(generation, ""));
+
+	system("mkdir -p " REPLAY_BUFFER_DIRECTORY);
+	context.limits = SearchLimits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+	context.fastLimits = SearchLimits(MOVE_TIME, FAST_SEARCH_SWEEPS, 0, (EARLY_STOP == 1));
+	context.rules = (ADJUDICATION == 1) ? AdjudicationRules() : AdjudicationRules(0., 0, 0., 0., 0, 0);
+	context.collector = new BranchCollector();
+	context.evaluator = new LeafEvaluator(N_EVALUATORS, EVALUATION_BATCH_SIZE, EVALUATION_MAX_WAIT);
+	context.writer = new DatasetWriter(REPLAY_BUFFER_DIRECTORY, generation, DATASET_TARGET_TYPE, SAMPLES_PER_SHARD);
+	context.async = new AsyncWriter(ASYNC_QUEUE_SIZE);
+	context.nextGame = 0;
+	context.stop = false;
+
+	log(&context, "Self play with generation " + std::to_string(generation) + " on " + std::to_string(nThreads) + " threads (seed " + std::to_string(context.seed) + ").\n");
+
+	std::vector<std::thread> threads;
+	for(int i=0;i<nThreads;i++) {
+		threads.push_back(std::thread(playGames, &context));
+	}
+
+	//Train, test and promote the new generations while the self play goes on
+	int candidate = generation;
+	long trainedSamples = 0;
+	while(std::ifstream(STOP_FILE).good() == false) {
+		std::this_thread::sleep_for(std::chrono::seconds(CHECK_INTERVAL));
+
+		long samples = context.writer->getNumberOfSamples(PIECES_NETWORK);
+		if((samples - trainedSamples) < SAMPLES_PER_GENERATION) {
+			continue;
+		}
+
+		//The samples written so far become visible to the trainer
+		context.async->drain();
+		context.writer->flush();
+		trainedSamples = samples;
+
+		std::shared_ptr<Generation> current = std::atomic_load(&(context.current));
+		candidate++;
+		log(&context, "Training generation " + std::to_string(candidate) + " after " + std::to_string(samples) + " samples, " + std::to_string(context.nextGame) + " games.\n");
+		if(runCommand("sh trainGeneration " + std::to_string(candidate) + ((MULTI_HEAD == 1) ? " multi" : "")) != 0) {
+			log(&context, "Training of generation " + std::to_string(candidate) + " failed.\n");
+			continue;
+		}
+
+		std::ostringstream arena;
+		arena << "./Arena " << candidate << " " << current->number << " " << ARENA_THREADS << " " << ARENA_GAMES;
+		if(runCommand(arena.str()) != 0) {
+			log(&context, "Generation " + std::to_string(candidate) + " rejected.\n");
+			continue;
+		}
+
+		//Promotion: the next games use the new networks, which become also the current ones on disk
+		std::atomic_store(&(context.current), std::make_shared<Generation>(candidate, "_" + std::to_string(candidate)));
+		context.writer->setGeneration(candidate);
+		copyNetworks("_" + std::to_string(candidate), "");
+		log(&context, "Generation " + std::to_string(candidate) + " promoted.\n");
+	}
+
+	log(&context, "Stopping after " + std::to_string(context.nextGame) + " games.\n");
+	context.stop = true;
+	for(int i=0;i<nThreads;i++) {
+		threads[i].join();
+	}
+
+	delete context.async;
+	delete context.writer;
+	delete context.evaluator;
+	delete context.collector;
+	std::atomic_store(&(context.current), std::shared_ptr<Generation>());
+
+	context.monitor.close();
+}
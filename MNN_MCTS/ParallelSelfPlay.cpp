@@ -0,0 +1,352 @@
+//To be compiled as g++ -ffast-math -O3 -std=c++11 -pthread -o ParallelSelfPlay ParallelSelfPlay.cpp MCTS.cpp Tree.cpp Pipeline.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp net.c samples.c -lz
+//Usage: ./ParallelSelfPlay [number of threads] [number of games]
+
+//Self play on several threads sharing the same networks. Every game has its own random generator (seeded with the seed of the run
+//plus the number of the game) and its own TrainingSet, appended to the TrainingSet directory as a whole when the game ends, so that
+//all the threads write a single, aligned dataset (with BINARY_DATASETS, a single set of binary shards kept open by a DatasetWriter).
+//With GAME_RECORDS only the compact records of the games are written, and ReplayGames regenerates the datasets from them.
+//With N_EVALUATORS > 0 the leaves of all the games are sent to a single LeafEvaluator, which runs each network on the leaves of several
+//games at once: up to EVALUATION_BATCH_SIZE leaves, waiting at most EVALUATION_MAX_WAIT seconds for a batch to fill up.
+//With FULL_SEARCH_FRACTION < 1 only that fraction of the moves gets the full search and becomes a target for the probabilities, the other
+//moves are searched with FAST_SEARCH_SWEEPS sweeps and give only a sample of the value (playout cap randomization).
+//With ADJUDICATION the decided games are resigned and the long balanced ones drawn (see Adjudicator in MCTS.hpp).
+//With ASYNC_OUTPUT the datasets, the records and monitor.out are written by an AsyncWriter, off the threads of the games.
+
+#include "Chess.hpp"
+#include "Tree.hpp"
+#include "MCTS.hpp"
+#include "TrainingSet.hpp"
+#include "Pipeline.hpp"
+#include "AsyncWriter.hpp"
+#include "net.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+
+
+#define MAX_N_MOVES 400
+#define N_GAMES 1000
+#define N_THREADS 8
+#define SHOW_GAMES 0
+
+//Limits of the search of each move (time in seconds, 0 for no time limit)
+#define MOVE_TIME 0.
+#define EARLY_STOP 0
+
+//End the games decided according to the value of the root, with the rules of AdjudicationRules. Off until the rate of the wrong
+//resignations, measured on the games played without resignations, is known
+#define ADJUDICATION 0
+
+//Playout cap randomization: fraction of the moves searched fully and written as targets of the probabilities (1 to search all of them
+//fully), and sweeps of the fast searches of the other moves, which are targets of the value only
+#define FULL_SEARCH_FRACTION 1
+#define FAST_SEARCH_SWEEPS 64
+
+//Evaluation of the leaves shared by all the games (0 evaluators to let each game evaluate its own leaves)
+#define N_EVALUATORS 2
+#define EVALUATION_BATCH_SIZE 64
+#define EVALUATION_MAX_WAIT 0.001
+
+//Write the datasets as binary shards (see samples.h) instead of text files
+#define BINARY_DATASETS 1
+
+//Write only the compact records of the games (see GameRecord.hpp)
+#define GAME_RECORDS 1
+#define GAME_RECORDS_FILE "TrainingSet/games.rec"
+
+//Write the output on a background thread, with at most ASYNC_QUEUE_SIZE pending writes before the games wait for it
+#define ASYNC_OUTPUT 1
+#define ASYNC_QUEUE_SIZE 256
+
+//Play with the multi-head network which replaces the seven networks (MULTI_NETWORK_FILE, see multi_net in net.h and train.c --multi):
+//its first head is the first network and the next ones the networks of the pieces, which share the evaluations of its trunk
+#define MULTI_HEAD 0
+#define MULTI_NETWORK_FILE "multi_network.txt"
+
+
+//State shared by the threads
+struct SelfPlayContext {
+	NN* net1;
+	std::array<NN*, 6> nets2;
+	//Network of the heads, with MULTI_HEAD
+	multi_net multi;
+	SearchLimits limits;
+	SearchLimits fastLimits;
+	AdjudicationRules rules;
+	BranchCollector* collector;
+	LeafEvaluator* evaluator;
+	DatasetWriter* writer;
+	GameRecordWriter* recorder;
+	AsyncWriter* async;
+	unsigned int seed;
+	int nGames;
+
+	//Next game to play
+	std::atomic<int> nextGame;
+	//White wins, draws, black wins
+	std::atomic<unsigned int> results[3];
+	AdjudicationStatistics adjudication;
+	//Fast and full searches, and their sweeps
+	std::atomic<long> searches[2];
+	std::atomic<long> sweeps[2];
+
+	std::ofstream monitor;
+	std::mutex outputMutex;
+};
+
+
+//Appends a line to monitor.out, on the thread of the AsyncWriter if there is one
+void logMonitor(SelfPlayContext *context, std::string line) {
+	if(context->async != NULL) {
+		context->async->submit([context, line]() {
+			context->monitor << line;
+			context->monitor.flush();
+		});
+	}
+	else {
+		std::lock_guard<std::mutex> lock(context->outputMutex);
+		context->monitor << line;
+		context->monitor.flush();
+	}
+}
+
+
+//Loop of the threads: play games until all of them have been played
+void playGames(SelfPlayContext *context) {
+	int game;
+
+	while((game = context->nextGame++) < context->nGames) {
+		ChessState* currentState = new ChessState();
+
+		//The game only depends on its own seed
+		MCTS* neoCortex = new MCTS(currentState, context->net1, context->nets2, (GAME_RECORDS == 0), context->seed + game);
+		neoCortex->setGameRecorder(context->recorder);
+		neoCortex->setCollector(context->collector);
+		if(context->evaluator != NULL) {
+			neoCortex->enablePipeline(context->evaluator);
+		}
+		TrainingSet* trainingSet = NULL;
+		if(context->writer != NULL) {
+			trainingSet = new TrainingSet(context->writer);
+			trainingSet->setAsyncWriter(context->async);
+			neoCortex->setTrainingSet(trainingSet);
+		}
+
+		//Random choices of the driver, apart from the ones of the tree
+		std::mt19937 generator(context->seed + game + context->nGames);
+		std::uniform_real_distribution<double> distribution(0., 1.);
+		Adjudicator adjudicator(context->rules, generator());
+
+		int Nmoves = 0;
+		while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
+			bool full = (distribution(generator) < FULL_SEARCH_FRACTION);
+			SearchStatistics statistics = neoCortex->search(full ? context->limits : context->fastLimits);
+			neoCortex->setRecordTarget(full);
+			context->searches[full]++;
+			context->sweeps[full] += statistics.sweeps;
+			if(full && adjudicator.update(currentState->getPlayer(), statistics.rootValue, Nmoves) == true) {
+				break;
+			}
+
+			currentState = neoCortex->playBestMove();
+
+			if(SHOW_GAMES == 1) {
+				std::lock_guard<std::mutex> lock(context->outputMutex);
+				std::cout << "Game n. " << game << ", move n. " << Nmoves << "\n";
+				currentState->printState();
+			}
+
+			Nmoves++;
+		}
+
+		//Write the datasets of the game, with the adjudicated result if it did not reach its end
+		int winner = currentState->getWinner();
+		if(adjudicator.getTermination() != GAME_PLAYED) {
+			winner = adjudicator.getWinner();
+		}
+		neoCortex->printBoardEvaluations(winner, adjudicator.getTermination());
+		context->adjudication.add(adjudicator, winner);
+
+		if(winner == 1) {
+			context->results[0]++;
+		}
+		else if(winner == -1) {
+			context->results[2]++;
+		}
+		else {
+			context->results[1]++;
+		}
+
+		delete neoCortex;
+		delete trainingSet;
+
+		{
+			std::lock_guard<std::mutex> lock(context->outputMutex);
+			std::cout << "Game " << (game+1) << " of " << context->nGames << " over after " << Nmoves << " moves.\n";
+		}
+		if(((game+1)%100) == 0) {
+			logMonitor(context, "Playing game " + std::to_string(game+1) + " of " + std::to_string(context->nGames) + "\n");
+		}
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	SelfPlayContext context;
+	int nThreads = N_THREADS;
+
+	context.nGames = N_GAMES;
+	if(argc > 1) {
+		nThreads = atoi(argv[1]);
+	}
+	if(argc > 2) {
+		context.nGames = atoi(argv[2]);
+	}
+	if((nThreads < 1) || (context.nGames < 1)) {
+		printf("Error, the number of threads and of games must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	srand(time(0));
+	srand48(time(0));
+	context.seed = time(0);
+
+	context.monitor.open("monitor.out", std::ios::out | std::ios::app);
+
+	system("rm -rf TrainingSet");
+	system("mkdir TrainingSet");
+
+	char pieces_network_name[25] = "pieces_network.txt";
+	char pawn_network_name[25] = "pawn_network.txt";
+	char rook_network_name[25] = "rook_network.txt";
+	char knight_network_name[25] = "knight_network.txt";
+	char bishop_network_name[25] = "bishop_network.txt";
+	char queen_network_name[25] = "queen_network.txt";
+	char king_network_name[25] = "king_network.txt";
+
+	//The networks are loaded once and shared by all the games
+    if(MULTI_HEAD == 1) {
+    	load_multi_net(&context.multi, (char*)MULTI_NETWORK_FILE);
+    	if(context.multi.nheads != 7) {
+    		printf("Error, the multi-head network has %d heads instead of 7.\n", context.multi.nheads);
+    		exit(EXIT_FAILURE);
+    	}
+    	context.net1 = &context.multi.heads[0];
+    	for(int i=0;i<6;i++) {
+    		context.nets2[i] = &context.multi.heads[i + 1];
+    	}
+    }
+    else {
+    	context.net1 = new NN();
+    	load_net(context.net1, pieces_network_name);
+
+    	context.nets2[PAWN] = new NN();
+    	context.nets2[ROOK] = new NN();
+    	context.nets2[KNIGHT] = new NN();
+    	context.nets2[BISHOP] = new NN();
+    	context.nets2[QUEEN] = new NN();
+    	context.nets2[KING] = new NN();
+    	load_net(context.nets2[PAWN], pawn_network_name);
+    	load_net(context.nets2[ROOK], rook_network_name);
+    	load_net(context.nets2[KNIGHT], knight_network_name);
+    	load_net(context.nets2[BISHOP], bishop_network_name);
+    	load_net(context.nets2[QUEEN], queen_network_name);
+    	load_net(context.nets2[KING], king_network_name);
+    }
+
+	context.limits = SearchLimits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+	context.fastLimits = SearchLimits(MOVE_TIME, FAST_SEARCH_SWEEPS, 0, (EARLY_STOP == 1));
+	context.rules = (ADJUDICATION == 1) ? AdjudicationRules() : AdjudicationRules(0., 0, 0., 0., 0, 0);
+	context.collector = new BranchCollector();
+	context.evaluator = NULL;
+	if(N_EVALUATORS > 0) {
+		context.evaluator = new LeafEvaluator(N_EVALUATORS, EVALUATION_BATCH_SIZE, EVALUATION_MAX_WAIT);
+	}
+	context.writer = NULL;
+	context.recorder = NULL;
+	if(GAME_RECORDS == 1) {
+		context.recorder = new GameRecordWriter(GAME_RECORDS_FILE);
+	}
+	else if(BINARY_DATASETS == 1) {
+		context.writer = new DatasetWriter("TrainingSet");
+	}
+	context.async = NULL;
+	if(ASYNC_OUTPUT == 1) {
+		context.async = new AsyncWriter(ASYNC_QUEUE_SIZE);
+		if(context.recorder != NULL) {
+			context.recorder->setAsyncWriter(context.async);
+		}
+	}
+	context.nextGame = 0;
+	for(int i=0;i<3;i++) {
+		context.results[i] = 0;
+	}
+	for(int i=0;i<2;i++) {
+		context.searches[i] = 0;
+		context.sweeps[i] = 0;
+	}
+
+	std::cout << "Playing " << context.nGames << " games on " << nThreads << " threads (seed " << context.seed << ").\n";
+	context.monitor << "Playing " << context.nGames << " games on " << nThreads << " threads (seed " << context.seed << ").\n";
+	context.monitor.flush();
+
+	//Play the games
+	std::vector<std::thread> threads;
+	for(int i=0;i<nThreads;i++) {
+		threads.push_back(std::thread(playGames, &context));
+	}
+	for(int i=0;i<nThreads;i++) {
+		threads[i].join();
+	}
+	//monitor.out is written by this thread again once the AsyncWriter is idle
+	if(context.async != NULL) {
+		context.async->drain();
+	}
+
+	std::cout << "\n\nResults:\nWhite won " << (100 * context.results[0] / context.nGames) << "%% of the games;\nBlack won " << (100 * context.results[2] / context.nGames) << "%% of the games;\nDraws " << (100 * context.results[1] / context.nGames) << "%% of the games;\n\n\n";
+    context.monitor << "\n\nResults:\nWhite won " << (100 * context.results[0] / context.nGames) << "%% of the games;\nBlack won " << (100 * context.results[2] / context.nGames) << "%% of the games;\nDraws " << (100 * context.results[1] / context.nGames) << "%% of the games;\n\n\n";
+    std::cout << context.adjudication.getSummary();
+    context.monitor << context.adjudication.getSummary();
+    std::cout << "Searches: " << context.searches[1] << " full (" << context.sweeps[1] << " sweeps, written as targets), " << context.searches[0] << " fast (" << context.sweeps[0] << " sweeps).\n";
+    context.monitor << "Searches: " << context.searches[1] << " full (" << context.sweeps[1] << " sweeps, written as targets), " << context.searches[0] << " fast (" << context.sweeps[0] << " sweeps).\n";
+    if(context.evaluator != NULL) {
+    	std::cout << "Average batch of the networks: " << context.evaluator->getAverageNetworkBatchSize() << " leaves.\n";
+    	context.monitor << "Average batch of the networks: " << context.evaluator->getAverageNetworkBatchSize() << " leaves.\n";
+    }
+
+    //The AsyncWriter is deleted before the writers used by its tasks
+    if(context.async != NULL) {
+    	std::cout << context.async->getStatistics();
+    	context.monitor << context.async->getStatistics();
+    	delete context.async;
+    }
+    if(context.recorder != NULL) {
+    	std::cout << "Game records compressed " << context.recorder->getCompressionRatio() << " times.\n";
+    }
+    context.monitor.flush();
+
+    delete context.recorder;
+    delete context.writer;
+    delete context.evaluator;
+    delete context.collector;
+
+    if(MULTI_HEAD == 1) {
+    	free_multi_net(&context.multi);
+    }
+    else {
+    	for(int i=0;i<6;i++) {
+    		delete context.nets2[i];
+    	}
+    	delete context.net1;
+    }
+
+    context.monitor.close();
+}
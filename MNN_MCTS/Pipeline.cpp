@@ -0,0 +1,132 @@
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <utility>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "Tree.hpp"
+#include "Pipeline.hpp"
+
+
+//LEAF EVALUATOR
+//CONSTRUCTORS
+LeafEvaluator::LeafEvaluator(int nThreads, int batchSize) : LeafEvaluator(nThreads, batchSize, 0.) { }
+
+LeafEvaluator::LeafEvaluator(int nThreads, int batchSize, double maxWait) : requests(PIPELINE_QUEUE_SIZE), running(true), batchSize(batchSize), maxWait(maxWait), evaluatedLeaves(0), evaluatedBatches(0), networkLeaves(0), networkBatches(0) {
+  for(int i=0;i<nThreads;i++) {
+    this->threads.push_back(std::thread(&LeafEvaluator::work, this));
+  }
+}
+
+
+//Loop of the evaluator threads: drain the queue in batches and evaluate them
+void LeafEvaluator::work(void) {
+  EvaluationRequest request;
+
+  while(this->running.load(std::memory_order_acquire)) {
+    std::vector<EvaluationRequest> batch;
+    std::chrono::steady_clock::time_point deadline;
+
+    //Fill the batch, waiting at most maxWait after its first leaf for the other ones
+    while(batch.size() < (size_t)this->batchSize) {
+      if(this->requests.pop(request)) {
+        if(batch.size() == 0) {
+          deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(this->maxWait));
+        }
+        batch.push_back(request);
+      }
+      else if((batch.size() == 0) || (std::chrono::steady_clock::now() >= deadline) || (this->running.load(std::memory_order_acquire) == false)) {
+        break;
+      }
+      else {
+        this->requests.waitUntil(deadline);
+      }
+    }
+
+    //Sleep until a leaf is submitted, waking up now and then to check if the evaluator is being deleted
+    if(batch.size() == 0) {
+      this->requests.waitUntil(std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(PIPELINE_IDLE_WAIT)));
+      continue;
+    }
+
+    //The leaves of the batch can belong to different trees: the transposition tables are looked up tree by tree, then the networks are
+    //run once on all the remaining leaves of the trees sharing them
+    std::unordered_map<Tree*,std::vector<LeafEvaluation*>> leavesByTree;
+    std::map<std::pair<NN*,std::array<NN*, 6>>,std::vector<LeafEvaluation*>> leavesByNetworks;
+    for(std::vector<EvaluationRequest>::iterator r = batch.begin(); r != batch.end(); ++r) {
+      leavesByTree[(*r).evaluation->leaf->getTree()].push_back((*r).evaluation);
+    }
+    for(std::unordered_map<Tree*,std::vector<LeafEvaluation*>>::iterator group = leavesByTree.begin(); group != leavesByTree.end(); ++group) {
+      Tree *tree = group->first;
+
+      group->second = tree->lookupEvaluations(group->second);
+      std::vector<LeafEvaluation*> &leaves = leavesByNetworks[std::make_pair(tree->getNetwork1(), tree->getNetworks2())];
+      leaves.insert(leaves.end(), group->second.begin(), group->second.end());
+    }
+    for(std::map<std::pair<NN*,std::array<NN*, 6>>,std::vector<LeafEvaluation*>>::iterator group = leavesByNetworks.begin(); group != leavesByNetworks.end(); ++group) {
+      if(group->second.size() == 0) {
+        continue;
+      }
+
+      Tree::evaluateNetworks(group->first.first, group->first.second, group->second);
+      this->networkLeaves += group->second.size();
+      this->networkBatches++;
+    }
+    for(std::unordered_map<Tree*,std::vector<LeafEvaluation*>>::iterator group = leavesByTree.begin(); group != leavesByTree.end(); ++group) {
+      group->first->storeEvaluations(group->second);
+    }
+
+    this->evaluatedLeaves += batch.size();
+    this->evaluatedBatches++;
+
+    //Post the results back
+    for(std::vector<EvaluationRequest>::iterator r = batch.begin(); r != batch.end(); ++r) {
+      while((*r).replyTo->push((*r).evaluation) == false) {
+        std::this_thread::yield();
+      }
+    }
+  }
+}
+
+
+//EVALUATION
+void LeafEvaluator::submit(EvaluationRequest request) {
+  while(this->requests.push(request) == false) {
+    std::this_thread::yield();
+  }
+}
+
+
+//STATISTICS
+long LeafEvaluator::getNumberOfEvaluatedLeaves(void) {
+  return this->evaluatedLeaves.load();
+}
+
+double LeafEvaluator::getAverageBatchSize(void) {
+  if(this->evaluatedBatches.load() == 0) {
+    return 0.;
+  }
+
+  return (double)this->evaluatedLeaves.load() / this->evaluatedBatches.load();
+}
+
+//Average number of leaves on which the networks are run at once (the leaves found in the transposition tables are not counted)
+double LeafEvaluator::getAverageNetworkBatchSize(void) {
+  if(this->networkBatches.load() == 0) {
+    return 0.;
+  }
+
+  return (double)this->networkLeaves.load() / this->networkBatches.load();
+}
+
+
+//DESTRUCTOR
+LeafEvaluator::~LeafEvaluator(void) {
+  this->running.store(false, std::memory_order_release);
+  this->requests.notifyAll();
+
+  for(std::vector<std::thread>::iterator thread = this->threads.begin(); thread != this->threads.end(); ++thread) {
+    (*thread).join();
+  }
+}
@@ -0,0 +1,274 @@
+/*
+    Pipeline.hpp:
+        Library for the pipelined execution of the MCTS, in which the tree traversal and the evaluation of the leaves by the networks overlap.
+        The LockFreeQueue is a bounded multi-producer multi-consumer queue, based on an array of cells tagged with a sequence number.
+        The LeafEvaluator owns a pool of evaluator threads: the MCTS pushes the leaves to evaluate in its queue, the evaluator threads drain it
+        in batches, run the networks on each batch and post the evaluated leaves back to the queue of the MCTS that submitted them, where the
+        expansion and the backpropagation are completed.
+        A single LeafEvaluator can be shared by several games played concurrently: the leaves of all the trees using the same networks are
+        evaluated together, and an evaluator thread can wait a little for a batch to fill up before running the networks.
+        The threads waiting on an empty queue (the idle evaluators, or the MCTS waiting for its leaves) spin only PIPELINE_SPINS times, then
+        sleep on a condition variable until a push wakes them up, so that they do not take the cores from the other processes.
+        The queues and the evaluators are aligned to the cache lines, also when allocated with new (see CacheAligned).
+
+        @author: Massimiliano Chiappini
+        @contact: massimilianochiappini@gmail.com
+        @version: 0.2
+*/
+
+
+
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <map>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include "Tree.hpp"
+
+
+#define PIPELINE_QUEUE_SIZE 1024
+#define PIPELINE_CACHE_LINE 64
+
+//Checks of an empty queue before sleeping, and longest sleep of an idle evaluator thread (in seconds)
+#define PIPELINE_SPINS 64
+#define PIPELINE_IDLE_WAIT 0.1
+
+
+
+
+//CACHE ALIGNED
+//The new of C++11 does not align the objects beyond the fundamental alignment: the classes with members aligned to the cache lines
+//derive from CacheAligned, whose new allocates them on a cache line
+struct CacheAligned {
+    static void* operator new(size_t size) {
+      void *memory;
+
+      if(posix_memalign(&memory, PIPELINE_CACHE_LINE, size) != 0) {
+        throw std::bad_alloc();
+      }
+      return memory;
+    }
+
+    static void operator delete(void *memory) {
+      free(memory);
+    }
+};
+
+
+
+
+//LOCK FREE QUEUE
+template <typename T>
+class LockFreeQueue : public CacheAligned {
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T data;
+    };
+
+    //Ring buffer, whose size is a power of two
+    std::unique_ptr<Cell[]> buffer;
+    size_t mask;
+
+    //Positions of the producers and of the consumers, kept on different cache lines
+    alignas(PIPELINE_CACHE_LINE) std::atomic<size_t> enqueuePosition;
+    alignas(PIPELINE_CACHE_LINE) std::atomic<size_t> dequeuePosition;
+
+    //Consumers sleeping on the empty queue
+    alignas(PIPELINE_CACHE_LINE) std::atomic<int> waiters;
+    std::mutex waitMutex;
+    std::condition_variable notEmpty;
+
+
+  public:
+    //CONSTRUCTORS
+    LockFreeQueue(size_t capacity) {
+      size_t size = 2;
+      while(size < capacity) {
+        size *= 2;
+      }
+
+      this->buffer = std::unique_ptr<Cell[]>(new Cell[size]);
+      this->mask = size - 1;
+      for(size_t i=0;i<size;i++) {
+        this->buffer[i].sequence.store(i, std::memory_order_relaxed);
+      }
+      this->enqueuePosition.store(0, std::memory_order_relaxed);
+      this->dequeuePosition.store(0, std::memory_order_relaxed);
+      this->waiters.store(0, std::memory_order_relaxed);
+    }
+
+    LockFreeQueue(const LockFreeQueue&) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue&) = delete;
+
+
+    //QUEUE OPERATIONS
+    //Returns false if the queue is full
+    bool push(const T &data) {
+      Cell *cell;
+      size_t position = this->enqueuePosition.load(std::memory_order_relaxed);
+
+      while(true) {
+        cell = &this->buffer[position & this->mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if(difference == 0) {
+          //The cell is free: try to reserve it
+          if(this->enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if(difference < 0) {
+          return false;
+        }
+        else {
+          position = this->enqueuePosition.load(std::memory_order_relaxed);
+        }
+      }
+
+      cell->data = data;
+      cell->sequence.store(position + 1, std::memory_order_release);
+
+      //Wake up the sleeping consumers: either they see the data before sleeping, or this thread sees them waiting
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(this->waiters.load(std::memory_order_relaxed) > 0) {
+        this->notifyAll();
+      }
+      return true;
+    }
+
+    //Returns false if the queue is empty
+    bool pop(T &data) {
+      Cell *cell;
+      size_t position = this->dequeuePosition.load(std::memory_order_relaxed);
+
+      while(true) {
+        cell = &this->buffer[position & this->mask];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+        if(difference == 0) {
+          //The cell is full: try to take it
+          if(this->dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            break;
+          }
+        }
+        else if(difference < 0) {
+          return false;
+        }
+        else {
+          position = this->dequeuePosition.load(std::memory_order_relaxed);
+        }
+      }
+
+      data = cell->data;
+      cell->sequence.store(position + this->mask + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool isEmpty(void) {
+      size_t position = this->dequeuePosition.load(std::memory_order_relaxed);
+
+      return this->buffer[position & this->mask].sequence.load(std::memory_order_acquire) != position + 1;
+    }
+
+
+    //WAITING
+    //Waits until the queue is not empty or the deadline is reached, spinning a little before sleeping; returns false if the queue is
+    //still empty (also when woken up by notifyAll)
+    bool waitUntil(std::chrono::steady_clock::time_point deadline) {
+      for(int spin=0;spin<PIPELINE_SPINS;spin++) {
+        if(this->isEmpty() == false) {
+          return true;
+        }
+        std::this_thread::yield();
+      }
+
+      std::unique_lock<std::mutex> lock(this->waitMutex);
+      this->waiters.fetch_add(1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(this->isEmpty()) {
+        this->notEmpty.wait_until(lock, deadline);
+      }
+      this->waiters.fetch_sub(1, std::memory_order_relaxed);
+
+      return (this->isEmpty() == false);
+    }
+
+    void notifyAll(void) {
+      std::lock_guard<std::mutex> lock(this->waitMutex);
+      this->notEmpty.notify_all();
+    }
+};
+
+
+
+
+//EVALUATION REQUEST
+//A leaf to evaluate, together with the queue in which the result has to be posted
+struct EvaluationRequest {
+    LeafEvaluation *evaluation;
+    LockFreeQueue<LeafEvaluation*> *replyTo;
+};
+
+
+
+
+//LEAF EVALUATOR
+class LeafEvaluator : public CacheAligned {
+  private:
+    LockFreeQueue<EvaluationRequest> requests;
+    std::vector<std::thread> threads;
+    std::atomic<bool> running;
+
+    //Maximum number of leaves evaluated together
+    int batchSize;
+    //Maximum time (in seconds) waited for a batch to fill up, once its first leaf has arrived
+    double maxWait;
+
+    //Statistics
+    std::atomic<long> evaluatedLeaves;
+    std::atomic<long> evaluatedBatches;
+    std::atomic<long> networkLeaves;
+    std::atomic<long> networkBatches;
+
+    void work(void);
+
+
+  public:
+    //CONSTRUCTORS
+    LeafEvaluator(int, int);
+    LeafEvaluator(int, int, double);
+
+    LeafEvaluator(const LeafEvaluator&) = delete;
+    LeafEvaluator& operator=(const LeafEvaluator&) = delete;
+
+
+    //EVALUATION
+    void submit(EvaluationRequest);
+
+
+    //STATISTICS
+    long getNumberOfEvaluatedLeaves(void);
+    double getAverageBatchSize(void);
+    double getAverageNetworkBatchSize(void);
+
+
+    //DESTRUCTOR
+    ~LeafEvaluator(void);
+};
+
+
+#endif
@@ -1,10 +1,11 @@
-//To be compiled as g++ -ffast-math -O3 -std=c++11 -o PlayGame PlayGame.cpp MCTS.cpp Tree.cpp Chess.cpp net.c
+//To be compiled as g++ -ffast-math -O3 -std=c++11 -pthread -o PlayGame PlayGame.cpp MCTS.cpp Tree.cpp Pipeline.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp net.c samples.c -lz
 
 //TODO: Adjust brian to make the soft matt and the other part automatically and make it a bit more elegant
 //TODO: Functions to print the training datasets for the network
 #include "Chess.hpp"
 #include "Tree.hpp"
 #include "MCTS.hpp"
+#include "Profiler.hpp"
 #include "net.h"
 
 #include <stdlib.h>
@@ -18,6 +19,13 @@
 #define N_GAMES 100
 #define SHOW_GAMES 0
 
+//Limits of the search of each move (time in seconds, 0 for no time limit)
+#define MOVE_TIME 0.
+#define EARLY_STOP 1
+
+//Games between the timings appended to monitor.out, with the profiling compiled in (see Profiler.hpp)
+#define PROFILE_INTERVAL 10
+
 int main(int argc, char* argv[]) {
     if(argc < 3) {
         printf("Error, give the numbers of the networks to use as a parameter!\n");
@@ -108,8 +116,22 @@ int main(int argc, char* argv[]) {
     load_net(black_nets2[QUEEN], black_queen_network_name);
     load_net(black_nets2[KING], black_king_network_name);
 
+	SearchLimits limits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+
+	//The pruned branches are freed in the background
+	BranchCollector* collector = new BranchCollector();
+
+	std::ofstream monitor;
+	if(MCTS_PROFILING == 1) {
+		monitor.open("monitor.out", std::ios::out | std::ios::app);
+	}
+
 	for(int game=0;game<N_GAMES;game++) {
 		std::cout << "Playing game " << (game+1) << " of " << N_GAMES << "\n";
+		if((MCTS_PROFILING == 1) && (game > 0) && ((game%PROFILE_INTERVAL) == 0)) {
+			monitor << "Playing game " << (game+1) << " of " << N_GAMES << "\nProfile: " << Profiler::getJSON() << "\n";
+			monitor.flush();
+		}
 
 		//Get the starting state
 		currentState = new ChessState();
@@ -124,16 +146,15 @@ int main(int argc, char* argv[]) {
 		MCTS* Players[2];
 		Players[0] = new MCTS(new ChessState(), white_net1, white_nets2, false);
 		Players[1] = new MCTS(new ChessState(), black_net1, black_nets2, false);
+		Players[0]->setCollector(collector);
+		Players[1]->setCollector(collector);
 		
 		int Nmoves = 0;
 		int player = 0;
 		while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
 			//Think
-			for(int i=0;i<MCTS_NUMBER_OF_SWEEPS;i++)
-			{
-				Players[0]->sweep();
-				Players[1]->sweep();
-			}
+			Players[0]->search(limits);
+			Players[1]->search(limits);
 
 			//Play
 			currentState = Players[player]->playBestMove();
@@ -171,6 +192,15 @@ int main(int argc, char* argv[]) {
 	    delete Players[1];
 	}
 
+    delete collector;
+
+    if(MCTS_PROFILING == 1) {
+    	std::cout << "Profile: " << Profiler::getJSON() << "\n";
+    	monitor << "Profile: " << Profiler::getJSON() << "\n";
+    	monitor.close();
+    	Profiler::writeJSON(PROFILE_FILE);
+    }
+
     for(int i=0;i<6;i++) {
     	delete white_nets2[i];
     }
@@ -22,6 +22,10 @@
 #define SHOW_GAMES 0
 #define RANDOM_PLAYER -1
 
+//Limits of the search of each move (time in seconds, 0 for no time limit)
+#define MOVE_TIME 0.
+#define EARLY_STOP 1
+
 
 int main(int argc, char* argv[]) {
 	srand(time(0));
@@ -60,6 +64,11 @@ int main(int argc, char* argv[]) {
     load_net(nets2[KING], king_network_name);
 
 
+	SearchLimits limits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+
+	//The pruned branches are freed in the background
+	BranchCollector* collector = new BranchCollector();
+
 	//Perform N_GAMES self games
 	for(int game=0;game<N_GAMES;game++) {
 		std::cout << "Playing game " << (game+1) << " of " << N_GAMES << "\n";
@@ -76,14 +85,11 @@ int main(int argc, char* argv[]) {
 
 		//Initialize a MCTS players
 		MCTS* neoCortex = new MCTS(currentState, net1, nets2, false);
+		neoCortex->setCollector(collector);
 		
 		int Nmoves = 0;
 		while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
-			for(int i=0;i<MCTS_NUMBER_OF_SWEEPS;i++)
-			{
-				//std::cout << "Sweep number " << i << ".\n";
-				neoCortex->sweep();
-			}
+			neoCortex->search(limits);
 			
 			if(currentState->getPlayer() == RANDOM_PLAYER) {
 				currentState = neoCortex->playRandomMove();
@@ -123,6 +129,8 @@ int main(int argc, char* argv[]) {
     monitor << "\n\nResults:\nWhite won " << (100 * results[0] / N_GAMES) << "%% of the games;\nBlack won " << (100 * results[2] / N_GAMES) << "%% of the games;\nDraws " << (100 * results[1] / N_GAMES) << "%% of the games;\n\n\n";
     monitor.flush();
 
+    delete collector;
+
     for(int i=0;i<6;i++) {
     	delete nets2[i];
     }
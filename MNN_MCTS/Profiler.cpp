@@ -0,0 +1,134 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "Profiler.hpp"
+
+
+static const char *PHASE_NAMES[N_PROFILED_PHASES] = {"selection", "expansion", "backPropagation", "buildChildren", "predict", "computeLegalMoves", "pruneOtherBranches"};
+
+std::mutex Profiler::mutex;
+std::vector<ThreadProfile*> Profiler::threads;
+std::chrono::steady_clock::time_point Profiler::start = std::chrono::steady_clock::now();
+
+
+//Only the thread of the counters writes them, so they are increased with a relaxed load and store instead of a locked addition
+static inline void increase(std::atomic<unsigned long> &counter, unsigned long value) {
+  counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+//CONSTRUCTOR
+ThreadProfile::ThreadProfile(void) : searches(0), sweeps(0), nodes(0), searchNanoseconds(0) {
+  for(int p=0;p<N_PROFILED_PHASES;p++) {
+    this->phases[p].calls = 0;
+    this->phases[p].nanoseconds = 0;
+    for(int i=0;i<PROFILER_BUCKETS;i++) {
+      this->phases[p].histogram[i] = 0;
+    }
+  }
+}
+
+
+//COUNTERS
+//The counters of a thread are created at its first call, and registered for the reports
+ThreadProfile* Profiler::getThreadProfile(void) {
+  thread_local ThreadProfile *profile = NULL;
+
+  if(profile == NULL) {
+    profile = new ThreadProfile();
+    std::lock_guard<std::mutex> lock(Profiler::mutex);
+    Profiler::threads.push_back(profile);
+  }
+
+  return profile;
+}
+
+void Profiler::addCall(ProfiledPhase phase, std::chrono::steady_clock::duration duration) {
+  PhaseCounters &counters = Profiler::getThreadProfile()->phases[phase];
+  unsigned long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  int bucket = 0;
+
+  while((bucket < PROFILER_BUCKETS - 1) && ((nanoseconds >> bucket) > 0)) {
+    bucket++;
+  }
+  increase(counters.calls, 1);
+  increase(counters.nanoseconds, nanoseconds);
+  increase(counters.histogram[bucket], 1);
+}
+
+//A search of the given sweeps, nodes created and seconds
+void Profiler::addSearch(int sweeps, long nodes, double seconds) {
+  ThreadProfile *profile = Profiler::getThreadProfile();
+
+  increase(profile->searches, 1);
+  increase(profile->sweeps, sweeps);
+  increase(profile->nodes, nodes);
+  increase(profile->searchNanoseconds, (unsigned long)(seconds * 1e9));
+}
+
+
+//REPORTS
+//The rates of the sweeps and of the nodes are per second of search, summed over the threads; the histograms list the upper
+//bound in nanoseconds and the calls of their non-empty buckets
+std::string Profiler::getJSON(void) {
+  std::lock_guard<std::mutex> lock(Profiler::mutex);
+  std::ostringstream json;
+  unsigned long searches = 0, sweeps = 0, nodes = 0, searchNanoseconds = 0;
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Profiler::start).count();
+
+  for(std::vector<ThreadProfile*>::iterator profile = Profiler::threads.begin(); profile != Profiler::threads.end(); ++profile) {
+    searches += (*profile)->searches.load(std::memory_order_relaxed);
+    sweeps += (*profile)->sweeps.load(std::memory_order_relaxed);
+    nodes += (*profile)->nodes.load(std::memory_order_relaxed);
+    searchNanoseconds += (*profile)->searchNanoseconds.load(std::memory_order_relaxed);
+  }
+  double searchSeconds = searchNanoseconds * 1e-9;
+
+  json << "{\"elapsedSeconds\": " << elapsed << ", \"threads\": " << Profiler::threads.size();
+  json << ", \"searches\": " << searches << ", \"searchSeconds\": " << searchSeconds << ", \"sweeps\": " << sweeps << ", \"nodes\": " << nodes;
+  json << ", \"sweepsPerSecond\": " << ((searchSeconds > 0) ? sweeps / searchSeconds : 0.);
+  json << ", \"nodesPerSecond\": " << ((searchSeconds > 0) ? nodes / searchSeconds : 0.);
+  json << ", \"phases\": {";
+  for(int p=0;p<N_PROFILED_PHASES;p++) {
+    unsigned long calls = 0, nanoseconds = 0;
+    unsigned long histogram[PROFILER_BUCKETS] = {0};
+
+    for(std::vector<ThreadProfile*>::iterator profile = Profiler::threads.begin(); profile != Profiler::threads.end(); ++profile) {
+      PhaseCounters &counters = (*profile)->phases[p];
+      calls += counters.calls.load(std::memory_order_relaxed);
+      nanoseconds += counters.nanoseconds.load(std::memory_order_relaxed);
+      for(int i=0;i<PROFILER_BUCKETS;i++) {
+        histogram[i] += counters.histogram[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    json << ((p > 0) ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": {\"calls\": " << calls << ", \"seconds\": " << nanoseconds * 1e-9;
+    json << ", \"meanMicroseconds\": " << ((calls > 0) ? nanoseconds * 1e-3 / calls : 0.) << ", \"histogram\": [";
+    bool first = true;
+    for(int i=0;i<PROFILER_BUCKETS;i++) {
+      if(histogram[i] > 0) {
+        json << (first ? "" : ", ") << "[" << (1UL << i) << ", " << histogram[i] << "]";
+        first = false;
+      }
+    }
+    json << "]}";
+  }
+  json << "}}";
+
+  return json.str();
+}
+
+bool Profiler::writeJSON(std::string fileName) {
+  std::ofstream file(fileName.c_str(), std::ios::out | std::ios::trunc);
+
+  if(file.good() == false) {
+    return false;
+  }
+  file << Profiler::getJSON() << "\n";
+
+  return file.good();
+}
@@ -0,0 +1,110 @@
+/*
+    Profiler.hpp:
+        Library for the timing of the hot paths of the search: the phases of the sweeps (selection, expansion, backpropagation), the
+        building of the children, the calls of the networks, the generation of the legal moves and the pruning of the branches.
+        Each thread counts the calls of each phase, their total time and a histogram of their durations in its own counters, which
+        only that thread writes; the report sums the counters of all the threads, with the sweeps and the nodes of the searches.
+        The times of the phases are inclusive: the expansion contains the building of the children, the calls of the networks and
+        the generation of the legal moves.
+
+        The instrumentation is compiled in with MCTS_PROFILING 1 (or -DMCTS_PROFILING=1): otherwise PROFILE_PHASE and PROFILE_SEARCH
+        expand to nothing, and the search does not pay for it.
+
+        @author: Massimiliano Chiappini
+        @contact: massimilianochiappini@gmail.com
+        @version: 0.2
+*/
+
+
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+
+#ifndef MCTS_PROFILING
+#define MCTS_PROFILING 0
+#endif
+
+//File of the final report of SelfPlay and PlayGame, which also append the reports to monitor.out during the games
+#define PROFILE_FILE "profile.json"
+
+//Buckets of the histograms of the durations: a call lasting from 2^(i-1) to 2^i nanoseconds is counted in the bucket i
+#define PROFILER_BUCKETS 40
+
+
+enum ProfiledPhase {PHASE_SELECTION, PHASE_EXPANSION, PHASE_BACKPROPAGATION, PHASE_BUILD_CHILDREN, PHASE_PREDICT, PHASE_LEGAL_MOVES, PHASE_PRUNE, N_PROFILED_PHASES};
+
+
+//Counters of a phase in a thread, read by the reports while the thread writes them
+struct PhaseCounters {
+    std::atomic<unsigned long> calls;
+    std::atomic<unsigned long> nanoseconds;
+    std::atomic<unsigned long> histogram[PROFILER_BUCKETS];
+};
+
+//Counters of a thread
+struct ThreadProfile {
+    PhaseCounters phases[N_PROFILED_PHASES];
+    std::atomic<unsigned long> searches;
+    std::atomic<unsigned long> sweeps;
+    std::atomic<unsigned long> nodes;
+    std::atomic<unsigned long> searchNanoseconds;
+
+    //Constructor
+    ThreadProfile(void);
+};
+
+
+class Profiler {
+  private:
+    //Counters of the threads, kept after the threads end
+    static std::mutex mutex;
+    static std::vector<ThreadProfile*> threads;
+    static std::chrono::steady_clock::time_point start;
+
+    static ThreadProfile* getThreadProfile(void);
+
+
+  public:
+    //COUNTERS
+    static void addCall(ProfiledPhase, std::chrono::steady_clock::duration);
+    static void addSearch(int, long, double);
+
+
+    //REPORTS
+    //Counters of all the threads, as a JSON object
+    static std::string getJSON(void);
+    static bool writeJSON(std::string);
+};
+
+
+//Times the scope in which it is declared
+class PhaseTimer {
+  private:
+    ProfiledPhase phase;
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    PhaseTimer(ProfiledPhase phase) : phase(phase), start(std::chrono::steady_clock::now()) { }
+    ~PhaseTimer(void) {
+      Profiler::addCall(this->phase, std::chrono::steady_clock::now() - this->start);
+    }
+};
+
+
+#if MCTS_PROFILING == 1
+#define PROFILE_PHASE(phase) PhaseTimer phaseTimer(phase)
+#define PROFILE_SEARCH(sweeps, nodes, seconds) Profiler::addSearch(sweeps, nodes, seconds)
+#else
+#define PROFILE_PHASE(phase)
+#define PROFILE_SEARCH(sweeps, nodes, seconds)
+#endif
+
+
+#endif
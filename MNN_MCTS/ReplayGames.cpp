@@ -0,0 +1,63 @@
+//To be compiled as g++ -O3 -std=c++11 -pthread -o ReplayGames ReplayGames.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp samples.c -lz
+//Usage: ./ReplayGames <output directory> <game records> [<game records> ...]
+
+//Regenerates the datasets of the networks from the records of the games written by the self play: the moves of each game are played
+//again through ChessState, and the inputs, the targets and z of its positions are written in the output directory.
+
+#include "Chess.hpp"
+#include "TrainingSet.hpp"
+#include "GameRecord.hpp"
+
+#include <stdlib.h>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+
+
+//Write the datasets as binary shards (see samples.h) instead of text files
+#define BINARY_DATASETS 1
+
+
+int main(int argc, char* argv[]) {
+	if(argc < 3) {
+		std::cout << "Usage: " << argv[0] << " <output directory> <game records> [<game records> ...]\n";
+		exit(EXIT_FAILURE);
+	}
+
+	std::string directory(argv[1]);
+	DatasetWriter* writer = NULL;
+	if(BINARY_DATASETS == 1) {
+		writer = new DatasetWriter(directory);
+	}
+
+	long games = 0;
+	long positions = 0;
+	GameRecord record;
+
+	try {
+		for(int f=2;f<argc;f++) {
+			GameRecordReader reader(argv[f]);
+
+			while(reader.next(record)) {
+				//One training set for each game, so that the samples of a game are written together
+				TrainingSet* trainingSet = (writer != NULL) ? new TrainingSet(writer) : new TrainingSet(directory);
+
+				replayGame(record, trainingSet);
+				trainingSet->flush();
+				delete trainingSet;
+
+				games++;
+				positions += record.getNumberOfPositions();
+			}
+		}
+	}
+	catch(const std::runtime_error &error) {
+		std::cout << "Error: " << error.what() << "\n";
+		delete writer;
+		exit(EXIT_FAILURE);
+	}
+
+	delete writer;
+
+	std::cout << "Replayed " << games << " games, " << positions << " positions.\n";
+}
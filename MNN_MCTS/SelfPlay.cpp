@@ -1,10 +1,13 @@
-//To be compiled as g++ -ffast-math -O3 -std=c++11 -o SelfPlay SelfPlay.cpp MCTS.cpp Tree.cpp Chess.cpp net.c
+//To be compiled as g++ -ffast-math -O3 -std=c++11 -pthread -o SelfPlay SelfPlay.cpp MCTS.cpp Tree.cpp Pipeline.cpp TrainingSet.cpp GameRecord.cpp AsyncWriter.cpp Chess.cpp Profiler.cpp net.c samples.c -lz
 
 //TODO: Make tree of the Neural Network class as a pointer 
 
 #include "Chess.hpp"
 #include "Tree.hpp"
 #include "MCTS.hpp"
+#include "TrainingSet.hpp"
+#include "AsyncWriter.hpp"
+#include "Profiler.hpp"
 #include "net.h"
 
 #include <stdlib.h>
@@ -18,6 +21,42 @@
 #define N_GAMES 1000
 #define SHOW_GAMES 0
 
+//Limits of the search of each move (time in seconds, 0 for no time limit). The early stop is off by default, since it would
+//truncate the visit counts used as targets for the networks
+#define MOVE_TIME 0.
+#define EARLY_STOP 0
+
+//End the games decided according to the value of the root, with the rules of AdjudicationRules (see MCTS.hpp). Off until the rate of the wrong
+//resignations, measured on the games played without resignations, is known
+#define ADJUDICATION 0
+
+//Playout cap randomization: fraction of the moves searched fully and written as targets of the probabilities (1 to search all of them
+//fully), and sweeps of the fast searches of the other moves, which are targets of the value only
+#define FULL_SEARCH_FRACTION 1
+#define FAST_SEARCH_SWEEPS 64
+
+//Number of evaluator threads of the pipelined search (0 for the sequential search) and size of their batches
+#define N_EVALUATORS 0
+#define EVALUATION_BATCH_SIZE 8
+
+//Merge the transpositions in the search tree
+#define MERGE_TRANSPOSITIONS 0
+
+//Write the datasets as binary shards (see samples.h) instead of text files
+#define BINARY_DATASETS 1
+
+//Write only the compact records of the games (see GameRecord.hpp), from which ReplayGames regenerates the datasets
+#define GAME_RECORDS 1
+#define GAME_RECORDS_FILE "TrainingSet/games.rec"
+
+//Write the datasets, the records and monitor.out on a background thread, so that the next game starts while they are written
+#define ASYNC_OUTPUT 1
+
+//Play with the multi-head network which replaces the seven networks (MULTI_NETWORK_FILE, see multi_net in net.h and train.c --multi):
+//its first head is the first network and the next ones the networks of the pieces, which share the evaluations of its trunk
+#define MULTI_HEAD 0
+#define MULTI_NETWORK_FILE "multi_network.txt"
+
 
 int main(int argc, char* argv[]) {
 	srand(time(0));
@@ -41,29 +80,83 @@ int main(int argc, char* argv[]) {
 	char queen_network_name[25] = "queen_network.txt";
 	char king_network_name[25] = "king_network.txt";
 	
-    NN* net1 = new NN();
-    load_net(net1, pieces_network_name);
-
+    NN* net1;
     std::array<NN*, 6> nets2;
-    nets2[PAWN] = new NN();
-    nets2[ROOK] = new NN();
-    nets2[KNIGHT] = new NN();
-    nets2[BISHOP] = new NN();
-    nets2[QUEEN] = new NN();
-    nets2[KING] = new NN();
-    load_net(nets2[PAWN], pawn_network_name);
-    load_net(nets2[ROOK], rook_network_name);
-    load_net(nets2[KNIGHT], knight_network_name);
-    load_net(nets2[BISHOP], bishop_network_name);
-    load_net(nets2[QUEEN], queen_network_name);
-    load_net(nets2[KING], king_network_name);
+    multi_net multi;
+    if(MULTI_HEAD == 1) {
+    	load_multi_net(&multi, (char*)MULTI_NETWORK_FILE);
+    	if(multi.nheads != 7) {
+    		printf("Error, the multi-head network has %d heads instead of 7.\n", multi.nheads);
+    		exit(EXIT_FAILURE);
+    	}
+    	net1 = &multi.heads[0];
+    	for(int i=0;i<6;i++) {
+    		nets2[i] = &multi.heads[i + 1];
+    	}
+    }
+    else {
+    	net1 = new NN();
+    	load_net(net1, pieces_network_name);
+
+    	nets2[PAWN] = new NN();
+    	nets2[ROOK] = new NN();
+    	nets2[KNIGHT] = new NN();
+    	nets2[BISHOP] = new NN();
+    	nets2[QUEEN] = new NN();
+    	nets2[KING] = new NN();
+    	load_net(nets2[PAWN], pawn_network_name);
+    	load_net(nets2[ROOK], rook_network_name);
+    	load_net(nets2[KNIGHT], knight_network_name);
+    	load_net(nets2[BISHOP], bishop_network_name);
+    	load_net(nets2[QUEEN], queen_network_name);
+    	load_net(nets2[KING], king_network_name);
+    }
     
+	SearchLimits limits(MOVE_TIME, MCTS_NUMBER_OF_SWEEPS, 0, (EARLY_STOP == 1));
+	AdjudicationRules rules = (ADJUDICATION == 1) ? AdjudicationRules() : AdjudicationRules(0., 0, 0., 0., 0, 0);
+	AdjudicationStatistics adjudication;
+	SearchLimits fastLimits(MOVE_TIME, FAST_SEARCH_SWEEPS, 0, (EARLY_STOP == 1));
+	//Fast and full searches, and their sweeps
+	long searches[2] = {0};
+	long sweeps[2] = {0};
+
+	//The pruned branches are freed in the background
+	BranchCollector* collector = new BranchCollector();
+
+	//The binary shards stay open for all the games
+	DatasetWriter* writer = NULL;
+	GameRecordWriter* recorder = NULL;
+	if(GAME_RECORDS == 1) {
+		recorder = new GameRecordWriter(GAME_RECORDS_FILE);
+	}
+	else if(BINARY_DATASETS == 1) {
+		writer = new DatasetWriter("TrainingSet");
+	}
+	AsyncWriter* async = NULL;
+	if(ASYNC_OUTPUT == 1) {
+		async = new AsyncWriter();
+		if(recorder != NULL) {
+			recorder->setAsyncWriter(async);
+		}
+	}
+
 	//Perform N_GAMES self games
 	for(int game=0;game<N_GAMES;game++) {
 		if(((game+1)%100) == 0) {
 			std::cout << "Playing game " << (game+1) << " of " << N_GAMES << "\n";
-			monitor << "Playing game " << (game+1) << " of " << N_GAMES << "\n";
-			monitor.flush();
+			//With the profiling compiled in (see Profiler.hpp), the timings so far follow in monitor.out
+			std::string profile = (MCTS_PROFILING == 1) ? "Profile: " + Profiler::getJSON() + "\n" : "";
+			if(async != NULL) {
+				std::string line = "Playing game " + std::to_string(game+1) + " of " + std::to_string(N_GAMES) + "\n" + profile;
+				async->submit([&monitor, line]() {
+					monitor << line;
+					monitor.flush();
+				});
+			}
+			else {
+				monitor << "Playing game " << (game+1) << " of " << N_GAMES << "\n" << profile;
+				monitor.flush();
+			}
 		}
 
 		//Initialize the game
@@ -75,14 +168,33 @@ int main(int argc, char* argv[]) {
 	    }
 
 		//Initialize a MCTS players
-		MCTS* neoCortex = new MCTS(currentState, net1, nets2, true);
+		MCTS* neoCortex = new MCTS(currentState, net1, nets2, (GAME_RECORDS == 0));
+		neoCortex->setGameRecorder(recorder);
+		neoCortex->setCollector(collector);
+		TrainingSet* trainingSet = NULL;
+		if(writer != NULL) {
+			trainingSet = new TrainingSet(writer);
+			trainingSet->setAsyncWriter(async);
+			neoCortex->setTrainingSet(trainingSet);
+		}
+		if(MERGE_TRANSPOSITIONS == 1) {
+			neoCortex->enableTranspositions();
+		}
+		if(N_EVALUATORS > 0) {
+			neoCortex->enablePipeline(N_EVALUATORS, EVALUATION_BATCH_SIZE);
+		}
 		
+		Adjudicator adjudicator(rules, rand());
+
 		int Nmoves = 0;
 		while((currentState->isFinalState() == 0) && (Nmoves < MAX_N_MOVES)) {
-			for(int i=0;i<MCTS_NUMBER_OF_SWEEPS;i++)
-			{
-				//std::cout << "Sweep number " << i << ".\n";
-				neoCortex->sweep();
+			bool full = (drand48() < FULL_SEARCH_FRACTION);
+			SearchStatistics statistics = neoCortex->search(full ? limits : fastLimits);
+			neoCortex->setRecordTarget(full);
+			searches[full]++;
+			sweeps[full] += statistics.sweeps;
+			if(full && adjudicator.update(currentState->getPlayer(), statistics.rootValue, Nmoves) == true) {
+				break;
 			}
 			
 			currentState = neoCortex->playBestMove();
@@ -95,14 +207,21 @@ int main(int argc, char* argv[]) {
 	        Nmoves++;
 		}
 
-		neoCortex->printBoardEvaluations();
+		//The result of a game which did not reach its end is the adjudicated one
+		int winner = currentState->getWinner();
+		if(adjudicator.getTermination() != GAME_PLAYED) {
+			winner = adjudicator.getWinner();
+			std::cout << ((adjudicator.getTermination() == GAME_RESIGNED) ? "Resigned after " : "Draw adjudicated after ") << Nmoves << " moves.\n";
+		}
+		neoCortex->printBoardEvaluations(winner, adjudicator.getTermination());
+		adjudication.add(adjudicator, winner);
 		
-		if(currentState->getWinner() == 1)
+		if(winner == 1)
 		{
 			std::cout << "White won!\n\n";
 			results[0]++;
 		}
-		else if(currentState->getWinner() == -1)
+		else if(winner == -1)
 		{
 			std::cout << "Black won!\n\n";
 			results[2]++;
@@ -114,16 +233,43 @@ int main(int argc, char* argv[]) {
 
 	    //Destroy and clean
 	    delete neoCortex;
+	    delete trainingSet;
+	}
+
+	//The AsyncWriter completes its writes, and is deleted before the writers used by its tasks
+	if(async != NULL) {
+		async->drain();
+		std::cout << async->getStatistics();
+		monitor << async->getStatistics();
+		delete async;
 	}
 
 	std::cout << "\n\nResults:\nWhite won " << (100 * results[0] / N_GAMES) << "%% of the games;\nBlack won " << (100 * results[2] / N_GAMES) << "%% of the games;\nDraws " << (100 * results[1] / N_GAMES) << "%% of the games;\n\n\n";
     monitor << "\n\nResults:\nWhite won " << (100 * results[0] / N_GAMES) << "%% of the games;\nBlack won " << (100 * results[2] / N_GAMES) << "%% of the games;\nDraws " << (100 * results[1] / N_GAMES) << "%% of the games;\n\n\n";
+    std::cout << adjudication.getSummary();
+    monitor << adjudication.getSummary();
+    std::cout << "Searches: " << searches[1] << " full (" << sweeps[1] << " sweeps, written as targets), " << searches[0] << " fast (" << sweeps[0] << " sweeps).\n";
+    monitor << "Searches: " << searches[1] << " full (" << sweeps[1] << " sweeps, written as targets), " << searches[0] << " fast (" << sweeps[0] << " sweeps).\n";
+    if(MCTS_PROFILING == 1) {
+    	std::cout << "Profile: " << Profiler::getJSON() << "\n";
+    	monitor << "Profile: " << Profiler::getJSON() << "\n";
+    	Profiler::writeJSON(PROFILE_FILE);
+    }
     monitor.flush();
 
-    for(int i=0;i<6;i++) {
-    	delete nets2[i];
+    delete recorder;
+    delete writer;
+    delete collector;
+
+    if(MULTI_HEAD == 1) {
+    	free_multi_net(&multi);
+    }
+    else {
+    	for(int i=0;i<6;i++) {
+    		delete nets2[i];
+    	}
+    	delete net1;
     }
-    delete net1;
 
     monitor.close();
 }
@@ -0,0 +1,300 @@
+#include <array>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <algorithm>
+#include <map>
+#include "Chess.hpp"
+#include "TrainingSet.hpp"
+#include "samples.h"
+
+
+std::mutex TrainingSet::filesMutex;
+
+
+//DATASET WRITER
+//CONSTRUCTORS
+DatasetWriter::DatasetWriter(std::string directory, int generation, int targetType, long shardSize) : directory(directory), generation(generation), targetType(targetType), shardSize(shardSize) {
+  this->opened.fill(false);
+  this->written.fill(0);
+}
+
+DatasetWriter::DatasetWriter(std::string directory) : DatasetWriter(directory, 0, DATASET_TARGET_TYPE, SAMPLES_PER_SHARD) { }
+
+
+//SET/GET methods
+std::string DatasetWriter::getDirectory(void) {
+  return this->directory;
+}
+
+long DatasetWriter::getNumberOfSamples(int network) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->written[network];
+}
+
+void DatasetWriter::setGeneration(int generation) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->generation = generation;
+}
+
+int DatasetWriter::getGeneration(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->generation;
+}
+
+
+//OUTPUT
+//Writes the first n samples of a network. Every record holds both the input and the target, so the games written concurrently by
+//several threads can not fall out of alignment.
+void DatasetWriter::write(int network, std::vector<std::vector<double>> &inputs, std::vector<std::vector<double>> &targets, size_t n) {
+  this->write(network, inputs, targets, n, this->getGeneration());
+}
+
+//The samples are written in shards of their own generation
+void DatasetWriter::write(int network, std::vector<std::vector<double>> &inputs, std::vector<std::vector<double>> &targets, size_t n, int generation) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  if(n == 0) {
+    return;
+  }
+
+  //The shards of a network are opened with the sizes of its first sample
+  if(this->opened[network] == false) {
+    std::string prefix = this->directory + "/" + NETWORK_NAMES[network];
+
+    //The inputs are -1, 0 or 1, apart from the counters of the first network
+    int inputType = (network == PIECES_NETWORK) ? SAMPLES_INT16 : SAMPLES_TERNARY;
+
+    open_samples_writer(&(this->writers[network]), (char*)prefix.c_str(), inputs[0].size(), targets[0].size(), inputType, this->targetType, generation, this->shardSize);
+    this->opened[network] = true;
+  }
+  set_samples_generation(&(this->writers[network]), generation);
+
+  for(size_t i=0;i<n;i++) {
+    write_sample(&(this->writers[network]), &(inputs[i][0]), &(targets[i][0]));
+  }
+  this->written[network] += n;
+}
+
+
+void DatasetWriter::flush(void) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  for(int network=0;network<N_NETWORKS;network++) {
+    if(this->opened[network] == true) {
+      next_samples_shard(&(this->writers[network]));
+    }
+  }
+}
+
+
+//DESTRUCTOR
+DatasetWriter::~DatasetWriter(void) {
+  for(int network=0;network<N_NETWORKS;network++) {
+    if(this->opened[network] == true) {
+      close_samples_writer(&(this->writers[network]));
+    }
+  }
+}
+
+
+
+
+//TRAINING SET
+//CONSTRUCTORS
+TrainingSet::TrainingSet(std::string directory) : directory(directory), writer(NULL), async(NULL), generation(-1) { }
+
+TrainingSet::TrainingSet(DatasetWriter *writer) : directory(writer->getDirectory()), writer(writer), async(NULL), generation(-1) { }
+
+TrainingSet::TrainingSet(void) : TrainingSet("TrainingSet") { }
+
+
+//SET/GET methods
+std::string TrainingSet::getDirectory(void) {
+  return this->directory;
+}
+
+void TrainingSet::setAsyncWriter(AsyncWriter *async) {
+  this->async = async;
+}
+
+void TrainingSet::setGeneration(int generation) {
+  this->generation = generation;
+}
+
+
+//OUTPUT
+void TrainingSet::printInput(int network, std::vector<double> &input) {
+  this->inputs[network].push_back(input);
+}
+
+void TrainingSet::printOutput(int network, std::vector<double> &output) {
+  this->outputs[network].push_back(output);
+}
+
+void TrainingSet::printZ(double z) {
+  this->z.push_back(z);
+}
+
+//Prints the samples of a position, given the probabilities to play its legal moves (in the order of ChessState::getLegalMoves):
+//for each starting square, the input of the network of the piece type with the probabilities of its moves, then the input of the
+//first network with the probabilities of the starting squares
+void TrainingSet::printPosition(ChessState *state, std::vector<double> &probabilities) {
+  std::vector<ChessMove> legalMoves = state->getLegalMoves();
+  std::vector<double> firstNetworkInput = state->getFirstNetworkInput();
+  std::vector<double> firstNetworkOutput(64, 0.);
+  std::map<int,std::vector<double>> secondNetworkOutput;
+  std::map<int,int> pieces;
+
+  for(int i=0;i<legalMoves.size();i++) {
+    int square0 = legalMoves[i].startingSquare;
+
+    //Get the piece that has to be moved
+    if(pieces.count(square0) == 0) {
+      if(state->getPlayer() == 1) {
+        pieces[square0] = PIECES_TYPES[state->getBoard()[square0]];
+      } else {
+        pieces[square0] = PIECES_TYPES[state->getBoard()[(63-square0)]];
+      }
+      secondNetworkOutput[square0] = std::vector<double>(SECOND_NETWORK_OUTPUTS[pieces[square0]], 0.);
+    }
+
+    firstNetworkOutput[square0] += probabilities[i];
+    secondNetworkOutput[square0][legalMoves[i].id] += probabilities[i];
+  }
+
+  for(std::map<int,std::vector<double>>::iterator output = secondNetworkOutput.begin(); output != secondNetworkOutput.end(); ++output) {
+    double Normalization = firstNetworkOutput[output->first];
+
+    if(Normalization != 0) {
+      for(std::vector<double>::iterator prob = output->second.begin(); prob != output->second.end(); ++prob) {
+        (*prob) /= Normalization;
+      }
+
+      std::vector<double> secondNetworkInput = state->getSecondNetworkInput(output->first);
+      this->printInput(pieces[output->first], secondNetworkInput);
+      this->printOutput(pieces[output->first], output->second);
+    }
+  }
+
+  double Normalization = 0.;
+  for(std::vector<double>::iterator prob = firstNetworkOutput.begin(); prob != firstNetworkOutput.end(); ++prob) {
+    Normalization += (*prob);
+  }
+  for(std::vector<double>::iterator prob = firstNetworkOutput.begin(); prob != firstNetworkOutput.end(); ++prob) {
+    (*prob) /= Normalization;
+  }
+
+  this->printInput(PIECES_NETWORK, firstNetworkInput);
+  this->printOutput(PIECES_NETWORK, firstNetworkOutput);
+}
+
+//Prints the sample of the first network of a position searched only to play the game: its probabilities are zero, so that only
+//the value is trained on it (see masked_policy in net.h), and there are no samples of the second networks
+void TrainingSet::printValuePosition(ChessState *state) {
+  std::vector<double> firstNetworkInput = state->getFirstNetworkInput();
+  std::vector<double> firstNetworkOutput(64, 0.);
+
+  this->printInput(PIECES_NETWORK, firstNetworkInput);
+  this->printOutput(PIECES_NETWORK, firstNetworkOutput);
+}
+
+
+//Appends the samples collected so far to the files of the directory
+void TrainingSet::flush(void) {
+  bool empty = (this->z.size() == 0);
+  for(int network=0;network<N_NETWORKS;network++) {
+    empty = empty && (this->inputs[network].size() == 0) && (this->outputs[network].size() == 0);
+  }
+  if(empty) {
+    return;
+  }
+
+  //Hand the samples to the background thread, in a training set of their own
+  if(this->async != NULL) {
+    TrainingSet *samples = (this->writer != NULL) ? new TrainingSet(this->writer) : new TrainingSet(this->directory);
+
+    samples->generation = this->generation;
+    samples->inputs.swap(this->inputs);
+    samples->outputs.swap(this->outputs);
+    samples->z.swap(this->z);
+
+    this->async->submit([samples]() {
+      samples->flush();
+      delete samples;
+    });
+    return;
+  }
+
+  if(this->writer != NULL) {
+    for(int network=0;network<N_NETWORKS;network++) {
+      size_t n = std::min(this->inputs[network].size(), this->outputs[network].size());
+
+      //The target of the first network is completed by z, known only at the end of the game
+      if(network == PIECES_NETWORK) {
+        n = std::min(n, this->z.size());
+        for(size_t i=0;i<n;i++) {
+          this->outputs[network][i].push_back(this->z[i]);
+        }
+        this->z.erase(this->z.begin(), this->z.begin() + n);
+      }
+
+      if(this->generation >= 0) {
+        this->writer->write(network, this->inputs[network], this->outputs[network], n, this->generation);
+      }
+      else {
+        this->writer->write(network, this->inputs[network], this->outputs[network], n);
+      }
+
+      this->inputs[network].erase(this->inputs[network].begin(), this->inputs[network].begin() + n);
+      this->outputs[network].erase(this->outputs[network].begin(), this->outputs[network].begin() + n);
+    }
+
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(TrainingSet::filesMutex);
+  std::ofstream file;
+
+  for(int network=0;network<N_NETWORKS;network++) {
+    if(this->inputs[network].size() > 0) {
+      file.open((this->directory + "/" + NETWORK_NAMES[network] + "_input.dat").c_str(), std::ios::out | std::ios::app);
+      for(size_t i=0;i<this->inputs[network].size();i++) {
+        for(size_t j=0;j<this->inputs[network][i].size();j++) {
+          file << this->inputs[network][i][j] << " ";
+        }
+        file << "\n";
+      }
+      file.close();
+    }
+    if(this->outputs[network].size() > 0) {
+      file.open((this->directory + "/" + NETWORK_NAMES[network] + "_output.dat").c_str(), std::ios::out | std::ios::app);
+      for(size_t i=0;i<this->outputs[network].size();i++) {
+        for(size_t j=0;j<this->outputs[network][i].size();j++) {
+          file << this->outputs[network][i][j] << " ";
+        }
+        file << "\n";
+      }
+      file.close();
+    }
+
+    this->inputs[network].clear();
+    this->outputs[network].clear();
+  }
+
+  if(this->z.size() > 0) {
+    file.open((this->directory + "/z.dat").c_str(), std::ios::out | std::ios::app);
+    for(size_t i=0;i<this->z.size();i++) {
+      file << this->z[i] << "\n";
+    }
+    file.close();
+  }
+  this->z.clear();
+}
+
+
+//DESTRUCTOR
+TrainingSet::~TrainingSet(void) {
+  this->flush();
+}
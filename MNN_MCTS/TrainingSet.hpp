@@ -0,0 +1,147 @@
+/*
+    TrainingSet.hpp:
+        Library for the output of the training datasets of the networks.
+        A TrainingSet collects in memory the inputs and the target outputs of the first network (pieces) and of the six second networks
+        (one for each piece type), together with the final results of the game (z), and appends them to the files of the training directory
+        when flushed. The files are appended under a global lock, so that the games played concurrently by several threads are written one
+        after the other, keeping the inputs, the outputs and z aligned.
+        When a DatasetWriter is given, the samples are written instead in the binary shards of samples.h: the writer keeps the shards open
+        for the whole run and buffers them in memory, and the target of the first network is followed by z in the same record.
+        With an AsyncWriter, flush only hands the samples to its thread, which formats and writes them in the background.
+        The binary shards are tagged with the generation of the networks which played the games: a TrainingSet writes its samples with
+        its own generation, if set, otherwise with the current one of the DatasetWriter.
+
+        @author: Massimiliano Chiappini
+        @contact: massimilianochiappini@gmail.com
+        @version: 0.2
+*/
+
+
+
+#ifndef TRAININGSET_HPP
+#define TRAININGSET_HPP
+
+#include <array>
+#include <vector>
+#include <string>
+#include <mutex>
+#include "Chess.hpp"
+#include "samples.h"
+#include "AsyncWriter.hpp"
+
+
+//The first network follows the six second networks (indexed by piece type)
+#define PIECES_NETWORK 6
+#define N_NETWORKS 7
+
+const std::array<std::string,N_NETWORKS> NETWORK_NAMES = {"pawn", "rook", "knight", "bishop", "queen", "king", "pieces"};
+
+//Number of outputs of the second networks, indexed by piece type
+const std::array<int,6> SECOND_NETWORK_OUTPUTS = {12, 28, 8, 28, 56, 10};
+
+//Binary shards
+#define SAMPLES_PER_SHARD 100000
+#define DATASET_TARGET_TYPE SAMPLES_FLOAT16
+
+
+
+
+//DATASET WRITER
+//Binary shards of the seven networks, shared by all the games of a run
+class DatasetWriter {
+  private:
+    std::string directory;
+    int generation;
+    int targetType;
+    long shardSize;
+
+    std::array<samples_writer,N_NETWORKS> writers;
+    std::array<bool,N_NETWORKS> opened;
+    std::array<long,N_NETWORKS> written;
+
+    std::mutex mutex;
+
+
+  public:
+    //CONSTRUCTORS
+    DatasetWriter(std::string, int, int, long);
+    DatasetWriter(std::string);
+
+    DatasetWriter(const DatasetWriter&) = delete;
+    DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+
+    //SET/GET methods
+    std::string getDirectory(void);
+    long getNumberOfSamples(int);
+    void setGeneration(int);
+    int getGeneration(void);
+
+
+    //OUTPUT
+    void write(int, std::vector<std::vector<double>>&, std::vector<std::vector<double>>&, size_t, int);
+    void write(int, std::vector<std::vector<double>>&, std::vector<std::vector<double>>&, size_t);
+    //Completes the open shards, so that their samples can be read
+    void flush(void);
+
+
+    //DESTRUCTOR
+    ~DatasetWriter(void);
+};
+
+
+
+
+//TRAINING SET
+class TrainingSet {
+  private:
+    //Directory of the dataset files
+    std::string directory;
+    //Binary output (NULL for the text files)
+    DatasetWriter *writer;
+    //Background output (NULL to write in flush)
+    AsyncWriter *async;
+    //Generation of the networks which produced the samples (-1 for the one of the DatasetWriter)
+    int generation;
+
+    //Samples not written yet
+    std::array<std::vector<std::vector<double>>,N_NETWORKS> inputs;
+    std::array<std::vector<std::vector<double>>,N_NETWORKS> outputs;
+    std::vector<double> z;
+
+    //Lock on the dataset files, shared by all the training sets
+    static std::mutex filesMutex;
+
+
+  public:
+    //CONSTRUCTORS
+    TrainingSet(std::string);
+    TrainingSet(DatasetWriter*);
+    TrainingSet(void);
+
+    TrainingSet(const TrainingSet&) = delete;
+    TrainingSet& operator=(const TrainingSet&) = delete;
+
+
+    //SET/GET methods
+    std::string getDirectory(void);
+    void setAsyncWriter(AsyncWriter*);
+    void setGeneration(int);
+
+
+    //OUTPUT
+    void printInput(int, std::vector<double>&);
+    void printOutput(int, std::vector<double>&);
+    void printZ(double);
+    void printPosition(ChessState*, std::vector<double>&);
+    void printValuePosition(ChessState*);
+
+    void flush(void);
+
+
+    //DESTRUCTOR
+    ~TrainingSet(void);
+};
+
+
+#endif
@@ -7,27 +7,37 @@
 #include <cfloat>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "Chess.hpp"
 #include "MCTS.hpp"
 #include "Tree.hpp"
+#include "TrainingSet.hpp"
 #include "net.h"
+#include "Profiler.hpp"
 
 
 #define DEBUG_MODE 0
 
 
 //Dirichlet noise functions
-double gamma1(double alpha) {
+double gamma1(double alpha, std::mt19937 &generator) {
   double umax, vmin, vmax;
   double u, t, t1;
+  std::uniform_real_distribution<double> uniform(0., 1.);
 
   umax = pow((alpha/exp(1.0)), 0.5*alpha);
   vmin = -2.0/exp(1.0);
   vmax = 2.0*alpha/exp(1.0)/(exp(1.0)-alpha);
   do {
-    u = (double) lrand48()/RAND_MAX;
+    u = uniform(generator);
     u *= umax;
-    t = (double) lrand48()/RAND_MAX;
+    t = uniform(generator);
     t = (t*(vmax-vmin)+vmin)/u;
     t1 = exp(t/alpha);
   } while(2.0*log(u)>(t-t1));
@@ -39,13 +49,13 @@ double gamma1(double alpha) {
   }
 }
 
-void dirichlet(double alpha, int size, double *p) {
+void dirichlet(double alpha, int size, double *p, std::mt19937 &generator) {
   int i;
   double norm;
 
   norm = 0.0;
   for(i=0; i<size; i++) {
-    *(p + i) = gamma1(alpha);
+    *(p + i) = gamma1(alpha, generator);
     norm += *(p + i);
   }
   for(i=0; i<size; i++) {
@@ -54,6 +64,119 @@ void dirichlet(double alpha, int size, double *p) {
 }
 
 
+//LEAF EVALUATION
+LeafEvaluation::LeafEvaluation(Node *leaf) : leaf(leaf), v(0) { }
+
+
+//TRANSPOSITION TABLE
+TranspositionEntry::TranspositionEntry(void) : n(0), W(0), evaluated(false), v(0), references(1) { }
+
+//The entry is deleted by the last of its owners
+void TranspositionEntry::release(void) {
+  if(this->references.fetch_sub(1) == 1) {
+    delete this;
+  }
+}
+
+
+//CONSTRUCTORS
+TranspositionTable::TranspositionTable(void) : hits(0), misses(0) { }
+
+
+//ENTRIES
+//Returns the entry of the position, creating it if needed. The caller owns a reference to it.
+TranspositionEntry* TranspositionTable::acquire(uint64_t key) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+  TranspositionEntry* entry;
+
+  std::unordered_map<uint64_t,TranspositionEntry*>::iterator found = this->entries.find(key);
+  if(found == this->entries.end()) {
+    entry = new TranspositionEntry();
+    this->entries[key] = entry;
+  }
+  else {
+    entry = found->second;
+  }
+
+  entry->references++;
+  return entry;
+}
+
+//Copies the outputs of the networks if the position has already been evaluated
+bool TranspositionTable::lookupEvaluation(TranspositionEntry *entry, LeafEvaluation *evaluation) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+
+  if(entry->evaluated == false) {
+    this->misses++;
+    return false;
+  }
+
+  evaluation->p1 = entry->p1;
+  evaluation->p2 = entry->p2;
+  evaluation->v = entry->v;
+  this->hits++;
+  return true;
+}
+
+void TranspositionTable::storeEvaluation(TranspositionEntry *entry, LeafEvaluation *evaluation) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+
+  if(entry->evaluated == false) {
+    entry->p1 = evaluation->p1;
+    entry->p2 = evaluation->p2;
+    entry->v = evaluation->v;
+    entry->evaluated = true;
+  }
+}
+
+//Removes the entries which are not used by any node anymore
+void TranspositionTable::purge(void) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+
+  std::unordered_map<uint64_t,TranspositionEntry*>::iterator entry = this->entries.begin();
+  while(entry != this->entries.end()) {
+    if(entry->second->references.load() == 1) {
+      entry->second->release();
+      entry = this->entries.erase(entry);
+    }
+    else {
+      ++entry;
+    }
+  }
+}
+
+
+//STATISTICS
+int TranspositionTable::getSize(void) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+  return this->entries.size();
+}
+
+long TranspositionTable::getNumberOfHits(void) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+  return this->hits;
+}
+
+long TranspositionTable::getNumberOfMisses(void) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+  return this->misses;
+}
+
+
+//DESTRUCTOR
+//The entries still used by some node survive until that node is deleted
+TranspositionTable::~TranspositionTable(void) {
+  std::lock_guard<std::mutex> lock(this->entriesMutex);
+
+  for(std::unordered_map<uint64_t,TranspositionEntry*>::iterator entry = this->entries.begin(); entry != this->entries.end(); ++entry) {
+    entry->second->release();
+  }
+  this->entries.clear();
+}
+
+
+
+
 //NODE
 //Ordering criterium based on Q+U
 struct CompareNodes {
@@ -69,6 +192,9 @@ Node::Node(ChessState *state, Node* parent, Tree *tree, double p, int piece, int
   this->nc = 0;
   this->W = 0;
   this->Q = 0;
+  this->v = 0;
+  this->pending = false;
+  this->entry = NULL;
 }
 
 Node::Node(ChessState *state, Node* parent, Tree *tree, double p)  : parent(parent), state(state), tree(tree), p(p) {
@@ -79,6 +205,9 @@ Node::Node(ChessState *state, Node* parent, Tree *tree, double p)  : parent(pare
   this->nc = 0;
   this->W = 0;
   this->Q = 0;
+  this->v = 0;
+  this->pending = false;
+  this->entry = NULL;
 }
 
 Node::Node(ChessState *state, Node* parent, Tree *tree)  : parent(parent), state(state), tree(tree) {
@@ -90,6 +219,9 @@ Node::Node(ChessState *state, Node* parent, Tree *tree)  : parent(parent), state
   this->W = 0;
   this->Q = 0;
   this->p = 0;
+  this->v = 0;
+  this->pending = false;
+  this->entry = NULL;
 }
 
 Node::Node(ChessState *state, Node* parent)  : parent(parent), state(state) {
@@ -101,6 +233,9 @@ Node::Node(ChessState *state, Node* parent)  : parent(parent), state(state) {
   this->W = 0;
   this->Q = 0;
   this->p = 0;
+  this->v = 0;
+  this->pending = false;
+  this->entry = NULL;
 }
 
 Node::Node(ChessState *state, Tree *tree) : Node(state, (Node*)NULL, tree) {}
@@ -137,7 +272,28 @@ int Node::getId(void) {
   return this->id;
 }
 
+//Index of the move leading to this node among the legal moves of the parent (the children are sorted during the search)
+int Node::getMoveIndex(void) {
+  std::vector<ChessMove> legalMoves = this->parent->getState()->getLegalMoves();
+
+  for(int i=0;i<legalMoves.size();i++) {
+    if((legalMoves[i].startingSquare == this->startingSquare) && (legalMoves[i].id == this->id)) {
+      return i;
+    }
+  }
+
+  throw std::runtime_error("The move of the node is not a legal move of its parent.");
+}
+
 void Node::addChild(Node *newChild) {
+  //In a DAG, the child shares the statistics of its position
+  if((this->tree != NULL) && (this->tree->getTable() != NULL)) {
+    newChild->setEntry(this->tree->getTable()->acquire(newChild->getState()->getPositionKey()));
+  }
+  if(this->tree != NULL) {
+    this->tree->addCreatedNodes(1);
+  }
+
   this->children.push_back(newChild);
   
   //Sort the children on ascending value of Q+U
@@ -145,6 +301,16 @@ void Node::addChild(Node *newChild) {
 }
 
 void Node::addChildren(std::vector<Node*> newChildren) {
+  //In a DAG, the children share the statistics of their positions
+  if((this->tree != NULL) && (this->tree->getTable() != NULL)) {
+    for(std::vector<Node*>::iterator child = newChildren.begin(); child != newChildren.end(); ++child) {
+      (*child)->setEntry(this->tree->getTable()->acquire((*child)->getState()->getPositionKey()));
+    }
+  }
+  if(this->tree != NULL) {
+    this->tree->addCreatedNodes(newChildren.size());
+  }
+
   this->children.insert(this->children.end(), newChildren.begin(), newChildren.end());
   
   //Sort the children on ascending value of Q+U
@@ -162,7 +328,8 @@ Node* Node::getRandomChild(void) {
     return NULL;
   }
   
-  return this->children[std::rand()%this->children.size()];
+  std::uniform_int_distribution<int> uniform(0, this->children.size() - 1);
+  return this->children[uniform(this->tree->getGenerator())];
 }
 
 Node* Node::getBestChild(void) {
@@ -197,7 +364,8 @@ Node* Node::getChildToPlay(void) {
     Normalization += moveProbabilities[i];
   }
 
-  double r = ((double)std::rand() / RAND_MAX) * Normalization;
+  std::uniform_real_distribution<double> uniform(0., 1.);
+  double r = uniform(this->tree->getGenerator()) * Normalization;
   int i = 0;
   Normalization = moveProbabilities[0];
   while(Normalization < r) {
@@ -268,7 +436,12 @@ double Node::getTotalAction(void) {
 }
 
 
+//In a DAG, the mean action is the one of the position over all its paths
 double Node::getMeanAction(void) {
+  if((this->entry != NULL) && (this->entry->n > 0)) {
+    return this->entry->W / this->entry->n;
+  }
+
   return this->Q;
 }
 
@@ -276,6 +449,26 @@ double Node::getU(void) {
   return this->U;
 }
 
+double Node::getValue(void) {
+  return this->v;
+}
+
+void Node::setPending(bool pending) {
+  this->pending = pending;
+}
+
+bool Node::isPending(void) {
+  return this->pending;
+}
+
+void Node::setEntry(TranspositionEntry *entry) {
+  this->entry = entry;
+}
+
+TranspositionEntry* Node::getEntry(void) {
+  return this->entry;
+}
+
 
 //TO OPTIMIZE
 double Node::getPlayProbability(void) {
@@ -313,208 +506,14 @@ bool Node::isLeaf(void) {
 
 
 
-void Node::printNetworkDatasets(void) {
-  std::ofstream pieces_input, pieces_output, pawn_input, pawn_output, rook_input, rook_output, knight_input, knight_output, bishop_input, bishop_output, queen_input, queen_output, king_input, king_output;
-  std::set<int> startingPieces;
-  std::vector<double> firstNetworkInput;
-  std::vector<double> firstNetworkOutput;
-  std::unordered_map<int,std::vector<double>> secondNetworkInput;
-  std::unordered_map<int,std::vector<double>> secondNetworkOutput;
-
-  //First of all, let's open the files to print the outputs
-  pieces_input.open("TrainingSet/pieces_input.dat", std::ios::out | std::ios::app);
-  pieces_output.open("TrainingSet/pieces_output.dat", std::ios::out | std::ios::app);
-  pawn_input.open("TrainingSet/pawn_input.dat", std::ios::out | std::ios::app);
-  pawn_output.open("TrainingSet/pawn_output.dat", std::ios::out | std::ios::app);
-  rook_input.open("TrainingSet/rook_input.dat", std::ios::out | std::ios::app);
-  rook_output.open("TrainingSet/rook_output.dat", std::ios::out | std::ios::app);
-  knight_input.open("TrainingSet/knight_input.dat", std::ios::out | std::ios::app);
-  knight_output.open("TrainingSet/knight_output.dat", std::ios::out | std::ios::app);
-  bishop_input.open("TrainingSet/bishop_input.dat", std::ios::out | std::ios::app);
-  bishop_output.open("TrainingSet/bishop_output.dat", std::ios::out | std::ios::app);
-  queen_input.open("TrainingSet/queen_input.dat", std::ios::out | std::ios::app);
-  queen_output.open("TrainingSet/queen_output.dat", std::ios::out | std::ios::app);
-  king_input.open("TrainingSet/king_input.dat", std::ios::out | std::ios::app);
-  king_output.open("TrainingSet/king_output.dat", std::ios::out | std::ios::app);
-
+void Node::printNetworkDatasets(TrainingSet *trainingSet) {
+  std::vector<double> playProbabilities(this->state->getLegalMoves().size(), 0.);
 
-  //Get the input for the first network from the current state
-  firstNetworkInput = this->state->getFirstNetworkInput();
-  //And set up the output
-  firstNetworkOutput = std::vector<double>(64, 0.);
-
-
-  //Then, get all the starting squares in the current board
   for(std::vector<Node*>::iterator child = this->children.begin(); child != this->children.end(); ++child) {
-     startingPieces.insert((*child)->getStartingSquare());
-  }
-
-
-  //And, for each of the starting pieces
-  for(std::set<int>::iterator square0 = startingPieces.begin(); square0 != startingPieces.end(); ++square0) {
-  	int piece0;
-
-  	//Get the piece that has to be moved
-  	if(this->getPlayer() == 1) {
-  		piece0 = PIECES_TYPES[this->state->getBoard()[(*square0)]];
-  	} else {
-  		piece0 = PIECES_TYPES[this->state->getBoard()[(63-(*square0))]];
-  	}
-
-  	//And, consequently, get the input for the net
-  	secondNetworkInput[(*square0)] = this->state->getSecondNetworkInput((*square0));
-  	//And set the output
-  	switch(piece0) {
-  		case PAWN:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(12, 0.);
-  			break;
-
-  		case ROOK:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(28, 0.);
-  			break;
-
-  		case KNIGHT:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(8, 0.);
-  			break;
-
-  		case BISHOP:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(28, 0.);
-  			break;
-
-  		case QUEEN:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(56, 0.);
-  			break;
-
-  		case KING:
-  			secondNetworkOutput[(*square0)] = std::vector<double>(10, 0.);
-  			break;
-  	}
-
-  	//Then, cycle over all the children in which this piece is moved
-  	double Normalization = 0.;
-	  for(std::vector<Node*>::iterator child = this->children.begin(); child != this->children.end(); ++child) {
-	   if((*child)->getStartingSquare() == (*square0)) {
-	   	//Get the probability to play this move
-	   	double p = (*child)->getPlayProbability();
-
-	   	//And add it to the corrisponding outputs
-	   	Normalization+= p;
-	   	firstNetworkOutput[(*square0)] += p;
-	   	secondNetworkOutput[(*square0)][(*child)->getId()] += p;
-	   }
-	  }
-
-    if(Normalization != 0) {
-    	//Then normalize the probability
-    	for(std::vector<double>::iterator prob = secondNetworkOutput[(*square0)].begin(); prob != secondNetworkOutput[(*square0)].end(); ++prob) {
-    		(*prob) /= Normalization;
-    	}
-
-    	//And print it
-    	switch(piece0) {
-      		case PAWN:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  pawn_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			pawn_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  pawn_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			pawn_output << "\n";	
-      			break;
-
-      		case ROOK:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  rook_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			rook_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  rook_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			rook_output << "\n";
-      			break;
-
-      		case KNIGHT:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  knight_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			knight_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  knight_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			knight_output << "\n";	
-      			break;
-
-      		case BISHOP:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  bishop_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			bishop_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  bishop_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			bishop_output << "\n";	
-      			break;
-
-      		case QUEEN:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  queen_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			queen_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  queen_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			queen_output << "\n";	
-      			break;
-
-      		case KING:
-    			for(int i=0;i<secondNetworkInput[(*square0)].size();i++) {
-    		 	  king_input << secondNetworkInput[(*square0)][i] << " ";
-    			}
-    			king_input << "\n";
-    			for(int i=0;i<secondNetworkOutput[(*square0)].size();i++) {
-    		 	  king_output << secondNetworkOutput[(*square0)][i] << " ";
-    			}
-    			king_output << "\n";	
-      			break;
-      	}
-      }
-  }
-
-  //Then, normalize the piece probabilities
-  double Normalization = 0.;
-  for(std::vector<double>::iterator prob = firstNetworkOutput.begin(); prob != firstNetworkOutput.end(); ++prob) {
-	   Normalization += (*prob);
-  }
-  for(std::vector<double>::iterator prob = firstNetworkOutput.begin(); prob != firstNetworkOutput.end(); ++prob) {
-	   (*prob) /= Normalization;
-  }
-
-
-  //And print it
-  for(int i=0;i<firstNetworkInput.size();i++) {
-    pieces_input << firstNetworkInput[i] << " ";
-  }
-  pieces_input << "\n";
-  for(int i=0;i<firstNetworkOutput.size();i++) {
-    pieces_output << firstNetworkOutput[i] << " ";
+    playProbabilities[(*child)->getMoveIndex()] = (*child)->getPlayProbability();
   }
-  pieces_output << "\n";
 
-  pieces_input.close();
-  pieces_output.close();
-  pawn_input.close();
-  pawn_output.close();
-  rook_input.close();
-  rook_output.close();
-  knight_input.close();
-  knight_output.close();
-  bishop_input.close();
-  bishop_output.close();
-  queen_input.close();
-  queen_output.close();
-  king_input.close();
-  king_output.close();
+  trainingSet->printPosition(this->state, playProbabilities);
 }
 
 
@@ -529,6 +528,10 @@ void Node::cutBranch(void) {
     child = this->children.erase(child); 
   }
 
+  if(this->entry != NULL) {
+    this->entry->release();
+  }
+
   delete this->state;
 
   delete this;
@@ -536,7 +539,13 @@ void Node::cutBranch(void) {
 
 
 void Node::pruneOtherBranches(Node* branchToSave) {
+  PROFILE_PHASE(PHASE_PRUNE);
   std::vector<Node*>::iterator branch;
+  BranchCollector* collector = NULL;
+
+  if(this->tree != NULL) {
+    collector = this->tree->getCollector();
+  }
 
   branch = this->children.begin();
   while(branch != this->children.end()) {
@@ -544,7 +553,14 @@ void Node::pruneOtherBranches(Node* branchToSave) {
       ++branch;
     }
     else {
-      (*branch)->cutBranch();
+      //Detach the branch, and delete it now or leave it to the collector
+      (*branch)->setParent(NULL);
+      if(collector != NULL) {
+        collector->collect(*branch);
+      }
+      else {
+        (*branch)->cutBranch();
+      }
       branch = this->children.erase(branch);
     }
   }
@@ -554,74 +570,30 @@ void Node::pruneOtherBranches(Node* branchToSave) {
 
 
 void Node::buildChildren(void) {
-  std::vector<double> p1;
-  std::unordered_map<int,std::vector<double>> p2;
-  std::set<int> startingPieces;
-  std::vector<ChessMove> legalMoves;
-  std::vector<Node*> newChildren;
+  LeafEvaluation evaluation(this);
+  std::vector<LeafEvaluation*> batch(1, &evaluation);
 
-  //std::cout << "Building the children.\n\n";
+  //Get the move probabilities of the various pieces to move from the current state as evaluated by the neural network
+  this->tree->evaluate(batch);
 
+  this->buildChildren(&evaluation);
+}
 
-  //Get the move probabilities of the various pieces to move from the current state as evaluated by the neural network
-  std::vector<double> firstNetworkInput = this->state->getFirstNetworkInput();
-  p1 = std::vector<double>(get_output_size(this->tree->getNetwork1()), 0.);
-  predict(this->tree->getNetwork1(), &(firstNetworkInput[0]), &(p1[0]));
 
+//Build the children from the outputs of the networks already computed for this node
+void Node::buildChildren(LeafEvaluation *evaluation) {
+  PROFILE_PHASE(PHASE_BUILD_CHILDREN);
+  std::vector<ChessMove> legalMoves;
+  std::vector<Node*> newChildren;
+  std::vector<double> &p1 = evaluation->p1;
+  std::unordered_map<int,std::vector<double>> &p2 = evaluation->p2;
 
-  //std::cout << "Probabilities of starting pieces:\n";
-  //for(int i=0;i<p1.size();i++) {
-  //  std::cout << p1[i] << " ";
-  //}
-  //std::cout << "\n\n";
+  //Keep the value of the state, which will be backpropagated
+  this->v = evaluation->v;
 
   //Get the legal moves from the current state
   legalMoves = this->state->getLegalMoves();
 
-  //std::cout << "Found " << legalMoves.size() << " legal moves, starting from the squares:\n";
-
-  //Then, check which are the possible starting pieces of the legal moves
-  for(std::vector<ChessMove>::iterator move = legalMoves.begin(); move != legalMoves.end(); ++move) {
-     startingPieces.insert((*move).startingSquare);
-  }
-
-  //for(std::set<int>::iterator square0 = startingPieces.begin(); square0 != startingPieces.end(); ++square0) {
-  //  std::cout << "- " << (*square0) << "\n";
-  //}
-  //std::cout << "\n\n";
-
-  //And, for each of them, get the probability of the various moves p2
-  for(std::set<int>::iterator square0 = startingPieces.begin(); square0 != startingPieces.end(); ++square0) {
-  	int piece0; 
-
-  	//Get the piece type that moves
-  	if(this->getPlayer() == 1) {
-  		piece0 = PIECES_TYPES[this->state->getBoard()[(*square0)]];
-  	} else {
-  		piece0 = PIECES_TYPES[this->state->getBoard()[(63-(*square0))]];
-  	}
-
-
-    if(p1[(*square0)] > SECOND_NET_TRESHOLD) {
-      std::vector<double> secondNetworkInput = this->state->getSecondNetworkInput(((*square0)));
-      p2[(*square0)] = std::vector<double>(get_output_size(this->tree->getNetworks2()[piece0]), 0.);
-      predict(this->tree->getNetworks2()[piece0], &(secondNetworkInput[0]), &(p2[(*square0)][0]));
-    }
-    else {
-      if(DEBUG_MODE) {
-        std::cout << "Treshold not met.\n";
-      }
-      p2[(*square0)] = std::vector<double>(get_output_size(this->tree->getNetworks2()[piece0]), 0.);
-    }
-
-    //std::cout << "Probabilities of the moves of piece " << piece0 << " from square " << (*square0) << ":\n";
-    //for(int i=0;i<p2[(*square0)].size();i++) {
-    //  std::cout << p2[(*square0)][i] << " ";
-    //}
-    //std::cout << "\n\n";
-  }
-
-  
   if(legalMoves.size() != 0)
   {
     //Consequently build the array of children
@@ -633,7 +605,7 @@ void Node::buildChildren(void) {
         exit(EXIT_FAILURE);
       }
 
-      dirichlet(MCTS_ALPHA, legalMoves.size(), noises);
+      dirichlet(MCTS_ALPHA, legalMoves.size(), noises, this->tree->getGenerator());
 
       double Normalization = 0;
       for(std::vector<ChessMove>::iterator move = legalMoves.begin(); move != legalMoves.end(); ++move) {
@@ -707,6 +679,11 @@ void Node::updateAction(double v) {
 
   this->W += v;
   this->Q = this->W / this->n;
+
+  if(this->entry != NULL) {
+    this->entry->n++;
+    this->entry->W += v;
+  }
 }
 
 void Node::updateU(void)
@@ -739,10 +716,143 @@ void Node::updateChildrenU(void)
   }
 }
 
+//A node on the path of a pending evaluation is counted as a lost visit, so that the other sweeps explore elsewhere
+void Node::addVirtualLoss(double loss)
+{
+  this->n++;
+  this->W -= loss;
+  this->Q = this->W / this->n;
+
+  if(this->entry != NULL) {
+    this->entry->n++;
+    this->entry->W -= loss;
+  }
+
+  if(this->parent != NULL) {
+    this->parent->updateChildrenU();
+  }
+}
+
+void Node::revertVirtualLoss(double loss)
+{
+  this->n--;
+  this->W += loss;
+
+  if(this->entry != NULL) {
+    this->entry->n--;
+    this->entry->W += loss;
+  }
+  if(this->n > 0) {
+    this->Q = this->W / this->n;
+  }
+  else {
+    this->Q = 0;
+  }
+
+  if(this->parent != NULL) {
+    this->parent->updateChildrenU();
+  }
+}
+
+
+//BRANCH COLLECTOR
+//CONSTRUCTORS
+//If background is true, the branches are freed by a low priority thread, otherwise only when freeBranches is called
+BranchCollector::BranchCollector(bool background) : running(background), freedBranches(0) {
+  if(background) {
+    this->thread = std::thread(&BranchCollector::work, this);
+  }
+}
+
+BranchCollector::BranchCollector(void) : BranchCollector(true) { }
+
+
+//Loop of the background thread
+void BranchCollector::work(void) {
+#ifdef __linux__
+  //Only run when the cores have nothing else to do
+  struct sched_param parameters;
+  parameters.sched_priority = 0;
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &parameters);
+#endif
+
+  std::unique_lock<std::mutex> lock(this->garbageMutex);
+  while(this->running) {
+    this->garbageAvailable.wait(lock, [this] { return (this->garbage.size() > 0) || (this->running == false); });
+
+    while(this->garbage.size() > 0) {
+      Node* branch = this->garbage.back();
+      this->garbage.pop_back();
+
+      //The branch is not reachable from any tree anymore, so it can be deleted without holding the lock
+      lock.unlock();
+      branch->cutBranch();
+      lock.lock();
+
+      this->freedBranches++;
+    }
+  }
+}
+
+
+//COLLECTION
+void BranchCollector::collect(Node* branch) {
+  {
+    std::lock_guard<std::mutex> lock(this->garbageMutex);
+    this->garbage.push_back(branch);
+  }
+  this->garbageAvailable.notify_one();
+}
+
+//Frees the pending branches on the calling thread
+void BranchCollector::freeBranches(void) {
+  std::vector<Node*> branches;
+
+  {
+    std::lock_guard<std::mutex> lock(this->garbageMutex);
+    branches.swap(this->garbage);
+  }
+
+  for(std::vector<Node*>::iterator branch = branches.begin(); branch != branches.end(); ++branch) {
+    (*branch)->cutBranch();
+  }
+
+  std::lock_guard<std::mutex> lock(this->garbageMutex);
+  this->freedBranches += branches.size();
+}
+
+long BranchCollector::getNumberOfFreedBranches(void) {
+  std::lock_guard<std::mutex> lock(this->garbageMutex);
+  return this->freedBranches;
+}
+
+int BranchCollector::getNumberOfPendingBranches(void) {
+  std::lock_guard<std::mutex> lock(this->garbageMutex);
+  return this->garbage.size();
+}
+
+
+//DESTRUCTOR
+BranchCollector::~BranchCollector(void) {
+  if(this->thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(this->garbageMutex);
+      this->running = false;
+    }
+    this->garbageAvailable.notify_one();
+    this->thread.join();
+  }
+
+  //Free whatever is left
+  this->freeBranches();
+}
+
+
+
 
 //TREE
 //CONSTRUCTORS
-Tree::Tree(Node *root, NN *net1, std::array<NN*, 6> nets2) : root(root), net1(net1), nets2(nets2) {
+Tree::Tree(Node *root, NN *net1, std::array<NN*, 6> nets2) : root(root), net1(net1), nets2(nets2), collector(NULL), table(NULL), createdNodes(0), generator(lrand48()) {
   this->root->setTree(this);
   if(DEBUG_MODE) {
     std::cout << "The net of piece " << PAWN << " has output of size " << get_output_size(nets2[PAWN]) << "\n";
@@ -753,7 +863,9 @@ Tree::Tree(Node *root, NN *net1, std::array<NN*, 6> nets2) : root(root), net1(ne
     std::cout << "The net of piece " << KING << " has output of size " << get_output_size(nets2[KING]) << "\n";
   } 
 }
-Tree::Tree(ChessState *state, NN *net1, std::array<NN*, 6> nets2) : root(new Node(state, this)), net1(net1), nets2(nets2) {
+Tree::Tree(ChessState *state, NN *net1, std::array<NN*, 6> nets2) : Tree(state, net1, nets2, lrand48()) { }
+
+Tree::Tree(ChessState *state, NN *net1, std::array<NN*, 6> nets2, unsigned int seed) : root(new Node(state, this)), net1(net1), nets2(nets2), collector(NULL), table(NULL), createdNodes(0), generator(seed) {
   if(DEBUG_MODE) {
     std::cout << "The net of piece " << PAWN << " has output of size " << get_output_size(nets2[PAWN]) << "\n";
     std::cout << "The net of piece " << ROOK << " has output of size " << get_output_size(nets2[ROOK]) << "\n";
@@ -778,7 +890,7 @@ void Tree::setRoot(Node *root) {
     exit(EXIT_FAILURE);
   }
 
-  dirichlet(MCTS_ALPHA, rootChildren.size(), noises);
+  dirichlet(MCTS_ALPHA, rootChildren.size(), noises, this->generator);
 
   int i = 0;
   for(std::vector<Node*>::iterator child = rootChildren.begin(); child != rootChildren.end(); ++child) {
@@ -791,6 +903,11 @@ void Tree::setRoot(Node *root) {
   }
 
   free(noises);
+
+  //The positions which are not reachable anymore are removed from the table
+  if(this->table != NULL) {
+    this->table->purge();
+  }
 }
 
 Node* Tree::getRoot(void) {
@@ -813,10 +930,205 @@ std::array<NN*, 6> Tree::getNetworks2(void) {
   return this->nets2;
 }
 
+void Tree::setCollector(BranchCollector *collector) {
+  this->collector = collector;
+}
+
+BranchCollector* Tree::getCollector(void) {
+  return this->collector;
+}
+
+//Merge the transpositions from now on: the nodes created from now on share the statistics of their positions
+void Tree::enableTranspositions(void) {
+  if(this->table != NULL) {
+    return;
+  }
+
+  this->table = new TranspositionTable();
+  if(this->root->getEntry() == NULL) {
+    this->root->setEntry(this->table->acquire(this->root->getState()->getPositionKey()));
+  }
+}
+
+void Tree::disableTranspositions(void) {
+  if(this->table != NULL) {
+    delete this->table;
+    this->table = NULL;
+  }
+}
+
+TranspositionTable* Tree::getTable(void) {
+  return this->table;
+}
+
+void Tree::addCreatedNodes(int nodes) {
+  this->createdNodes += nodes;
+}
+
+long Tree::getNumberOfCreatedNodes(void) {
+  return this->createdNodes;
+}
+
+//By default the generator is seeded from lrand48, a game can be reproduced by seeding it explicitly
+void Tree::seed(unsigned int seed) {
+  this->generator.seed(seed);
+}
+
+std::mt19937& Tree::getGenerator(void) {
+  return this->generator;
+}
+
+//NETWORK EVALUATION
+//Evaluates a batch of leaves of this tree. Only the states are read, so it can be called concurrently.
+void Tree::evaluate(std::vector<LeafEvaluation*> batch) {
+  std::vector<LeafEvaluation*> missing = this->lookupEvaluations(batch);
+
+  Tree::evaluateNetworks(this->net1, this->nets2, missing);
+  this->storeEvaluations(missing);
+}
+
+//In a DAG, the positions already evaluated through another path are not evaluated again: returns the leaves still to evaluate
+std::vector<LeafEvaluation*> Tree::lookupEvaluations(std::vector<LeafEvaluation*> batch) {
+  if(this->table == NULL) {
+    return batch;
+  }
+
+  std::vector<LeafEvaluation*> missing;
+  for(std::vector<LeafEvaluation*>::iterator evaluation = batch.begin(); evaluation != batch.end(); ++evaluation) {
+    TranspositionEntry *entry = (*evaluation)->leaf->getEntry();
+    if((entry == NULL) || (this->table->lookupEvaluation(entry, (*evaluation)) == false)) {
+      missing.push_back((*evaluation));
+    }
+  }
+  return missing;
+}
+
+void Tree::storeEvaluations(std::vector<LeafEvaluation*> batch) {
+  if(this->table == NULL) {
+    return;
+  }
+
+  for(std::vector<LeafEvaluation*>::iterator evaluation = batch.begin(); evaluation != batch.end(); ++evaluation) {
+    if((*evaluation)->leaf->getEntry() != NULL) {
+      this->table->storeEvaluation((*evaluation)->leaf->getEntry(), (*evaluation));
+    }
+  }
+}
+
+//Evaluates a batch of leaves, possibly of different trees sharing the same networks: the first network is run once on all of them,
+//then the starting squares are grouped by piece type and each of the second networks is run once on its group.
+//When the networks are the heads of a multi-head network (see multi_net in net.h), the trunk is run once on each position and
+//its features are shared by the heads
+void Tree::evaluateNetworks(NN *net1, std::array<NN*, 6> nets2, std::vector<LeafEvaluation*> batch) {
+  int nInput1 = get_input_size(net1);
+  int nOutput1 = get_output_size(net1);
+  std::array<std::vector<std::pair<int,int>>, 6> requests;
+  bool sharedTrunk = (net1->trunk != NULL);
+  int nFeatures = sharedTrunk ? get_output_size(net1->trunk) : 0;
+  std::vector<double> features;
+
+  if(batch.size() == 0) {
+    return;
+  }
+
+  //Probabilities of the starting squares and value
+  std::vector<double> inputs1(batch.size() * nInput1, 0.);
+  std::vector<double> outputs1(batch.size() * nOutput1, 0.);
+  for(int b=0;b<batch.size();b++) {
+    std::vector<double> firstNetworkInput = batch[b]->leaf->getState()->getFirstNetworkInput();
+    std::copy(firstNetworkInput.begin(), firstNetworkInput.begin() + std::min((int)firstNetworkInput.size(), nInput1), inputs1.begin() + b * nInput1);
+  }
+  if(sharedTrunk) {
+    features = std::vector<double>(batch.size() * nFeatures, 0.);
+    PROFILE_PHASE(PHASE_PREDICT);
+    predict_trunk_batch(net1, batch.size(), &(inputs1[0]), &(features[0]));
+    predict_head_batch(net1, batch.size(), &(features[0]), &(inputs1[0]), &(outputs1[0]));
+  }
+  else {
+    PROFILE_PHASE(PHASE_PREDICT);
+    predict_batch(net1, batch.size(), &(inputs1[0]), &(outputs1[0]));
+  }
+
+  for(int b=0;b<batch.size();b++) {
+    ChessState *state = batch[b]->leaf->getState();
+    std::vector<ChessMove> legalMoves = state->getLegalMoves();
+    std::set<int> startingPieces;
+
+    batch[b]->p1 = std::vector<double>(outputs1.begin() + b * nOutput1, outputs1.begin() + (b + 1) * nOutput1);
+    batch[b]->v = batch[b]->p1[nOutput1 - 1];
+
+    //Check which are the possible starting pieces of the legal moves
+    for(std::vector<ChessMove>::iterator move = legalMoves.begin(); move != legalMoves.end(); ++move) {
+      startingPieces.insert((*move).startingSquare);
+    }
+
+    for(std::set<int>::iterator square0 = startingPieces.begin(); square0 != startingPieces.end(); ++square0) {
+      int piece0;
+
+      //Get the piece type that moves
+      if(state->getPlayer() == 1) {
+        piece0 = PIECES_TYPES[state->getBoard()[(*square0)]];
+      } else {
+        piece0 = PIECES_TYPES[state->getBoard()[(63-(*square0))]];
+      }
+
+      batch[b]->p2[(*square0)] = std::vector<double>(get_output_size(nets2[piece0]), 0.);
+
+      if(batch[b]->p1[(*square0)] > SECOND_NET_TRESHOLD) {
+        requests[piece0].push_back(std::make_pair(b, (*square0)));
+      }
+      else {
+        if(DEBUG_MODE) {
+          std::cout << "Treshold not met.\n";
+        }
+      }
+    }
+  }
+
+  //Probabilities of the moves, one batch for each piece type
+  for(int piece0=0;piece0<6;piece0++) {
+    if(requests[piece0].size() == 0) {
+      continue;
+    }
+
+    int nInput2 = get_input_size(nets2[piece0]);
+    int nOutput2 = get_output_size(nets2[piece0]);
+    std::vector<double> inputs2(requests[piece0].size() * nInput2, 0.);
+    std::vector<double> outputs2(requests[piece0].size() * nOutput2, 0.);
+
+    for(int r=0;r<requests[piece0].size();r++) {
+      std::vector<double> secondNetworkInput = batch[requests[piece0][r].first]->leaf->getState()->getSecondNetworkInput(requests[piece0][r].second);
+      std::copy(secondNetworkInput.begin(), secondNetworkInput.begin() + std::min((int)secondNetworkInput.size(), nInput2), inputs2.begin() + r * nInput2);
+    }
+    if(sharedTrunk && (nets2[piece0]->trunk == net1->trunk)) {
+      std::vector<double> features2(requests[piece0].size() * nFeatures, 0.);
+      for(int r=0;r<requests[piece0].size();r++) {
+        std::copy(features.begin() + requests[piece0][r].first * nFeatures, features.begin() + (requests[piece0][r].first + 1) * nFeatures, features2.begin() + r * nFeatures);
+      }
+      PROFILE_PHASE(PHASE_PREDICT);
+      predict_head_batch(nets2[piece0], requests[piece0].size(), &(features2[0]), &(inputs2[0]), &(outputs2[0]));
+    }
+    else {
+      PROFILE_PHASE(PHASE_PREDICT);
+      predict_batch(nets2[piece0], requests[piece0].size(), &(inputs2[0]), &(outputs2[0]));
+    }
+
+    for(int r=0;r<requests[piece0].size();r++) {
+      batch[requests[piece0][r].first]->p2[requests[piece0][r].second] = std::vector<double>(outputs2.begin() + r * nOutput2, outputs2.begin() + (r + 1) * nOutput2);
+    }
+  }
+}
+
+
 void Tree::deleteTree(void) {
   while(this->root->getParent() != NULL) {
     this->setRoot(this->root->getParent());
   }
 
-  this->root->cutBranch();
+  if(this->collector != NULL) {
+    this->collector->collect(this->root);
+  }
+  else {
+    this->root->cutBranch();
+  }
 }
@@ -3,6 +3,12 @@
         Library for the definition of the tree class.
         The tree class simply contain a root node (the node class being also defined in this library) and some set/get and cleaning routine. Also, it contains the 
         network used for the move evaluation.
+        The branch collector frees the branches pruned after a move, either on a low priority background thread or when explicitly asked
+        (e.g. in the idle time between moves), so that the next search does not wait for their deletion.
+        In the transposition (DAG) mode, the nodes holding the same position (same ChessState::getPositionKey) share an entry of the
+        transposition table: the statistics W and n of the entry are accumulated over all the paths and give the Q used in the selection, and
+        the outputs of the networks are computed once per position. Each node keeps its own state and its own visit count (the visits of the
+        edge from its parent, used for U and for the play probabilities), so the repetitions and the draws are still decided on each path.
         The node class contains a pointer to the parent node, a vector of pointers to the children nodes, and a pointer to the tree it belongs to.
         It also contains a pointer to the game state, and the values necessary to calculate the UCT. It also has methods necessary for the MCTS.
 
@@ -17,6 +23,13 @@
 #define TREE_HPP
 
 #include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <random>
 #include "Chess.hpp"
 #include "net.h"
 
@@ -24,14 +37,100 @@
 
 
 //Dirichlet noise functions
-double gamma1(double);
-void dirichlet(double, int, double*);
+double gamma1(double, std::mt19937&);
+void dirichlet(double, int, double*, std::mt19937&);
 
 
 
 
 //Forward declarations
 class Tree;
+class Node;
+class BranchCollector;
+class TrainingSet;
+
+
+
+//Output of the networks for a leaf, filled by Tree::evaluate
+struct LeafEvaluation {
+    //Leaf to evaluate
+    Node *leaf;
+
+    //Probabilities of the starting squares (and value as the last element)
+    std::vector<double> p1;
+    //Probabilities of the moves of each starting square
+    std::unordered_map<int,std::vector<double>> p2;
+    //Value of the state for the player to move
+    double v;
+
+    //Constructor
+    LeafEvaluation(Node*);
+};
+
+
+
+//TRANSPOSITION TABLE
+//Statistics shared by all the nodes holding the same position
+struct TranspositionEntry {
+    //Number of visits and total action over all the paths
+    int n;
+    double W;
+
+    //Outputs of the networks, once evaluated
+    bool evaluated;
+    std::vector<double> p1;
+    std::unordered_map<int,std::vector<double>> p2;
+    double v;
+
+    //Nodes pointing to the entry, plus one while it is stored in the table
+    std::atomic<int> references;
+
+    //Constructor
+    TranspositionEntry(void);
+
+    void release(void);
+};
+
+
+class TranspositionTable {
+  private:
+    std::unordered_map<uint64_t,TranspositionEntry*> entries;
+    std::mutex entriesMutex;
+
+    //Statistics
+    long hits;
+    long misses;
+
+
+  public:
+    //CONSTRUCTORS
+    TranspositionTable(void);
+
+    TranspositionTable(const TranspositionTable&) = delete;
+    TranspositionTable& operator=(const TranspositionTable&) = delete;
+
+
+    //ENTRIES
+    TranspositionEntry* acquire(uint64_t);
+    bool lookupEvaluation(TranspositionEntry*, LeafEvaluation*);
+    void storeEvaluation(TranspositionEntry*, LeafEvaluation*);
+    void purge(void);
+
+
+    //STATISTICS
+    int getSize(void);
+    long getNumberOfHits(void);
+    long getNumberOfMisses(void);
+
+
+    //DESTRUCTOR
+    ~TranspositionTable(void);
+};
+
+
+
+
+
 
 
 
@@ -70,6 +169,12 @@ class Node {
     double p;
     //Upper bound confidence
     double U;
+    //Value of the state given by the network
+    double v;
+    //Is the node waiting for the evaluation of the networks
+    bool pending;
+    //Statistics shared with the transpositions (NULL if the tree is not a DAG)
+    TranspositionEntry *entry;
   
   
   
@@ -94,6 +199,7 @@ class Node {
     int getPiece(void);
     int getStartingSquare(void);
     int getId(void);
+    int getMoveIndex(void);
   
     void addChild(Node* child);
     void addChildren(std::vector<Node*>);
@@ -120,6 +226,14 @@ class Node {
 
     double getU(void); 
 
+    double getValue(void);
+
+    void setPending(bool);
+    bool isPending(void);
+
+    void setEntry(TranspositionEntry*);
+    TranspositionEntry* getEntry(void);
+
     double getPlayProbability(void);
   
     int getNumberOfChildren(void);
@@ -128,12 +242,13 @@ class Node {
     //MCTS
     bool isLeaf(void);
 
-    void printNetworkDatasets(void);
+    void printNetworkDatasets(TrainingSet*);
 
     void cutBranch(void);
     void pruneOtherBranches(Node*);
 
     void buildChildren(void);
+    void buildChildren(LeafEvaluation*);
     void sortChildren(void);
 
     void increaseNumberOfVisits(void);
@@ -141,6 +256,55 @@ class Node {
     void updateAction(double);
     void updateU(void);
     void updateChildrenU(void);
+
+    void addVirtualLoss(double);
+    void revertVirtualLoss(double);
+};
+
+
+
+
+
+
+
+
+//BRANCH COLLECTOR
+class BranchCollector {
+  private:
+    //Branches waiting to be deleted
+    std::vector<Node*> garbage;
+    std::mutex garbageMutex;
+    std::condition_variable garbageAvailable;
+
+    //Background thread
+    std::thread thread;
+    bool running;
+
+    //Statistics
+    long freedBranches;
+
+    void work(void);
+
+
+  public:
+    //CONSTRUCTORS
+    BranchCollector(bool);
+    BranchCollector(void);
+
+    BranchCollector(const BranchCollector&) = delete;
+    BranchCollector& operator=(const BranchCollector&) = delete;
+
+
+    //COLLECTION
+    void collect(Node*);
+    void freeBranches(void);
+
+    long getNumberOfFreedBranches(void);
+    int getNumberOfPendingBranches(void);
+
+
+    //DESTRUCTOR
+    ~BranchCollector(void);
 };
 
 
@@ -156,12 +320,21 @@ class Tree {
   Node* root;
   NN* net1;
   std::array<NN*, 6> nets2;
+  //Collector of the pruned branches (NULL if they are deleted immediately)
+  BranchCollector* collector;
+  //Transposition table (NULL if the transpositions are not merged)
+  TranspositionTable* table;
+  //Number of nodes created since the construction of the tree
+  long createdNodes;
+  //Random generator of the tree, for the noise and the choice of the moves
+  std::mt19937 generator;
   
   
  public:
   //CONSTRUCTORS
   Tree(Node*, NN*, std::array<NN*, 6>);
   Tree(ChessState*, NN*, std::array<NN*, 6>);
+  Tree(ChessState*, NN*, std::array<NN*, 6>, unsigned int);
   
   //SET/GET 
   void setRoot(Node*);
@@ -173,6 +346,25 @@ class Tree {
   void setNetworks2(std::array<NN*, 6>);
   std::array<NN*, 6> getNetworks2(void);
 
+  void setCollector(BranchCollector*);
+  BranchCollector* getCollector(void);
+
+  void enableTranspositions(void);
+  void disableTranspositions(void);
+  TranspositionTable* getTable(void);
+
+  void addCreatedNodes(int);
+  long getNumberOfCreatedNodes(void);
+
+  void seed(unsigned int);
+  std::mt19937& getGenerator(void);
+
+  //NETWORK EVALUATION
+  void evaluate(std::vector<LeafEvaluation*>);
+  std::vector<LeafEvaluation*> lookupEvaluations(std::vector<LeafEvaluation*>);
+  void storeEvaluations(std::vector<LeafEvaluation*>);
+  static void evaluateNetworks(NN*, std::array<NN*, 6>, std::vector<LeafEvaluation*>);
+
   void deleteTree(void);
 };
   
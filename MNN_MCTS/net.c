@@ -3,9 +3,112 @@
 #include <math.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "net.h"
 
 
+// rows x columns matrix stored by rows in a single block, addressed through the pointers to its rows
+static double **alloc_matrix(int rows, int columns) {
+  double **matrix;
+  int i;
+
+  matrix = (double **) malloc(rows * sizeof(double*));
+  if(matrix == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  matrix[0] = (double *) malloc((size_t)rows * columns * sizeof(double));
+  if(matrix[0] == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  for(i=1; i<rows; i++) {
+    matrix[i] = matrix[0] + (size_t)i * columns;
+  }
+  return matrix;
+}
+
+static void free_matrix(double **matrix) {
+  if(matrix != NULL) {
+    free(matrix[0]);
+    free(matrix);
+  }
+}
+
+// the same, for the values of the training
+static train_real **alloc_train_matrix(int rows, int columns) {
+  train_real **matrix;
+  int i;
+
+  matrix = (train_real **) malloc(rows * sizeof(train_real*));
+  if(matrix == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  matrix[0] = (train_real *) calloc((size_t)rows * columns, sizeof(train_real));
+  if(matrix[0] == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  for(i=1; i<rows; i++) {
+    matrix[i] = matrix[0] + (size_t)i * columns;
+  }
+  return matrix;
+}
+
+static void free_train_matrix(train_real **matrix) {
+  if(matrix != NULL) {
+    free(matrix[0]);
+    free(matrix);
+  }
+}
+
+#if TRAINING_PRECISION == TRAINING_BF16
+// bfloat16: the upper half of a float32, rounded to nearest even
+static inline uint16_t float_to_bf16(float f) {
+  uint32_t x;
+
+  memcpy(&x, &f, sizeof(float));
+  x += 0x7fff + ((x >> 16) & 1);
+  return (uint16_t)(x >> 16);
+}
+
+static inline float bf16_to_float(uint16_t h) {
+  uint32_t x = (uint32_t) h << 16;
+  float f;
+
+  memcpy(&f, &x, sizeof(float));
+  return f;
+}
+
+#define WEIGHT_VALUE(w) bf16_to_float(w)
+#else
+#define WEIGHT_VALUE(w) (w)
+#endif
+
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+#define TRAIN_SQRT(x) sqrt(x)
+#else
+#define TRAIN_SQRT(x) sqrtf(x)
+#endif
+
+// an updated master weight is copied to the weights of the layer and to the ones of the propagation
+static inline void store_weight(layer *l, size_t i, train_real w) {
+#if TRAINING_PRECISION != TRAINING_DOUBLE
+  l->weights[0][i] = w;
+#endif
+#if TRAINING_PRECISION == TRAINING_BF16
+  l->prop_weights[0][i] = float_to_bf16(w);
+#endif
+}
+
+static inline void store_bias(layer *l, int i, train_real b) {
+#if TRAINING_PRECISION != TRAINING_DOUBLE
+  l->biases[i] = b;
+#endif
+}
+
+
 // FUNCTIONS
 
 void init_net(NN *net, char *hidden_type, char *output_type, int nlayers, ...) {
@@ -15,6 +118,7 @@ void init_net(NN *net, char *hidden_type, char *output_type, int nlayers, ...) {
 
   // set number of layers
   net->nl = nlayers;
+  net->trunk = NULL;
   if(net->nl<2) {
     printf("\nERROR: a network must have at least 2 layers!\n");
     exit(1);
@@ -83,6 +187,12 @@ void init_layer(layer *l, char *type, int n, int nprev) {
   l->n = n;
   // set number of units of previous layer
   l->nprev = nprev;
+  // the gradients are allocated only for the training (see init_gradients)
+  l->weights = NULL;
+  l->biases = l->deltas = NULL;
+  l->grad_weights = l->delta_weights = l->mom1_weights = l->mom2_weights = l->train_weights = NULL;
+  l->grad_biases = l->delta_biases = l->mom1_biases = l->mom2_biases = l->train_biases = NULL;
+  l->prop_weights = NULL;
   // alloc array of units
   l->units_lin = (double *) malloc(n * sizeof(double));
   if(strcmp(type, "input")==0 || strcmp(type, "linear")==0) {
@@ -94,20 +204,13 @@ void init_layer(layer *l, char *type, int n, int nprev) {
   // if there is a previous layer
   // then initialize weights and biases
   if(nprev > 0) {
-    // alloc memory
+    // alloc memory: the rows of the weights are contiguous, in a single block
     l->biases = (double *) malloc(n * sizeof(double));
-    l->weights = (double **) malloc(n * sizeof(double*));
-    if(l->biases == NULL || l->weights == NULL) {
+    l->weights = alloc_matrix(n, nprev);
+    if(l->biases == NULL) {
       printf("\nERROR: Malloc of net failed.\n");
       exit(1);
     }
-    for(i=0; i<n; i++) {
-      l->weights[i] = (double *) malloc(nprev * sizeof(double));
-      if(l->weights[i] == NULL) {
-        printf("\nERROR: Malloc of net failed.\n");
-        exit(1);
-      }
-    }
     // init values
     for(i=0; i<n; i++) {
       // set biases to zero
@@ -122,41 +225,63 @@ void init_layer(layer *l, char *type, int n, int nprev) {
 }
 
 void init_gradients(layer *l) {
-  int i, j;
+  int i;
 
-  // alloc memory
+  // alloc memory (the values of the training start from zero)
   l->deltas = (double *) malloc(l->n * sizeof(double));
-  l->delta_biases = (double *) malloc(l->n * sizeof(double));
-  l->delta_weights = (double **) malloc(l->n * sizeof(double*));
-  l->grad_biases = (double *) malloc(l->n * sizeof(double));
-  l->grad_weights = (double **) malloc(l->n * sizeof(double*));
-  if(l->deltas == NULL || l->delta_biases == NULL || l->delta_weights == NULL ||
-    l->grad_biases == NULL || l->grad_weights == NULL) {
+  l->delta_biases = (train_real *) calloc(l->n, sizeof(train_real));
+  l->delta_weights = alloc_train_matrix(l->n, l->nprev);
+  l->grad_biases = (train_real *) calloc(l->n, sizeof(train_real));
+  l->grad_weights = alloc_train_matrix(l->n, l->nprev);
+  l->mom1_weights = alloc_train_matrix(l->n, l->nprev);
+  l->mom2_weights = alloc_train_matrix(l->n, l->nprev);
+  l->mom1_biases = (train_real *) calloc(l->n, sizeof(train_real));
+  l->mom2_biases = (train_real *) calloc(l->n, sizeof(train_real));
+  if(l->deltas == NULL || l->delta_biases == NULL || l->grad_biases == NULL || l->mom1_biases == NULL || l->mom2_biases == NULL) {
     printf("\nERROR: Malloc of net failed.\n");
     exit(1);
   }
   for(i=0; i<l->n; i++) {
-    l->grad_weights[i] = (double *) malloc(l->nprev * sizeof(double));
-    if(l->grad_weights[i] == NULL) {
-      printf("\nERROR: Malloc of net failed.\n");
-      exit(1);
-    }
-    l->delta_weights[i] = (double *) malloc(l->nprev * sizeof(double));
-    if(l->delta_weights[i] == NULL) {
-      printf("\nERROR: Malloc of net failed.\n");
-      exit(1);
-    }
+    l->deltas[i] = 0.0;
+  }
+  // master weights, and weights of the propagation
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+  l->train_weights = l->weights;
+  l->train_biases = l->biases;
+#else
+  l->train_weights = alloc_train_matrix(l->n, l->nprev);
+  l->train_biases = (train_real *) malloc(l->n * sizeof(train_real));
+  if(l->train_biases == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
   }
-  // initialize
   for(i=0; i<l->n; i++) {
-    l->deltas[i] = 0.0;
-    l->delta_biases[i] = 0.0;
-    l->grad_biases[i] = 0.0;
-    for(j=0; j<l->nprev; j++) {
-      l->delta_weights[i][j] = 0.0;
-      l->grad_weights[i][j] = 0.0;
-    }
+    l->train_biases[i] = l->biases[i];
+  }
+  for(size_t k=0; k<(size_t)l->n*l->nprev; k++) {
+    l->train_weights[0][k] = l->weights[0][k];
+  }
+#endif
+#if TRAINING_PRECISION == TRAINING_BF16
+  l->prop_weights = (uint16_t **) malloc(l->n * sizeof(uint16_t*));
+  if(l->prop_weights == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  l->prop_weights[0] = (uint16_t *) malloc((size_t)l->n * l->nprev * sizeof(uint16_t));
+  if(l->prop_weights[0] == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
   }
+  for(i=0; i<l->n; i++) {
+    l->prop_weights[i] = l->prop_weights[0] + (size_t)i * l->nprev;
+  }
+  for(size_t k=0; k<(size_t)l->n*l->nprev; k++) {
+    l->prop_weights[0][k] = float_to_bf16(l->train_weights[0][k]);
+  }
+#else
+  l->prop_weights = l->train_weights;
+#endif
 }
 
 void init_training(NN *net) {
@@ -165,31 +290,35 @@ void init_training(NN *net) {
   for(i=1; i<net->nl; i++) {
     init_gradients(&net->layers[i]);
   }
+  net->step = 0;
 }
 
 void free_layer(layer *l) {
-  int i;
-
   free(l->units_lin);
   if(l->nprev>0) {
     if(strcmp(l->type, "linear")!=0) {
       free(l->units_act);
     }
-    for(i=0; i<l->n; i++) {
-      free(l->weights[i]);
-      if(l->grad_weights != NULL) {
-        free(l->grad_weights[i]);
-      }
-      if(l->delta_weights != NULL) {
-        free(l->delta_weights[i]);
-      }
+#if TRAINING_PRECISION == TRAINING_BF16
+    if(l->prop_weights != NULL) {
+      free(l->prop_weights[0]);
+      free(l->prop_weights);
     }
-    free(l->weights);
+#endif
+#if TRAINING_PRECISION != TRAINING_DOUBLE
+    free_train_matrix(l->train_weights);
+    free(l->train_biases);
+#endif
+    free_matrix(l->weights);
     free(l->biases);
-    free(l->grad_weights);
-    free(l->delta_weights);
+    free_train_matrix(l->grad_weights);
+    free_train_matrix(l->delta_weights);
+    free_train_matrix(l->mom1_weights);
+    free_train_matrix(l->mom2_weights);
     free(l->grad_biases);
     free(l->delta_biases);
+    free(l->mom1_biases);
+    free(l->mom2_biases);
     free(l->deltas);
   }
 }
@@ -227,7 +356,11 @@ int get_output_size(NN *net) {
   return net->layers[net->nl-1].n;
 }
 
+// the inputs of a head are the ones of its trunk followed by its query
 int get_input_size(NN *net) {
+  if(net->trunk != NULL) {
+    return get_input_size(net->trunk)+net->layers[0].n-get_output_size(net->trunk);
+  }
   return net->layers[0].n;
 }
 
@@ -395,6 +528,10 @@ void forward_propagation(NN *net, double *input_vector) {
 void predict(NN *net, double *vector, double *output) {
   int i, nout;
 
+  if(net->trunk != NULL) {
+    predict_batch(net, 1, vector, output);
+    return;
+  }
   forward_propagation(net, vector);
   nout = net->layers[net->nl-1].n;
   for(i=0; i<nout; i++) {
@@ -402,6 +539,133 @@ void predict(NN *net, double *vector, double *output) {
   }
 }
 
+// the rows of inputs (nbatch x units of the input layer) propagated through the layers of the network
+static void predict_layers(NN *net, int nbatch, double *inputs, double *outputs) {
+  int i, k, b, n, nmax;
+  double temp;
+  double *units_prev, *units_lin, *units_act;
+
+  // largest layer, to size the buffers
+  nmax = 0;
+  for(n=0; n<net->nl; n++) {
+    if(net->layers[n].n > nmax) {
+      nmax = net->layers[n].n;
+    }
+  }
+  units_prev = (double *) malloc(nbatch * nmax * sizeof(double));
+  units_lin = (double *) malloc(nbatch * nmax * sizeof(double));
+  units_act = (double *) malloc(nbatch * nmax * sizeof(double));
+  if(units_prev == NULL || units_lin == NULL || units_act == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
+    exit(1);
+  }
+  // copy the input rows
+  for(b=0; b<nbatch; b++) {
+    for(i=0; i<net->layers[0].n; i++) {
+      units_prev[b*nmax+i] = inputs[b*net->layers[0].n+i];
+    }
+  }
+  // forward propagation trough the other layers
+  for(n=1; n<net->nl; n++) {
+    layer *l = &net->layers[n];
+    // each row of weights is reused for the whole batch
+    for(k=0; k<l->n; k++) {
+      for(b=0; b<nbatch; b++) {
+        temp = l->biases[k];
+        for(i=0; i<l->nprev; i++) {
+          temp += l->weights[k][i]*units_prev[b*nmax+i];
+        }
+        units_lin[b*nmax+k] = temp;
+      }
+    }
+    for(b=0; b<nbatch; b++) {
+      if(l->activation == id_activation) {
+        for(k=0; k<l->n; k++) {
+          units_prev[b*nmax+k] = units_lin[b*nmax+k];
+        }
+      }
+      else {
+        l->activation(&units_lin[b*nmax], &units_act[b*nmax], l->n);
+        for(k=0; k<l->n; k++) {
+          units_prev[b*nmax+k] = units_act[b*nmax+k];
+        }
+      }
+    }
+  }
+  // copy the output rows
+  for(b=0; b<nbatch; b++) {
+    for(k=0; k<get_output_size(net); k++) {
+      outputs[b*get_output_size(net)+k] = units_prev[b*nmax+k];
+    }
+  }
+  free(units_prev);
+  free(units_lin);
+  free(units_act);
+}
+
+// batched and reentrant version of predict: the rows of inputs (nbatch x input size)
+// are propagated together using local buffers, so that the units stored in the
+// layers are never touched and several threads can share the same network
+void predict_batch(NN *net, int nbatch, double *inputs, double *outputs) {
+  double *features;
+
+  if(net->trunk == NULL) {
+    predict_layers(net, nbatch, inputs, outputs);
+    return;
+  }
+  features = (double *) malloc((size_t)nbatch * get_output_size(net->trunk) * sizeof(double));
+  if(features == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
+    exit(1);
+  }
+  predict_trunk_batch(net, nbatch, inputs, features);
+  predict_head_batch(net, nbatch, features, inputs, outputs);
+  free(features);
+}
+
+// features of the trunk of a head (nbatch x output size of the trunk) for the rows of inputs of the head
+void predict_trunk_batch(NN *head, int nbatch, double *inputs, double *features) {
+  int b, i, ninput = get_input_size(head), ntrunk = get_input_size(head->trunk);
+  double *trunk_inputs;
+
+  trunk_inputs = (double *) malloc((size_t)nbatch * ntrunk * sizeof(double));
+  if(trunk_inputs == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
+    exit(1);
+  }
+  for(b=0; b<nbatch; b++) {
+    for(i=0; i<ntrunk; i++) {
+      trunk_inputs[(size_t)b*ntrunk+i] = inputs[(size_t)b*ninput+i];
+    }
+  }
+  predict_layers(head->trunk, nbatch, trunk_inputs, features);
+  free(trunk_inputs);
+}
+
+// outputs of a head from the features of its trunk and the queries of the rows of inputs: the heads of a
+// multi-head network share the features of the positions, computed once by predict_trunk_batch
+void predict_head_batch(NN *head, int nbatch, double *features, double *inputs, double *outputs) {
+  int b, i, ninput = get_input_size(head), ntrunk = get_input_size(head->trunk);
+  int nfeatures = get_output_size(head->trunk), n = head->layers[0].n;
+  double *head_inputs;
+
+  head_inputs = (double *) malloc((size_t)nbatch * n * sizeof(double));
+  if(head_inputs == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
+    exit(1);
+  }
+  for(b=0; b<nbatch; b++) {
+    for(i=0; i<nfeatures; i++) {
+      head_inputs[(size_t)b*n+i] = features[(size_t)b*nfeatures+i];
+    }
+    for(i=nfeatures; i<n; i++) {
+      head_inputs[(size_t)b*n+i] = inputs[(size_t)b*ninput+ntrunk+i-nfeatures];
+    }
+  }
+  predict_layers(head, nbatch, head_inputs, outputs);
+  free(head_inputs);
+}
+
 void delta(layer *l, layer *lnext) {
   int i, j, k;
   double fprime[l->n];
@@ -418,15 +682,32 @@ void delta(layer *l, layer *lnext) {
   }
 }
 
-void delta_out(layer *l, double *target) {
+// a target of a mcts output with all the probabilities at zero has no policy (a position searched only to play the game):
+// only its value is trained
+int masked_policy(layer *l, double *target) {
   int i;
+
+  if(l->loss != mcts_loss) {
+    return 0;
+  }
+  for(i=0; i<l->n-1; i++) {
+    if(target[i] != 0.) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void delta_out(layer *l, double *target) {
+  int i, masked;
   double fprime[l->n];
 
   // compute derivatives
   l->derivative(l->units_lin, l->units_act, fprime, l->n);
   // compute deltas
+  masked = masked_policy(l, target);
   for(i=0; i<l->n; i++) {
-    l->deltas[i] = fprime[i]*(l->units_act[i]-target[i]);
+    l->deltas[i] = (masked && (i < l->n-1)) ? 0. : fprime[i]*(l->units_act[i]-target[i]);
   }
 }
 
@@ -454,21 +735,58 @@ void reset_gradients(layer *l) {
   }
 }
 
+// the weights, their gradients and their updates are contiguous (see alloc_matrix), so that each update is a single pass
+// over all the weights of the layer, which also sets the gradients to zero and copies the weights (see store_weight)
 void gradient_descent(layer *l, double rate, double momentum, double weight_decay, int batchsize) {
-  int i, j;
+  int i, size = l->n*l->nprev;
+  train_real *weights = l->train_weights[0], *grad = l->grad_weights[0], *delta = l->delta_weights[0];
+  train_real r = rate, m = momentum, wd = weight_decay, nb = batchsize;
 
-  // update weights and biases
+  // update biases
   for(i=0; i<l->n; i++) {
-    l->delta_biases[i] = momentum*l->delta_biases[i]-rate*(l->grad_biases[i]/batchsize);
-    l->biases[i] += l->delta_biases[i];
-    for(j=0; j<l->nprev; j++) {
-      l->delta_weights[i][j] = momentum*l->delta_weights[i][j]
-      -rate*(l->grad_weights[i][j]/batchsize+weight_decay*l->weights[i][j]);
-      l->weights[i][j] += l->delta_weights[i][j];
-    }
+    l->delta_biases[i] = m*l->delta_biases[i]-r*(l->grad_biases[i]/nb);
+    l->train_biases[i] += l->delta_biases[i];
+    store_bias(l, i, l->train_biases[i]);
+    l->grad_biases[i] = 0.0;
+  }
+  // update weights
+  for(i=0; i<size; i++) {
+    delta[i] = m*delta[i]-r*(grad[i]/nb+wd*weights[i]);
+    weights[i] += delta[i];
+    store_weight(l, i, weights[i]);
+    grad[i] = 0.0;
+  }
+}
+
+// adam update of the step n. step (from 1), with the bias correction of the moments folded in the rate.
+// The weight decay is added to the gradients, or with decoupled (adamw) applied to the weights directly
+void adam(layer *l, double rate, double beta1, double beta2, double epsilon, double weight_decay, int decoupled, int batchsize, long step) {
+  int i, size = l->n*l->nprev;
+  train_real *weights = l->train_weights[0], *grad = l->grad_weights[0], *mom1 = l->mom1_weights[0], *mom2 = l->mom2_weights[0];
+  train_real b1 = beta1, b2 = beta2, c1 = 1.0-beta1, c2 = 1.0-beta2, eps = epsilon, nb = batchsize;
+  train_real effective_rate, decay, wd, g;
+
+  effective_rate = rate*sqrt(1.0-pow(beta2, step))/(1.0-pow(beta1, step));
+  // update biases (never decayed)
+  for(i=0; i<l->n; i++) {
+    g = l->grad_biases[i]/nb;
+    l->mom1_biases[i] = b1*l->mom1_biases[i]+c1*g;
+    l->mom2_biases[i] = b2*l->mom2_biases[i]+c2*g*g;
+    l->train_biases[i] -= effective_rate*l->mom1_biases[i]/(TRAIN_SQRT(l->mom2_biases[i])+eps);
+    store_bias(l, i, l->train_biases[i]);
+    l->grad_biases[i] = 0.0;
+  }
+  // update weights
+  decay = decoupled ? 1.0-rate*weight_decay : 1.0;
+  wd = decoupled ? 0.0 : weight_decay;
+  for(i=0; i<size; i++) {
+    g = grad[i]/nb+wd*weights[i];
+    mom1[i] = b1*mom1[i]+c1*g;
+    mom2[i] = b2*mom2[i]+c2*g*g;
+    weights[i] = decay*weights[i]-effective_rate*mom1[i]/(TRAIN_SQRT(mom2[i])+eps);
+    store_weight(l, i, weights[i]);
+    grad[i] = 0.0;
   }
-  // set gradients to zero
-  reset_gradients(l);
 }
 
 void back_propagation(NN *net, double *target) {
@@ -483,137 +801,1149 @@ void back_propagation(NN *net, double *target) {
   }
 }
 
-void sgd_update(NN *net, double rate, double momentum, double weight_decay, int batchsize) {
-  int i;
+// MINIBATCH PROPAGATION
+// The samples of a minibatch are propagated together, as products of matrices: each row of the weights
+// (and of their gradients) is loaded once for BATCH_BLOCK samples instead of once per sample.
+// The inputs of the boards are mostly zeros: when at most SPARSE_INPUTS of the inputs of a batch are non-zero, the
+// gradients of the first layer are accumulated on the non-zero inputs only.
 
-  for(i=1; i<net->nl; i++) {
-    gradient_descent(&net->layers[i], rate, momentum, weight_decay, batchsize);
-  }
-}
+#define BATCH_BLOCK 4
+#define EVALUATION_BATCH 256
+#define SPARSE_INPUTS 0.25
 
-void train(NN *net, int ntrain, double **dataset, double **target, double rate, double momentum, double weight_decay, int batchsize, int Niterations) {
-  int ninput, noutput;
-  int nbatches, batchsize_last;
-  int *index;
-  int i, j, k, n;
-  double loss;
+void init_batch(net_batch *b, NN *net, int nbatch) {
+  int i;
 
-  noutput = get_output_size(net);
-  ninput = get_input_size(net);
-  // determine number of batches
-  nbatches = ntrain/batchsize;
-  batchsize_last = ntrain%batchsize;
-  // alloc memory for indices
-  index = (int *) malloc(ntrain * sizeof(int));
-  if(index == NULL) {
-    printf("\nERROR: Malloc of index failed.\n");
+  // the propagation reads the weights of the training (see init_gradients)
+  if(net->layers[net->nl-1].prop_weights == NULL) {
+    init_training(net);
+  }
+  b->nbatch = nbatch;
+  b->sparse = 0;
+  b->ncolumns = 0;
+  b->nactive = (int *) malloc(nbatch * sizeof(int));
+  b->active = (int *) malloc((size_t)nbatch * net->layers[0].n * sizeof(int));
+  b->active_values = (train_real *) malloc((size_t)nbatch * net->layers[0].n * sizeof(train_real));
+  b->columns = (int *) malloc(net->layers[0].n * sizeof(int));
+  b->column_used = (char *) calloc(net->layers[0].n, sizeof(char));
+  b->grad_columns = (train_real *) calloc((size_t)net->layers[0].n * net->layers[1].n, sizeof(train_real));
+  if(b->nactive == NULL || b->active == NULL || b->active_values == NULL || b->columns == NULL || b->column_used == NULL || b->grad_columns == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
     exit(1);
   }
-  for(n=0; n<Niterations; n++) {
-    // random indices
-    random_indices(index, ntrain);
-    // loop over batches
-    k = 0;
-    for(i=0; i<nbatches; i++) {
-      for(j=0; j<batchsize; j++) {
-        // produce output
-        //index[k] = k;
-        forward_propagation(net, dataset[index[k]]);
-        // back-propagate error
-        back_propagation(net, target[index[k]]);
-        k++;
-      }
-      // update
-      sgd_update(net, rate, momentum, weight_decay, batchsize);
-    }
-    // last batch (if present)
-    if(batchsize_last>0) {
-      for(j=0; j<batchsize_last; j++) {
-        // produce output
-        forward_propagation(net, dataset[index[k]]);
-        // back-propagate error
-        back_propagation(net, target[index[k]]);
-        k++;
+  b->units_lin = (train_real **) malloc(net->nl * sizeof(train_real*));
+  b->units_act = (train_real **) malloc(net->nl * sizeof(train_real*));
+  b->deltas = (train_real **) malloc(net->nl * sizeof(train_real*));
+  if(b->units_lin == NULL || b->units_act == NULL || b->deltas == NULL) {
+    printf("\nERROR: Malloc of batch buffers failed.\n");
+    exit(1);
+  }
+  for(i=0; i<net->nl; i++) {
+    b->units_lin[i] = (train_real *) malloc((size_t)nbatch * net->layers[i].n * sizeof(train_real));
+    b->deltas[i] = (train_real *) malloc((size_t)nbatch * net->layers[i].n * sizeof(train_real));
+    if(b->units_lin[i] == NULL || b->deltas[i] == NULL) {
+      printf("\nERROR: Malloc of batch buffers failed.\n");
+      exit(1);
+    }
+    // the identity activations share the units
+    if(net->layers[i].activation == id_activation) {
+      b->units_act[i] = b->units_lin[i];
+    }
+    else {
+      b->units_act[i] = (train_real *) malloc((size_t)nbatch * net->layers[i].n * sizeof(train_real));
+      if(b->units_act[i] == NULL) {
+        printf("\nERROR: Malloc of batch buffers failed.\n");
+        exit(1);
       }
-      // update
-      sgd_update(net, rate, momentum, weight_decay, batchsize_last);
     }
-    // evaluate loss
-    loss = evaluate_loss(net, dataset, target, ntrain);
-    printf("Iteration %d,  loss = %lg\n", n+1, loss);
   }
 }
 
-double evaluate_loss(NN *net, double **dataset, double **target, int ndata) {
+void free_batch(net_batch *b, NN *net) {
   int i;
-  double error = 0.0;
 
-  for(i=0; i<ndata; i++) {
-    // produce output
-    forward_propagation(net, dataset[i]);
-    // compute error
-    error += net->layers[net->nl-1].loss(net->layers[net->nl-1].units_act, target[i], net->layers[net->nl-1].n);
-  }
-  return error/ndata;
+  for(i=0; i<net->nl; i++) {
+    if(b->units_act[i] != b->units_lin[i]) {
+      free(b->units_act[i]);
+    }
+    free(b->units_lin[i]);
+    free(b->deltas[i]);
+  }
+  free(b->units_lin);
+  free(b->units_act);
+  free(b->deltas);
+  free(b->nactive);
+  free(b->active);
+  free(b->active_values);
+  free(b->columns);
+  free(b->column_used);
+  free(b->grad_columns);
 }
 
-void load_net(NN *net, char *file_name) {
-  int *dim;
-  int nl;
-  int n, i, j;
-  char **types;
-  double temp;
-  FILE *in;
+// the activation functions work on doubles: with the float32 training the rows are converted on the way
+static void activation_row(layer *l, train_real *units_lin, train_real *units_act) {
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+  l->activation(units_lin, units_act, l->n);
+#else
+  double lin[l->n], act[l->n];
+  int i;
 
-  // open file
-  if((in = fopen(file_name,"r")) == NULL) {
-    printf("\nERROR while opening file [%s]\n", file_name);
-    exit(0);
+  for(i=0; i<l->n; i++) {
+    lin[i] = units_lin[i];
   }
-  // read number of layers
-  fscanf(in, "%d", &nl);
-  net->nl = nl;
-  //printf("%d\n", net->nl);
-  if(net->nl<2) {
-    printf("\nERROR: network must have at least 2 layers!\n");
-    exit(1);
+  l->activation(lin, act, l->n);
+  for(i=0; i<l->n; i++) {
+    units_act[i] = act[i];
   }
-  // alloc memory for dimensions of layers
-  dim = (int *) malloc(nl * sizeof(int));
-  if(dim == NULL) {
-    printf("\nERROR: Malloc of net failed.\n");
-    exit(1);
+#endif
+}
+
+static void derivative_row(layer *l, train_real *units_lin, train_real *units_act, double *fprime) {
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+  l->derivative(units_lin, units_act, fprime, l->n);
+#else
+  double lin[l->n], act[l->n];
+  int i;
+
+  for(i=0; i<l->n; i++) {
+    lin[i] = units_lin[i];
+    act[i] = units_act[i];
   }
-  // read dimension of layers
-  for(i=0; i<nl; i++) {
-    fscanf(in, "%d", &dim[i]);
+  l->derivative(lin, act, fprime, l->n);
+#endif
+}
+
+static double loss_row(layer *l, train_real *units_act, double *target) {
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+  return l->loss(units_act, target, l->n);
+#else
+  double act[l->n];
+  int i;
+
+  for(i=0; i<l->n; i++) {
+    act[i] = units_act[i];
   }
-  // alloc memory for types of layers
-  types = (char **) malloc(nl * sizeof(char*));
-  if(types == NULL) {
-    printf("\nERROR: Malloc of net failed.\n");
-    exit(1);
+  return l->loss(act, target, l->n);
+#endif
+}
+
+// units_lin = units_prev * weights^T + biases
+static void linear_activation_batch(layer *l, int nbatch, train_real *units_prev, train_real *units_lin) {
+  int b, k, i, nprev = l->nprev;
+  train_real t0, t1, t2, t3, w;
+  train_real *p0, *p1, *p2, *p3;
+  train_weight *weights;
+
+  for(b=0; b+BATCH_BLOCK<=nbatch; b+=BATCH_BLOCK) {
+    p0 = &units_prev[b*nprev];
+    p1 = p0+nprev;
+    p2 = p1+nprev;
+    p3 = p2+nprev;
+    for(k=0; k<l->n; k++) {
+      weights = l->prop_weights[k];
+      t0 = t1 = t2 = t3 = l->train_biases[k];
+      for(i=0; i<nprev; i++) {
+        w = WEIGHT_VALUE(weights[i]);
+        t0 += w*p0[i];
+        t1 += w*p1[i];
+        t2 += w*p2[i];
+        t3 += w*p3[i];
+      }
+      units_lin[b*l->n+k] = t0;
+      units_lin[(b+1)*l->n+k] = t1;
+      units_lin[(b+2)*l->n+k] = t2;
+      units_lin[(b+3)*l->n+k] = t3;
+    }
   }
-  for(i=0; i<nl; i++) {
-    types[i] = (char *) malloc(10 * sizeof(char));
-    if(types[i] == NULL) {
-      printf("\nERROR: Malloc of net failed.\n");
-      exit(1);
+  // last samples
+  for(; b<nbatch; b++) {
+    p0 = &units_prev[b*nprev];
+    for(k=0; k<l->n; k++) {
+      weights = l->prop_weights[k];
+      t0 = l->train_biases[k];
+      for(i=0; i<nprev; i++) {
+        t0 += WEIGHT_VALUE(weights[i])*p0[i];
+      }
+      units_lin[b*l->n+k] = t0;
     }
   }
-  // read types of layers
-  for(i=0; i<nl; i++) {
-    fscanf(in, "%s", types[i]);
-    //printf("%s ", types[i]);
+}
+
+// grad_weights += deltas^T * units_prev, grad_biases += sum of the deltas over the batch
+static void update_gradients_batch(layer *l, int nbatch, train_real *deltas, train_real *units_prev, train_real **grad_weights, train_real *grad_biases) {
+  int b, k, i, nprev = l->nprev;
+  train_real d0, d1, d2, d3;
+  train_real *p0, *p1, *p2, *p3, *grad;
+
+  for(k=0; k<l->n; k++) {
+    grad = grad_weights[k];
+    for(b=0; b+BATCH_BLOCK<=nbatch; b+=BATCH_BLOCK) {
+      d0 = deltas[b*l->n+k];
+      d1 = deltas[(b+1)*l->n+k];
+      d2 = deltas[(b+2)*l->n+k];
+      d3 = deltas[(b+3)*l->n+k];
+      grad_biases[k] += d0+d1+d2+d3;
+      p0 = &units_prev[b*nprev];
+      p1 = p0+nprev;
+      p2 = p1+nprev;
+      p3 = p2+nprev;
+      for(i=0; i<nprev; i++) {
+        grad[i] += d0*p0[i]+d1*p1[i]+d2*p2[i]+d3*p3[i];
+      }
+    }
+    // last samples
+    for(; b<nbatch; b++) {
+      d0 = deltas[b*l->n+k];
+      grad_biases[k] += d0;
+      p0 = &units_prev[b*nprev];
+      for(i=0; i<nprev; i++) {
+        grad[i] += d0*p0[i];
+      }
+    }
   }
-  //printf("\n");
-  // alloc memory for layers
-  net->layers = (layer *) malloc(nl * sizeof(layer));
-  if(net->layers == NULL) {
-    printf("\nERROR: Malloc of net failed.\n");
-    exit(1);
+}
+
+// update_gradients_batch of the first layer, on the non-zero inputs of the rows of the batch: the gradients are
+// accumulated by column in grad_columns (each non-zero input adds its deltas to its column)
+static void update_gradients_sparse(layer *l, net_batch *bt, int nbatch, train_real *deltas, train_real *grad_biases) {
+  int b, k, a, nprev = l->nprev;
+  train_real v, *d, *column;
+
+  for(k=0; k<l->n; k++) {
+    for(b=0; b+BATCH_BLOCK<=nbatch; b+=BATCH_BLOCK) {
+      grad_biases[k] += deltas[b*l->n+k]+deltas[(b+1)*l->n+k]+deltas[(b+2)*l->n+k]+deltas[(b+3)*l->n+k];
+    }
+    for(; b<nbatch; b++) {
+      grad_biases[k] += deltas[b*l->n+k];
+    }
   }
-  // init input layer
+  for(b=0; b<nbatch; b++) {
+    d = &deltas[b*l->n];
+    for(a=0; a<bt->nactive[b]; a++) {
+      column = &bt->grad_columns[(size_t)bt->active[b*nprev+a]*l->n];
+      v = bt->active_values[b*nprev+a];
+      for(k=0; k<l->n; k++) {
+        column[k] += v*d[k];
+      }
+    }
+  }
+}
+
+// the gradients by column are added to grad_weights, and set to zero
+static void add_gradient_columns(layer *l, net_batch *bt, train_real **grad_weights) {
+  int c, j, k;
+  train_real *column;
+
+  for(c=0; c<bt->ncolumns; c++) {
+    j = bt->columns[c];
+    column = &bt->grad_columns[(size_t)j*l->n];
+    for(k=0; k<l->n; k++) {
+      grad_weights[k][j] += column[k];
+      column[k] = 0.0;
+    }
+  }
+}
+
+// deltas of the previous layer: (deltas * weights) times the derivatives of its activation
+static void delta_batch(layer *lprev, layer *l, int nbatch, train_real *deltas, train_real *units_lin_prev, train_real *units_act_prev, train_real *deltas_prev) {
+  int b, k, i, nprev = l->nprev;
+  train_real d0, d1, d2, d3;
+  train_real *dp;
+  train_weight *w0, *w1, *w2, *w3;
+  double fprime[nprev];
+
+  for(b=0; b<nbatch; b++) {
+    dp = &deltas_prev[b*nprev];
+    for(i=0; i<nprev; i++) {
+      dp[i] = 0.0;
+    }
+    for(k=0; k+BATCH_BLOCK<=l->n; k+=BATCH_BLOCK) {
+      d0 = deltas[b*l->n+k];
+      d1 = deltas[b*l->n+k+1];
+      d2 = deltas[b*l->n+k+2];
+      d3 = deltas[b*l->n+k+3];
+      w0 = l->prop_weights[k];
+      w1 = l->prop_weights[k+1];
+      w2 = l->prop_weights[k+2];
+      w3 = l->prop_weights[k+3];
+      for(i=0; i<nprev; i++) {
+        dp[i] += d0*WEIGHT_VALUE(w0[i])+d1*WEIGHT_VALUE(w1[i])+d2*WEIGHT_VALUE(w2[i])+d3*WEIGHT_VALUE(w3[i]);
+      }
+    }
+    for(; k<l->n; k++) {
+      d0 = deltas[b*l->n+k];
+      w0 = l->prop_weights[k];
+      for(i=0; i<nprev; i++) {
+        dp[i] += d0*WEIGHT_VALUE(w0[i]);
+      }
+    }
+    // the derivative of the identity is 1
+    if(lprev->derivative != id_derivative) {
+      derivative_row(lprev, &units_lin_prev[b*nprev], &units_act_prev[b*nprev], fprime);
+      for(i=0; i<nprev; i++) {
+        dp[i] *= fprime[i];
+      }
+    }
+  }
+}
+
+// the units of the input layer of the batch propagated through the other layers
+static void propagate_layers_batch(NN *net, net_batch *b, int nbatch) {
+  int i, k;
+  layer *l;
+
+  for(i=1; i<net->nl; i++) {
+    l = &net->layers[i];
+    linear_activation_batch(l, nbatch, b->units_act[i-1], b->units_lin[i]);
+    if(l->activation != id_activation) {
+      for(k=0; k<nbatch; k++) {
+        activation_row(l, &b->units_lin[i][k*l->n], &b->units_act[i][k*l->n]);
+      }
+    }
+  }
+}
+
+// the rows of inputs are packed in the batch and propagated through the layers
+void forward_propagation_batch(NN *net, net_batch *b, double **inputs, int nbatch) {
+  int j, k, n;
+  long nnz;
+
+  if(nbatch > b->nbatch) {
+    printf("\nERROR: batch of %d samples larger than the buffers (%d)!\n", nbatch, b->nbatch);
+    exit(1);
+  }
+  // the non-zero inputs are also listed, for the sparse gradients of the first layer
+  n = net->layers[0].n;
+  nnz = 0;
+  for(j=0; j<b->ncolumns; j++) {
+    b->column_used[b->columns[j]] = 0;
+  }
+  b->ncolumns = 0;
+  for(k=0; k<nbatch; k++) {
+    b->nactive[k] = 0;
+    for(j=0; j<n; j++) {
+      b->units_act[0][k*n+j] = inputs[k][j];
+      if(inputs[k][j] != 0.0) {
+        b->active[k*n+b->nactive[k]] = j;
+        b->active_values[k*n+b->nactive[k]] = inputs[k][j];
+        b->nactive[k]++;
+        if(b->column_used[j] == 0) {
+          b->column_used[j] = 1;
+          b->columns[b->ncolumns++] = j;
+        }
+      }
+    }
+    nnz += b->nactive[k];
+  }
+  b->sparse = (nnz <= SPARSE_INPUTS*nbatch*n);
+  propagate_layers_batch(net, b, nbatch);
+}
+
+// the input layer of a head: the features of its trunk (nbatch x output size of the trunk) followed by the queries
+// of the rows of inputs
+static void head_inputs_batch(NN *head, net_batch *b, train_real *features, double **inputs, int nbatch) {
+  int j, k, n = head->layers[0].n;
+  int nfeatures = get_output_size(head->trunk), ntrunk = get_input_size(head->trunk);
+
+  if(nbatch > b->nbatch) {
+    printf("\nERROR: batch of %d samples larger than the buffers (%d)!\n", nbatch, b->nbatch);
+    exit(1);
+  }
+  b->sparse = 0;
+  for(k=0; k<nbatch; k++) {
+    for(j=0; j<nfeatures; j++) {
+      b->units_act[0][k*n+j] = features[k*nfeatures+j];
+    }
+    for(j=nfeatures; j<n; j++) {
+      b->units_act[0][k*n+j] = inputs[k][ntrunk+j-nfeatures];
+    }
+  }
+}
+
+// forward_propagation_batch of any network: a head is propagated after its trunk (in trunk_b)
+static void forward_batch(NN *net, net_batch *b, net_batch *trunk_b, double **inputs, int nbatch) {
+  if(net->trunk == NULL) {
+    forward_propagation_batch(net, b, inputs, nbatch);
+    return;
+  }
+  forward_propagation_batch(net->trunk, trunk_b, inputs, nbatch);
+  head_inputs_batch(net, b, trunk_b->units_act[net->trunk->nl-1], inputs, nbatch);
+  propagate_layers_batch(net, b, nbatch);
+}
+
+// deltas of the output layer of the batch, for the targets
+static void output_deltas_batch(NN *net, net_batch *b, double **targets, int nbatch) {
+  int j, k, n, masked;
+  layer *l;
+  train_real *act, *deltas;
+
+  l = &net->layers[net->nl-1];
+  n = l->n;
+  {
+    double fprime[n];
+
+    for(k=0; k<nbatch; k++) {
+      act = &b->units_act[net->nl-1][k*n];
+      deltas = &b->deltas[net->nl-1][k*n];
+      derivative_row(l, &b->units_lin[net->nl-1][k*n], act, fprime);
+      masked = masked_policy(l, targets[k]);
+      for(j=0; j<n; j++) {
+        deltas[j] = (masked && (j < n-1)) ? 0. : fprime[j]*(act[j]-targets[k][j]);
+      }
+    }
+  }
+}
+
+// the deltas of the output layer are propagated back: the gradients of the batch are added to grad_weights and
+// grad_biases (for each layer, apart from the weights of a sparse first layer, in grad_columns of the batch), or to the
+// gradients of the layers if they are NULL. With input_deltas also the
+// deltas of the inputs are computed (for the trunk of a head)
+static void back_propagation_layers(NN *net, net_batch *b, int nbatch, train_real ***grad_weights, train_real **grad_biases, int input_deltas) {
+  int i;
+  layer *l;
+
+  // hidden layers (if present): the deltas of a layer are computed before its weights are used for its gradients
+  for(i=net->nl-1; i>0; i--) {
+    l = &net->layers[i];
+    if((i > 1) || input_deltas) {
+      delta_batch(&net->layers[i-1], l, nbatch, b->deltas[i], b->units_lin[i-1], b->units_act[i-1], b->deltas[i-1]);
+    }
+    if((i == 1) && b->sparse) {
+      // the gradients of the shards are left by column for reduce_shards
+      update_gradients_sparse(l, b, nbatch, b->deltas[i], (grad_weights == NULL) ? l->grad_biases : grad_biases[i]);
+      if(grad_weights == NULL) {
+        add_gradient_columns(l, b, l->grad_weights);
+      }
+    }
+    else if(grad_weights == NULL) {
+      update_gradients_batch(l, nbatch, b->deltas[i], b->units_act[i-1], l->grad_weights, l->grad_biases);
+    }
+    else {
+      update_gradients_batch(l, nbatch, b->deltas[i], b->units_act[i-1], grad_weights[i], grad_biases[i]);
+    }
+  }
+}
+
+// back propagation of the batch of the last forward_propagation_batch
+static void back_propagation_gradients(NN *net, net_batch *b, double **targets, int nbatch, train_real ***grad_weights, train_real **grad_biases) {
+  output_deltas_batch(net, b, targets, nbatch);
+  back_propagation_layers(net, b, nbatch, grad_weights, grad_biases, 0);
+}
+
+void back_propagation_batch(NN *net, net_batch *b, double **targets, int nbatch) {
+  back_propagation_gradients(net, b, targets, nbatch, NULL, NULL);
+}
+
+void sgd_update(NN *net, double rate, double momentum, double weight_decay, int batchsize) {
+  int i;
+
+  for(i=1; i<net->nl; i++) {
+    gradient_descent(&net->layers[i], rate, momentum, weight_decay, batchsize);
+  }
+  net->step++;
+}
+
+void adam_update(NN *net, double rate, double beta1, double beta2, double epsilon, double weight_decay, int decoupled, int batchsize) {
+  int i;
+
+  net->step++;
+  for(i=1; i<net->nl; i++) {
+    adam(&net->layers[i], rate, beta1, beta2, epsilon, weight_decay, decoupled, batchsize, net->step);
+  }
+}
+
+// default parameters of the solvers: the moments of adam as in neuralnet.py, the momentum of train.c
+void init_optimizer(optimizer *o, int solver, double rate, double weight_decay) {
+  if((solver != SOLVER_SGD) && (solver != SOLVER_ADAM) && (solver != SOLVER_ADAMW)) {
+    printf("\nERROR: solver %d not allowed!\n", solver);
+    exit(1);
+  }
+  o->solver = solver;
+  o->rate = rate;
+  o->weight_decay = weight_decay;
+  o->momentum = 0.9;
+  o->beta1 = 0.9;
+  o->beta2 = 0.999;
+  o->epsilon = 1e-8;
+  o->seed = NULL;
+  o->label = NULL;
+}
+
+void optimizer_update(NN *net, optimizer *o, int batchsize) {
+  if(o->solver == SOLVER_SGD) {
+    sgd_update(net, o->rate, o->momentum, o->weight_decay, batchsize);
+  }
+  else {
+    adam_update(net, o->rate, o->beta1, o->beta2, o->epsilon, o->weight_decay, (o->solver == SOLVER_ADAMW), batchsize);
+  }
+}
+
+// DATA-PARALLEL TRAINING
+// A minibatch is split in TRAINING_SHARDS shards of consecutive samples, whatever the number of threads: each shard
+// is propagated with its own buffers and gradients, by the threads in turn, then the gradients of the shards are
+// added in the order of the shards. So the training gives the same networks with any number of threads.
+
+typedef struct training_thread {
+  NN *net;
+  int thread, nthreads;
+  // shards of the batch
+  net_batch *batches;
+  train_real ***grad_weights[TRAINING_SHARDS];
+  train_real **grad_biases[TRAINING_SHARDS];
+  double **inputs, **targets;
+  int nbatch;
+  // loss of the chunks of evaluate_loss_threads (with the buffers of the trunk for a head)
+  net_batch *trunk_batches;
+  double **dataset, **target;
+  int ndata;
+  double *losses;
+  // multi-head training: the net is the trunk, the heads have their own shards, and the rows of the head h in the
+  // shard s are the rows from rows[s][h] to rows[s][h+1] of the inputs
+  struct training_thread *heads;
+  int nheads;
+  int (*rows)[MAX_HEADS+1];
+} training_thread;
+
+static void shard_range(int nbatch, int shard, int *first, int *n) {
+  *first = (int)((long)nbatch * shard / TRAINING_SHARDS);
+  *n = (int)((long)nbatch * (shard+1) / TRAINING_SHARDS) - *first;
+}
+
+// buffers of the shards of nbatch samples, and their gradients
+static void init_shards(training_thread *t, net_batch *batches, NN *net, int nbatch) {
+  int s, i;
+
+  t->batches = batches;
+  for(s=0; s<TRAINING_SHARDS; s++) {
+    init_batch(&batches[s], net, (nbatch+TRAINING_SHARDS-1)/TRAINING_SHARDS);
+    t->grad_weights[s] = (train_real ***) malloc(net->nl * sizeof(train_real**));
+    t->grad_biases[s] = (train_real **) malloc(net->nl * sizeof(train_real*));
+    if(t->grad_weights[s] == NULL || t->grad_biases[s] == NULL) {
+      printf("\nERROR: Malloc of net failed.\n");
+      exit(1);
+    }
+    for(i=1; i<net->nl; i++) {
+      t->grad_weights[s][i] = alloc_train_matrix(net->layers[i].n, net->layers[i].nprev);
+      t->grad_biases[s][i] = (train_real *) malloc(net->layers[i].n * sizeof(train_real));
+      if(t->grad_biases[s][i] == NULL) {
+        printf("\nERROR: Malloc of net failed.\n");
+        exit(1);
+      }
+    }
+  }
+}
+
+static void free_shards(training_thread *t, NN *net) {
+  int s, i;
+
+  for(s=0; s<TRAINING_SHARDS; s++) {
+    free_batch(&t->batches[s], net);
+    for(i=1; i<net->nl; i++) {
+      free_train_matrix(t->grad_weights[s][i]);
+      free(t->grad_biases[s][i]);
+    }
+    free(t->grad_weights[s]);
+    free(t->grad_biases[s]);
+  }
+}
+
+// the gradients of the shard s are set to zero, after its forward propagation
+// (the gradients by column of a sparse first layer are set to zero by reduce_shards)
+static void reset_shard(training_thread *t, int s) {
+  int i;
+
+  for(i=1; i<t->net->nl; i++) {
+    if((i > 1) || (t->batches[s].sparse == 0)) {
+      memset(t->grad_weights[s][i][0], 0, (size_t)t->net->layers[i].n * t->net->layers[i].nprev * sizeof(train_real));
+    }
+    memset(t->grad_biases[s][i], 0, t->net->layers[i].n * sizeof(train_real));
+  }
+}
+
+// gradients of the shards of the thread
+static void *propagate_shards(void *arg) {
+  training_thread *t = (training_thread *) arg;
+  int s, first, n;
+
+  for(s=t->thread; s<TRAINING_SHARDS; s+=t->nthreads) {
+    shard_range(t->nbatch, s, &first, &n);
+    if(n > 0) {
+      forward_propagation_batch(t->net, &t->batches[s], &t->inputs[first], n);
+    }
+    else {
+      t->batches[s].sparse = 0;
+    }
+    reset_shard(t, s);
+    if(n > 0) {
+      back_propagation_gradients(t->net, &t->batches[s], &t->targets[first], n, t->grad_weights[s], t->grad_biases[s]);
+    }
+  }
+  return NULL;
+}
+
+// the gradients of the shards are added to the layers, each thread reducing every nthreads-th row. If some shards
+// have the gradients of the first layer by column, its weights are reduced by column instead: the columns of each
+// thread are summed over the shards, in the same order, and added once to the column of the layer
+static void *reduce_shards(void *arg) {
+  training_thread *t = (training_thread *) arg;
+  layer *l;
+  int i, k, j, s, sparse = 0, row = 0;
+
+  for(s=0; s<TRAINING_SHARDS; s++) {
+    sparse |= t->batches[s].sparse;
+  }
+  for(i=1; i<t->net->nl; i++) {
+    l = &t->net->layers[i];
+    for(k=0; k<l->n; k++, row++) {
+      if(row % t->nthreads != t->thread) {
+        continue;
+      }
+      for(s=0; s<TRAINING_SHARDS; s++) {
+        l->grad_biases[k] += t->grad_biases[s][i][k];
+        if((i == 1) && sparse) {
+          continue;
+        }
+        for(j=0; j<l->nprev; j++) {
+          l->grad_weights[k][j] += t->grad_weights[s][i][k][j];
+        }
+      }
+    }
+  }
+  if(sparse) {
+    l = &t->net->layers[1];
+    {
+      train_real sum[l->n], *column;
+
+      for(j=t->thread; j<l->nprev; j+=t->nthreads) {
+        for(k=0; k<l->n; k++) {
+          sum[k] = 0.0;
+        }
+        for(s=0; s<TRAINING_SHARDS; s++) {
+          if(t->batches[s].sparse == 0) {
+            for(k=0; k<l->n; k++) {
+              sum[k] += t->grad_weights[s][1][k][j];
+            }
+          }
+          else if(t->batches[s].column_used[j]) {
+            column = &t->batches[s].grad_columns[(size_t)j*l->n];
+            for(k=0; k<l->n; k++) {
+              sum[k] += column[k];
+              column[k] = 0.0;
+            }
+          }
+        }
+        for(k=0; k<l->n; k++) {
+          l->grad_weights[k][j] += sum[k];
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+// gradients of the shards of the thread in the multi-head training: the trunk is propagated on the rows of all the
+// heads in the shard, then each head on its rows, and the deltas of the features coming from the heads are propagated
+// back through the trunk
+static void *propagate_multi_shards(void *arg) {
+  training_thread *t = (training_thread *) arg, *head;
+  NN *trunk = t->net;
+  layer *l = &trunk->layers[trunk->nl-1];
+  int s, h, j, k, first, n, offset, nhead, ninput, nfeatures = l->n;
+  train_real *features, *deltas;
+  double fprime[nfeatures];
+
+  for(s=t->thread; s<TRAINING_SHARDS; s+=t->nthreads) {
+    first = t->rows[s][0];
+    n = t->rows[s][t->nheads] - first;
+    if(n > 0) {
+      forward_propagation_batch(trunk, &t->batches[s], &t->inputs[first], n);
+    }
+    else {
+      t->batches[s].sparse = 0;
+    }
+    reset_shard(t, s);
+    features = t->batches[s].units_act[trunk->nl-1];
+    deltas = t->batches[s].deltas[trunk->nl-1];
+    for(h=0; h<t->nheads; h++) {
+      head = &t->heads[h];
+      offset = t->rows[s][h] - first;
+      nhead = t->rows[s][h+1] - t->rows[s][h];
+      head->batches[s].sparse = 0;
+      reset_shard(head, s);
+      if(nhead == 0) {
+        continue;
+      }
+      ninput = head->net->layers[0].n;
+      head_inputs_batch(head->net, &head->batches[s], &features[offset*nfeatures], &t->inputs[first+offset], nhead);
+      propagate_layers_batch(head->net, &head->batches[s], nhead);
+      output_deltas_batch(head->net, &head->batches[s], &t->targets[first+offset], nhead);
+      back_propagation_layers(head->net, &head->batches[s], nhead, head->grad_weights[s], head->grad_biases[s], 1);
+      for(k=0; k<nhead; k++) {
+        for(j=0; j<nfeatures; j++) {
+          deltas[(offset+k)*nfeatures+j] = head->batches[s].deltas[0][k*ninput+j];
+        }
+      }
+    }
+    if(n == 0) {
+      continue;
+    }
+    // back propagation of the trunk, from the derivatives of its output layer
+    if(l->derivative != id_derivative) {
+      for(k=0; k<n; k++) {
+        derivative_row(l, &t->batches[s].units_lin[trunk->nl-1][k*nfeatures], &features[k*nfeatures], fprime);
+        for(j=0; j<nfeatures; j++) {
+          deltas[k*nfeatures+j] *= fprime[j];
+        }
+      }
+    }
+    back_propagation_layers(trunk, &t->batches[s], n, t->grad_weights[s], t->grad_biases[s], 0);
+  }
+  return NULL;
+}
+
+// the gradients of the shards of the trunk and of the heads are added to their layers
+static void *reduce_multi_shards(void *arg) {
+  training_thread *t = (training_thread *) arg, head;
+  int h;
+
+  reduce_shards(t);
+  for(h=0; h<t->nheads; h++) {
+    head = t->heads[h];
+    head.thread = t->thread;
+    head.nthreads = t->nthreads;
+    reduce_shards(&head);
+  }
+  return NULL;
+}
+
+// losses of the chunks of EVALUATION_BATCH samples of the thread
+static void *evaluate_chunks(void *arg) {
+  training_thread *t = (training_thread *) arg;
+  layer *l = &t->net->layers[t->net->nl-1];
+  int c, k, first, n;
+
+  for(c=t->thread; c*EVALUATION_BATCH<t->ndata; c+=t->nthreads) {
+    first = c*EVALUATION_BATCH;
+    n = (t->ndata-first < EVALUATION_BATCH) ? t->ndata-first : EVALUATION_BATCH;
+    // produce output
+    forward_batch(t->net, &t->batches[0], t->trunk_batches, &t->dataset[first], n);
+    // compute error
+    t->losses[c] = 0.0;
+    for(k=0; k<n; k++) {
+      t->losses[c] += loss_row(l, &t->batches[0].units_act[t->net->nl-1][k*l->n], t->target[first+k]);
+    }
+  }
+  return NULL;
+}
+
+// runs the function on nthreads threads, the first one being the calling thread
+static void run_threads(training_thread *t, int nthreads, void *(*function)(void *)) {
+  pthread_t threads[nthreads];
+  int i;
+
+  for(i=1; i<nthreads; i++) {
+    if(pthread_create(&threads[i], NULL, function, &t[i]) != 0) {
+      printf("\nERROR: creation of the training threads failed.\n");
+      exit(1);
+    }
+  }
+  function(&t[0]);
+  for(i=1; i<nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+void train(NN *net, int ntrain, double **dataset, double **target, double rate, double momentum, double weight_decay, int batchsize, int Niterations) {
+  train_threads(net, ntrain, dataset, target, rate, momentum, weight_decay, batchsize, Niterations, 1);
+}
+
+void train_threads(NN *net, int ntrain, double **dataset, double **target, double rate, double momentum, double weight_decay, int batchsize, int Niterations, int nthreads) {
+  optimizer o;
+
+  init_optimizer(&o, SOLVER_SGD, rate, weight_decay);
+  o.momentum = momentum;
+  train_optimizer(net, ntrain, dataset, target, &o, batchsize, Niterations, nthreads);
+}
+
+void train_optimizer(NN *net, int ntrain, double **dataset, double **target, optimizer *o, int batchsize, int Niterations, int nthreads) {
+  train_validated(net, ntrain, dataset, target, o, NULL, batchsize, Niterations, nthreads);
+}
+
+void init_validation(validation *v, int ndata, double **dataset, double **target, int frequency, int patience, double min_delta) {
+  v->ndata = ndata;
+  v->dataset = dataset;
+  v->target = target;
+  v->frequency = frequency;
+  v->patience = patience;
+  v->min_delta = min_delta;
+  v->iterations = 0;
+  v->loss = v->best_loss = HUGE_VAL;
+  v->stale = 0;
+  v->improved = v->stop = 0;
+}
+
+// it is time to evaluate the loss of the validation samples
+static int validation_due(validation *v) {
+  if((v->frequency <= 0) || (v->ndata == 0) || (++v->iterations < v->frequency)) {
+    return 0;
+  }
+  v->iterations = 0;
+  return 1;
+}
+
+// the best loss, and the end of the training, after the loss of the validation samples
+static void update_validation(validation *v, double loss, const char *label, int iteration) {
+  v->loss = loss;
+  printf("%s%sIteration %d,  validation loss = %lg\n", (label != NULL) ? label : "", (label != NULL) ? ": " : "", iteration, v->loss);
+  if(v->loss < v->best_loss-v->min_delta) {
+    v->best_loss = v->loss;
+    v->stale = 0;
+    v->improved = 1;
+  }
+  else if((v->patience > 0) && (++v->stale >= v->patience)) {
+    printf("%s%sNo improvement in the last %d evaluations, the training stops.\n", (label != NULL) ? label : "", (label != NULL) ? ": " : "", v->stale);
+    v->stop = 1;
+  }
+}
+
+// loss of the validation samples, if it is time to evaluate it
+static void validate(NN *net, validation *v, const char *label, int iteration, int nthreads) {
+  if(validation_due(v)) {
+    update_validation(v, evaluate_loss_threads(net, v->dataset, v->target, v->ndata, nthreads), label, iteration);
+  }
+}
+
+// without validation (v NULL) the loss of the training samples is evaluated after every iteration. Returns the
+// iterations done, fewer than Niterations if the training has stopped
+int train_validated(NN *net, int ntrain, double **dataset, double **target, optimizer *o, validation *v, int batchsize, int Niterations, int nthreads) {
+  int nbatches, batchsize_last;
+  int *index;
+  int i, j, k, n;
+  double loss;
+  double **inputs, **targets;
+  net_batch batches[TRAINING_SHARDS];
+  training_thread t[TRAINING_SHARDS];
+
+  if(nthreads < 1) {
+    printf("\nERROR: wrong number of training threads %d!\n", nthreads);
+    exit(1);
+  }
+  if(net->trunk != NULL) {
+    printf("\nERROR: the heads of a multi-head network are trained together (see train_multi)!\n");
+    exit(1);
+  }
+  if(nthreads > TRAINING_SHARDS) {
+    nthreads = TRAINING_SHARDS;
+  }
+  if(v != NULL) {
+    v->improved = 0;
+  }
+  // determine number of batches
+  nbatches = ntrain/batchsize;
+  batchsize_last = ntrain%batchsize;
+  // alloc memory for indices and for the rows of a batch
+  index = (int *) malloc(ntrain * sizeof(int));
+  inputs = (double **) malloc(batchsize * sizeof(double*));
+  targets = (double **) malloc(batchsize * sizeof(double*));
+  if(index == NULL || inputs == NULL || targets == NULL) {
+    printf("\nERROR: Malloc of index failed.\n");
+    exit(1);
+  }
+  // buffers and gradients of the shards
+  init_shards(&t[0], batches, net, batchsize);
+  for(i=0; i<nthreads; i++) {
+    t[i] = t[0];
+    t[i].net = net;
+    t[i].thread = i;
+    t[i].nthreads = nthreads;
+    t[i].inputs = inputs;
+    t[i].targets = targets;
+  }
+  for(n=0; n<Niterations; n++) {
+    // random indices
+    random_indices_r(index, ntrain, o->seed);
+    // loop over batches (the last one may be smaller)
+    k = 0;
+    for(i=0; i<nbatches+(batchsize_last>0); i++) {
+      int nbatch = (i < nbatches) ? batchsize : batchsize_last;
+      for(j=0; j<nbatch; j++) {
+        inputs[j] = dataset[index[k]];
+        targets[j] = target[index[k]];
+        k++;
+      }
+      for(j=0; j<nthreads; j++) {
+        t[j].nbatch = nbatch;
+      }
+      // produce output and back-propagate error, for each shard
+      run_threads(t, nthreads, propagate_shards);
+      run_threads(t, nthreads, reduce_shards);
+      // update
+      optimizer_update(net, o, nbatch);
+    }
+    // evaluate loss
+    if(v == NULL) {
+      loss = evaluate_loss_threads(net, dataset, target, ntrain, nthreads);
+      printf("%s%sIteration %d,  loss = %lg\n", (o->label != NULL) ? o->label : "", (o->label != NULL) ? ": " : "", n+1, loss);
+    }
+    else {
+      validate(net, v, o->label, n+1, nthreads);
+      if(v->stop) {
+        n++;
+        break;
+      }
+    }
+  }
+  free_shards(&t[0], net);
+  free(index);
+  free(inputs);
+  free(targets);
+  return n;
+}
+
+// MULTI-HEAD TRAINING
+// The heads are trained together on their own datasets, and the trunk on all of them: every step takes the same
+// fraction of each dataset (batchsize samples of the first one), so an iteration goes once through all of them.
+// The rows of a step are split in TRAINING_SHARDS shards as in the data-parallel training, each with its shard of the
+// rows of every head: the trunk is propagated once on the rows of the shard, and the deltas of the features coming
+// from the heads are added before its back propagation. Each head is updated with the mean of the gradients of its
+// samples, the trunk with the mean over all the samples of the step.
+
+// v, if not NULL, has the validation of each head with its held-out samples: the validation loss is the sum of the
+// losses of the heads, evaluated with the frequency and the patience of v[0], which keeps the state of the validation
+int train_multi(multi_net *m, int *ntrain, double ***dataset, double ***target, optimizer *o, validation *v, int batchsize, int Niterations, int nthreads) {
+  NN *trunk = &m->trunk;
+  int *index[MAX_HEADS];
+  int next[MAX_HEADS], nhead[MAX_HEADS];
+  int rows[TRAINING_SHARDS][MAX_HEADS+1];
+  int h, i, j, n, s, first, nshard, nrows, nsteps, nmax, ntrunk;
+  double loss;
+  double **inputs, **targets;
+  net_batch trunk_batches[TRAINING_SHARDS], head_batches[MAX_HEADS][TRAINING_SHARDS];
+  training_thread t[TRAINING_SHARDS], heads[MAX_HEADS];
+
+  if(nthreads < 1) {
+    printf("\nERROR: wrong number of training threads %d!\n", nthreads);
+    exit(1);
+  }
+  if(ntrain[0] < 1) {
+    printf("\nERROR: no samples for the first head!\n");
+    exit(1);
+  }
+  if(nthreads > TRAINING_SHARDS) {
+    nthreads = TRAINING_SHARDS;
+  }
+  if(v != NULL) {
+    v[0].improved = 0;
+  }
+  nsteps = (ntrain[0] >= batchsize) ? ntrain[0]/batchsize : 1;
+  // indices, buffers and gradients of the shards of each head, and of the rows of all the heads for the trunk
+  ntrunk = 0;
+  for(h=0; h<m->nheads; h++) {
+    index[h] = (int *) malloc((ntrain[h] > 0 ? ntrain[h] : 1) * sizeof(int));
+    if(index[h] == NULL) {
+      printf("\nERROR: Malloc of index failed.\n");
+      exit(1);
+    }
+    nmax = (ntrain[h]+nsteps-1)/nsteps;
+    heads[h].net = &m->heads[h];
+    init_shards(&heads[h], head_batches[h], &m->heads[h], (nmax > 0) ? nmax : 1);
+    ntrunk += (nmax+TRAINING_SHARDS-1)/TRAINING_SHARDS*TRAINING_SHARDS;
+  }
+  init_shards(&t[0], trunk_batches, trunk, ntrunk);
+  inputs = (double **) malloc(ntrunk * sizeof(double*));
+  targets = (double **) malloc(ntrunk * sizeof(double*));
+  if(inputs == NULL || targets == NULL) {
+    printf("\nERROR: Malloc of index failed.\n");
+    exit(1);
+  }
+  for(i=0; i<nthreads; i++) {
+    t[i] = t[0];
+    t[i].net = trunk;
+    t[i].thread = i;
+    t[i].nthreads = nthreads;
+    t[i].inputs = inputs;
+    t[i].targets = targets;
+    t[i].heads = heads;
+    t[i].nheads = m->nheads;
+    t[i].rows = rows;
+  }
+  for(n=0; n<Niterations; n++) {
+    for(h=0; h<m->nheads; h++) {
+      if(ntrain[h] > 0) {
+        random_indices_r(index[h], ntrain[h], o->seed);
+      }
+    }
+    for(i=0; i<nsteps; i++) {
+      // samples of the step, by shard and by head in each shard
+      for(h=0; h<m->nheads; h++) {
+        next[h] = (int)((long)ntrain[h]*i/nsteps);
+        nhead[h] = (int)((long)ntrain[h]*(i+1)/nsteps) - next[h];
+      }
+      nrows = 0;
+      for(s=0; s<TRAINING_SHARDS; s++) {
+        for(h=0; h<m->nheads; h++) {
+          rows[s][h] = nrows;
+          shard_range(nhead[h], s, &first, &nshard);
+          for(j=next[h]+first; j<next[h]+first+nshard; j++, nrows++) {
+            inputs[nrows] = dataset[h][index[h][j]];
+            targets[nrows] = target[h][index[h][j]];
+          }
+        }
+        rows[s][m->nheads] = nrows;
+      }
+      // produce output and back-propagate error, for each shard
+      run_threads(t, nthreads, propagate_multi_shards);
+      run_threads(t, nthreads, reduce_multi_shards);
+      // update
+      for(h=0; h<m->nheads; h++) {
+        if(nhead[h] > 0) {
+          optimizer_update(&m->heads[h], o, nhead[h]);
+        }
+      }
+      optimizer_update(trunk, o, nrows);
+    }
+    // evaluate loss
+    if(v == NULL) {
+      printf("%s%sIteration %d,  loss =", (o->label != NULL) ? o->label : "", (o->label != NULL) ? ": " : "", n+1);
+      for(h=0; h<m->nheads; h++) {
+        if(ntrain[h] > 0) {
+          printf(" %lg", evaluate_loss_threads(&m->heads[h], dataset[h], target[h], ntrain[h], nthreads));
+        }
+        else {
+          printf(" -");
+        }
+      }
+      printf("\n");
+    }
+    else {
+      if(validation_due(&v[0])) {
+        loss = 0.0;
+        for(h=0; h<m->nheads; h++) {
+          if(v[h].ndata > 0) {
+            loss += evaluate_loss_threads(&m->heads[h], v[h].dataset, v[h].target, v[h].ndata, nthreads);
+          }
+        }
+        update_validation(&v[0], loss, o->label, n+1);
+      }
+      if(v[0].stop) {
+        n++;
+        break;
+      }
+    }
+  }
+  for(h=0; h<m->nheads; h++) {
+    free_shards(&heads[h], &m->heads[h]);
+    free(index[h]);
+  }
+  free_shards(&t[0], trunk);
+  free(inputs);
+  free(targets);
+  return n;
+}
+
+double evaluate_loss(NN *net, double **dataset, double **target, int ndata) {
+  return evaluate_loss_threads(net, dataset, target, ndata, 1);
+}
+
+// the losses of the chunks are added in their order, so the loss does not depend on the number of threads
+double evaluate_loss_threads(NN *net, double **dataset, double **target, int ndata, int nthreads) {
+  int i, nchunks;
+  double error = 0.0;
+  double *losses;
+  net_batch batches[TRAINING_SHARDS], trunk_batches[TRAINING_SHARDS];
+  training_thread t[TRAINING_SHARDS];
+
+  if(nthreads > TRAINING_SHARDS) {
+    nthreads = TRAINING_SHARDS;
+  }
+  nchunks = (ndata+EVALUATION_BATCH-1)/EVALUATION_BATCH;
+  losses = (double *) malloc(nchunks * sizeof(double));
+  if(losses == NULL) {
+    printf("\nERROR: Malloc of the losses failed.\n");
+    exit(1);
+  }
+  for(i=0; i<nthreads; i++) {
+    init_batch(&batches[i], net, EVALUATION_BATCH);
+    if(net->trunk != NULL) {
+      init_batch(&trunk_batches[i], net->trunk, EVALUATION_BATCH);
+    }
+    t[i].net = net;
+    t[i].thread = i;
+    t[i].nthreads = nthreads;
+    t[i].batches = &batches[i];
+    t[i].trunk_batches = &trunk_batches[i];
+    t[i].dataset = dataset;
+    t[i].target = target;
+    t[i].ndata = ndata;
+    t[i].losses = losses;
+  }
+  run_threads(t, nthreads, evaluate_chunks);
+  for(i=0; i<nchunks; i++) {
+    error += losses[i];
+  }
+  for(i=0; i<nthreads; i++) {
+    free_batch(&batches[i], net);
+    if(net->trunk != NULL) {
+      free_batch(&trunk_batches[i], net->trunk);
+    }
+  }
+  free(losses);
+  return error/ndata;
+}
+
+// the network at the current position of the file
+static void read_net(NN *net, FILE *in) {
+  int *dim;
+  int nl;
+  int n, i, j;
+  char **types;
+  double temp;
+
+  // read number of layers
+  fscanf(in, "%d", &nl);
+  net->nl = nl;
+  net->trunk = NULL;
+  //printf("%d\n", net->nl);
+  if(net->nl<2) {
+    printf("\nERROR: network must have at least 2 layers!\n");
+    exit(1);
+  }
+  // alloc memory for dimensions of layers
+  dim = (int *) malloc(nl * sizeof(int));
+  if(dim == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  // read dimension of layers
+  for(i=0; i<nl; i++) {
+    fscanf(in, "%d", &dim[i]);
+  }
+  // alloc memory for types of layers
+  types = (char **) malloc(nl * sizeof(char*));
+  if(types == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  for(i=0; i<nl; i++) {
+    types[i] = (char *) malloc(10 * sizeof(char));
+    if(types[i] == NULL) {
+      printf("\nERROR: Malloc of net failed.\n");
+      exit(1);
+    }
+  }
+  // read types of layers
+  for(i=0; i<nl; i++) {
+    fscanf(in, "%s", types[i]);
+    //printf("%s ", types[i]);
+  }
+  //printf("\n");
+  // alloc memory for layers
+  net->layers = (layer *) malloc(nl * sizeof(layer));
+  if(net->layers == NULL) {
+    printf("\nERROR: Malloc of net failed.\n");
+    exit(1);
+  }
+  // init input layer
   init_layer(&net->layers[0], "input", dim[0], 0);
   // init hidden and output layers
   for(i=1; i<nl; i++) {
@@ -645,18 +1975,23 @@ void load_net(NN *net, char *file_name) {
   }
   free(types);
   free(dim);
-  fclose(in);
 }
 
-void save_net(NN *net, char *file_name) {
-  int n, i, j;
-  FILE *out;
+void load_net(NN *net, char *file_name) {
+  FILE *in;
 
   // open file
-  if((out = fopen(file_name,"w")) == NULL) {
+  if((in = fopen(file_name,"r")) == NULL) {
     printf("\nERROR while opening file [%s]\n", file_name);
     exit(0);
   }
+  read_net(net, in);
+  fclose(in);
+}
+
+static void write_net(NN *net, FILE *out) {
+  int n, i, j;
+
   // write number of layers
   fprintf(out, "%d\n", net->nl);
   // write dimension of layers
@@ -685,9 +2020,162 @@ void save_net(NN *net, char *file_name) {
       fprintf(out, "\n");
     }
   }
+}
+
+void save_net(NN *net, char *file_name) {
+  FILE *out;
+
+  // open file
+  if((out = fopen(file_name,"w")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", file_name);
+    exit(0);
+  }
+  write_net(net, out);
   fclose(out);
 }
 
+// a multi-head network is saved as the number of heads, then the trunk and the heads in the format of save_net
+void load_multi_net(multi_net *m, char *file_name) {
+  int h;
+  FILE *in;
+
+  // open file
+  if((in = fopen(file_name,"r")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", file_name);
+    exit(0);
+  }
+  fscanf(in, "%d", &m->nheads);
+  if(m->nheads<1 || m->nheads>MAX_HEADS) {
+    printf("\nERROR: a multi-head network must have from 1 to %d heads!\n", MAX_HEADS);
+    exit(1);
+  }
+  read_net(&m->trunk, in);
+  for(h=0; h<m->nheads; h++) {
+    read_net(&m->heads[h], in);
+    if(m->heads[h].layers[0].n < get_output_size(&m->trunk)) {
+      printf("\nERROR: head %d with less inputs than the features of the trunk!\n", h);
+      exit(1);
+    }
+    m->heads[h].trunk = &m->trunk;
+  }
+  fclose(in);
+}
+
+void save_multi_net(multi_net *m, char *file_name) {
+  int h;
+  FILE *out;
+
+  // open file
+  if((out = fopen(file_name,"w")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", file_name);
+    exit(0);
+  }
+  fprintf(out, "%d\n", m->nheads);
+  write_net(&m->trunk, out);
+  for(h=0; h<m->nheads; h++) {
+    write_net(&m->heads[h], out);
+  }
+  fclose(out);
+}
+
+void free_multi_net(multi_net *m) {
+  int h;
+
+  for(h=0; h<m->nheads; h++) {
+    free_net(&m->heads[h]);
+  }
+  free_net(&m->trunk);
+}
+
+// TRAINING STATE
+// Binary image of what the training changes in a network (after init_training): the weights, their master copies,
+// the momenta of the solvers and the step. The dimensions of the layers and the precision of the training are
+// checked when it is read back, on the network loaded from the same file.
+
+static void write_values(void *values, size_t size, size_t n, FILE *out) {
+  if(fwrite(values, size, n, out) != n) {
+    printf("\nERROR while writing the training state!\n");
+    exit(1);
+  }
+}
+
+static void read_values(void *values, size_t size, size_t n, FILE *in) {
+  if(fread(values, size, n, in) != n) {
+    printf("\nERROR: training state truncated!\n");
+    exit(1);
+  }
+}
+
+void save_training_state(NN *net, FILE *out) {
+  int i, precision = TRAINING_PRECISION;
+  size_t size;
+  layer *l;
+
+  write_values(&net->nl, sizeof(int), 1, out);
+  write_values(&precision, sizeof(int), 1, out);
+  write_values(&net->step, sizeof(long), 1, out);
+  for(i=0; i<net->nl; i++) {
+    write_values(&net->layers[i].n, sizeof(int), 1, out);
+  }
+  for(i=1; i<net->nl; i++) {
+    l = &net->layers[i];
+    size = (size_t)l->n*l->nprev;
+    write_values(l->weights[0], sizeof(double), size, out);
+    write_values(l->biases, sizeof(double), l->n, out);
+#if TRAINING_PRECISION != TRAINING_DOUBLE
+    write_values(l->train_weights[0], sizeof(train_real), size, out);
+    write_values(l->train_biases, sizeof(train_real), l->n, out);
+#endif
+    write_values(l->delta_weights[0], sizeof(train_real), size, out);
+    write_values(l->delta_biases, sizeof(train_real), l->n, out);
+    write_values(l->mom1_weights[0], sizeof(train_real), size, out);
+    write_values(l->mom1_biases, sizeof(train_real), l->n, out);
+    write_values(l->mom2_weights[0], sizeof(train_real), size, out);
+    write_values(l->mom2_biases, sizeof(train_real), l->n, out);
+  }
+}
+
+void load_training_state(NN *net, FILE *in) {
+  int i, n, precision;
+  size_t k, size;
+  layer *l;
+
+  read_values(&n, sizeof(int), 1, in);
+  read_values(&precision, sizeof(int), 1, in);
+  if((n != net->nl) || (precision != TRAINING_PRECISION)) {
+    printf("\nERROR: training state of another network (%d layers, precision %d)!\n", n, precision);
+    exit(1);
+  }
+  read_values(&net->step, sizeof(long), 1, in);
+  for(i=0; i<net->nl; i++) {
+    read_values(&n, sizeof(int), 1, in);
+    if(n != net->layers[i].n) {
+      printf("\nERROR: training state of another network (%d units in layer %d)!\n", n, i);
+      exit(1);
+    }
+  }
+  for(i=1; i<net->nl; i++) {
+    l = &net->layers[i];
+    size = (size_t)l->n*l->nprev;
+    read_values(l->weights[0], sizeof(double), size, in);
+    read_values(l->biases, sizeof(double), l->n, in);
+#if TRAINING_PRECISION != TRAINING_DOUBLE
+    read_values(l->train_weights[0], sizeof(train_real), size, in);
+    read_values(l->train_biases, sizeof(train_real), l->n, in);
+#endif
+    read_values(l->delta_weights[0], sizeof(train_real), size, in);
+    read_values(l->delta_biases, sizeof(train_real), l->n, in);
+    read_values(l->mom1_weights[0], sizeof(train_real), size, in);
+    read_values(l->mom1_biases, sizeof(train_real), l->n, in);
+    read_values(l->mom2_weights[0], sizeof(train_real), size, in);
+    read_values(l->mom2_biases, sizeof(train_real), l->n, in);
+    // the weights of the propagation follow the master weights
+    for(k=0; k<size; k++) {
+      store_weight(l, k, l->train_weights[0][k]);
+    }
+  }
+}
+
 // TOOL FUNCTIONS
 
 double ran_gauss(double mean, double sigma) {
@@ -699,6 +2187,11 @@ double ran_gauss(double mean, double sigma) {
 }
 
 void random_indices(int *index, int ndata) {
+  random_indices_r(index, ndata, NULL);
+}
+
+// with the generator of lrand48 if seed is NULL
+void random_indices_r(int *index, int ndata, unsigned short *seed) {
   int i, n, r;
   int temp[ndata];
 
@@ -707,7 +2200,7 @@ void random_indices(int *index, int ndata) {
   }
   n = ndata-1;
   for(i=0; i<ndata; i++) {
-    r = lrand48()%(n+1);
+    r = ((seed != NULL) ? nrand48(seed) : lrand48())%(n+1);
     index[i] = temp[r];
     temp[r] = temp[n];
     n = n-1;
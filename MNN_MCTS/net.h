@@ -1,6 +1,31 @@
 #ifndef NET_H
 #define NET_H
 
+#include <stdio.h>
+#include <stdint.h>
+
+// precision of the training: TRAINING_DOUBLE trains the weights of the layers; TRAINING_FLOAT32 trains float32 copies
+// of them (the master weights), with float32 gradients and units; TRAINING_BF16 is TRAINING_FLOAT32 with the propagation
+// reading the master weights rounded to bfloat16. The weights of the layers (for predict and save_net) follow the updates
+#define TRAINING_DOUBLE 0
+#define TRAINING_FLOAT32 1
+#define TRAINING_BF16 2
+#define TRAINING_PRECISION TRAINING_FLOAT32
+
+#if TRAINING_PRECISION == TRAINING_DOUBLE
+typedef double train_real;
+#else
+typedef float train_real;
+#endif
+#if TRAINING_PRECISION == TRAINING_BF16
+typedef uint16_t train_weight;
+#else
+typedef train_real train_weight;
+#endif
+
+// shards of a minibatch in the data-parallel training, the maximum number of training threads
+#define TRAINING_SHARDS 16
+
 /************** STRUCTS ******************/
 typedef struct {
   int n, nprev;
@@ -10,20 +35,92 @@ typedef struct {
   double **weights;
   double *biases;
   double *deltas;
-  double **grad_weights;
-  double *grad_biases;
-  double **delta_weights;
-  double *delta_biases;
+  train_real **grad_weights;
+  train_real *grad_biases;
+  train_real **delta_weights;
+  train_real *delta_biases;
+  train_real **mom1_weights, **mom2_weights;
+  train_real *mom1_biases, *mom2_biases;
+  // weights updated by the training, and weights read by the propagation of the minibatches (see TRAINING_PRECISION)
+  train_real **train_weights;
+  train_real *train_biases;
+  train_weight **prop_weights;
   void (*activation)(double *, double *, int);
   void (*derivative)(double *, double *, double *, int);
   double (*loss)(double *, double *, int);
 } layer;
 
-typedef struct {
+typedef struct NN {
   int nl;
   layer *layers;
+  // updates of the weights since init_training (the time step of adam)
+  long step;
+  // shared trunk of a head of a multi-head network, NULL for the other networks
+  struct NN *trunk;
 } NN;
 
+// heads of a multi-head network, at most
+#define MAX_HEADS 8
+
+// multi-head network: the trunk propagates the first get_input_size(&trunk) inputs of a sample, the heads propagate
+// the features of the trunk (its output units) followed by the rest of their inputs, the query (e.g. the square of
+// the piece to move). Each head is a network of its own, with the inputs of the sample (see get_input_size), so
+// it can replace a separate network; the trunk is propagated once for all the heads of a position
+typedef struct {
+  NN trunk;
+  int nheads;
+  NN heads[MAX_HEADS];
+} multi_net;
+
+// solvers of the training
+#define SOLVER_SGD 0
+#define SOLVER_ADAM 1
+#define SOLVER_ADAMW 2
+
+// solver and its parameters: momentum for SGD, beta1, beta2 and epsilon for adam; with adamw the weight decay is
+// applied to the weights directly instead of being added to their gradients. The minibatches are shuffled with the
+// generator of lrand48, or with its own state seed (for nrand48) when several networks are trained at the same time,
+// and the losses are printed after label, if any
+typedef struct {
+  int solver;
+  double rate, momentum, weight_decay;
+  double beta1, beta2, epsilon;
+  unsigned short *seed;
+  const char *label;
+} optimizer;
+
+// validation of the training: the loss of the validation samples is evaluated every frequency iterations (never if 0),
+// and the training stops after patience evaluations (never if 0) with no improvement of the best loss by min_delta
+typedef struct {
+  int ndata;
+  double **dataset, **target;
+  int frequency, patience;
+  double min_delta;
+  // iterations since the last evaluation, last and best loss, evaluations since the best one
+  int iterations;
+  double loss, best_loss;
+  int stale;
+  // the last training improved the best loss, or stopped
+  int improved, stop;
+} validation;
+
+// units of a minibatch, stored by rows (nbatch x units of the layer) for each layer
+typedef struct {
+  int nbatch;
+  train_real **units_lin;
+  train_real **units_act;
+  train_real **deltas;
+  // non-zero inputs of the rows, when sparse: nactive[k] indices and values from k*(input size), and the ncolumns
+  // inputs non-zero in some row, with the gradients of the first layer by column (input size x units)
+  int sparse;
+  int *nactive, *active;
+  train_real *active_values;
+  int ncolumns;
+  int *columns;
+  char *column_used;
+  train_real *grad_columns;
+} net_batch;
+
 /*************** FUNCTIONS ***************/
 
 // INITIALIZATION AND FINALIZATION
@@ -34,6 +131,9 @@ void free_layer(layer *l);
 void free_net(NN *net);
 void load_net(NN *net, char *file_name);
 void save_net(NN *net, char *file_name);
+void load_multi_net(multi_net *m, char *file_name);
+void save_multi_net(multi_net *m, char *file_name);
+void free_multi_net(multi_net *m);
 
 // INFORMATIVE
 void print_network_structure(NN *net);
@@ -50,6 +150,9 @@ void softmax_activation(double *units_lin, double *units_act, int n);
 void mcts_activation(double *units_lin, double *units_act, int n);
 void forward_propagation(NN *net, double *input_vector);
 void predict(NN *net, double *vector, double *output);
+void predict_batch(NN *net, int nbatch, double *inputs, double *outputs);
+void predict_trunk_batch(NN *head, int nbatch, double *inputs, double *features);
+void predict_head_batch(NN *head, int nbatch, double *features, double *inputs, double *outputs);
 
 // BACK PROPAGATION
 void id_derivative(double *units_lin, double *units_act, double *fprime, int n);
@@ -57,26 +160,46 @@ void tanh_derivative(double *units_lin, double *units_act, double *fprime, int n
 void sigmoid_derivative(double *units_lin, double *units_act, double *fprime, int n);
 void relu_derivative(double *units_lin, double *units_act, double *fprime, int n);
 void mcts_derivative(double *units_lin, double *units_act, double *fprime, int n);
+int masked_policy(layer *l, double *target);
 void delta_out(layer *l, double *target);
 void delta(layer *l, layer *lnext);
 void update_gradients(layer *l, layer *lprev);
 void reset_gradients(layer *l);
 void gradient_descent(layer *l, double rate, double momentum, double weight_decay, int batchsize);
+void adam(layer *l, double rate, double beta1, double beta2, double epsilon, double weight_decay, int decoupled, int batchsize, long step);
 void back_propagation(NN *net, double *target);
 
+// MINIBATCH PROPAGATION
+void init_batch(net_batch *b, NN *net, int nbatch);
+void free_batch(net_batch *b, NN *net);
+void forward_propagation_batch(NN *net, net_batch *b, double **inputs, int nbatch);
+void back_propagation_batch(NN *net, net_batch *b, double **targets, int nbatch);
+
 // TRAINING
 void init_training(NN *net);
 void sgd_update(NN *net, double rate, double momentum, double weight_decay, int batchsize);
+void adam_update(NN *net, double rate, double beta1, double beta2, double epsilon, double weight_decay, int decoupled, int batchsize);
+void init_optimizer(optimizer *o, int solver, double rate, double weight_decay);
+void optimizer_update(NN *net, optimizer *o, int batchsize);
+void train_optimizer(NN *net, int ntrain, double **dataset, double **target, optimizer *o, int batchsize, int Niterations, int nthreads);
+void init_validation(validation *v, int ndata, double **dataset, double **target, int frequency, int patience, double min_delta);
+int train_validated(NN *net, int ntrain, double **dataset, double **target, optimizer *o, validation *v, int batchsize, int Niterations, int nthreads);
 void train(NN *net, int ntrain, double **dataset, double **target, double rate, double momentum, double weight_decay, int batchsize, int Niterations);
+void train_threads(NN *net, int ntrain, double **dataset, double **target, double rate, double momentum, double weight_decay, int batchsize, int Niterations, int nthreads);
+int train_multi(multi_net *m, int *ntrain, double ***dataset, double ***target, optimizer *o, validation *v, int batchsize, int Niterations, int nthreads);
+void save_training_state(NN *net, FILE *out);
+void load_training_state(NN *net, FILE *in);
 
 // LOSS
 double square_loss(double *units_act, double *target, int n);
 double cross_entropy_loss(double *units_act, double *target, int n);
 double mcts_loss(double *units_act, double *target, int n);
 double evaluate_loss(NN *net, double **dataset, double **target, int ndata);
+double evaluate_loss_threads(NN *net, double **dataset, double **target, int ndata, int nthreads);
 
 // TOOL FUNCTIONS
 double ran_gauss(double mean, double sigma);
 void random_indices(int *index, int ndata);
+void random_indices_r(int *index, int ndata, unsigned short *seed);
 
 #endif
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "samples.h"
+#include "replay.h"
+
+
+// FUNCTIONS
+
+// reads all the samples of the shard once, to check their checksum
+static void check_shard(samples_reader *r) {
+  double *input, *target;
+
+  input = (double *) malloc((r->header.ninput + 1) * sizeof(double));
+  target = (double *) malloc((r->header.noutput + 1) * sizeof(double));
+  if((input == NULL) || (target == NULL)) {
+    printf("\nERROR: Malloc of the replay buffer failed.\n");
+    exit(1);
+  }
+
+  while(read_sample(r, input, r->header.ninput, target, r->header.noutput));
+
+  free(input);
+  free(target);
+}
+
+// Vose's alias method: the shard i is drawn with probability proportional to its samples in the window times its priority
+static void build_alias_table(replay_buffer *rb) {
+  double *weight, total;
+  int *small, *large;
+  int nsmall, nlarge, i, s, l;
+  int32_t newest;
+
+  weight = (double *) malloc(rb->nshards * sizeof(double));
+  small = (int *) malloc(rb->nshards * sizeof(int));
+  large = (int *) malloc(rb->nshards * sizeof(int));
+  if((weight == NULL) || (small == NULL) || (large == NULL)) {
+    printf("\nERROR: Malloc of the replay buffer failed.\n");
+    exit(1);
+  }
+
+  newest = rb->shards[0].reader.header.generation;
+  for(i=0; i<rb->nshards; i++) {
+    if(rb->shards[i].reader.header.generation > newest) {
+      newest = rb->shards[i].reader.header.generation;
+    }
+  }
+
+  total = 0.;
+  for(i=0; i<rb->nshards; i++) {
+    rb->shards[i].priority = pow(rb->decay, (double)(newest - rb->shards[i].reader.header.generation));
+    weight[i] = (double)(rb->shards[i].reader.header.nsamples - rb->shards[i].start) * rb->shards[i].priority;
+    total += weight[i];
+  }
+
+  nsmall = nlarge = 0;
+  for(i=0; i<rb->nshards; i++) {
+    weight[i] *= rb->nshards / total;
+    if(weight[i] < 1.) {
+      small[nsmall++] = i;
+    }
+    else {
+      large[nlarge++] = i;
+    }
+  }
+
+  while((nsmall > 0) && (nlarge > 0)) {
+    s = small[--nsmall];
+    l = large[--nlarge];
+    rb->probability[s] = weight[s];
+    rb->alias[s] = l;
+    weight[l] -= (1. - weight[s]);
+    if(weight[l] < 1.) {
+      small[nsmall++] = l;
+    }
+    else {
+      large[nlarge++] = l;
+    }
+  }
+  // what is left has probability 1, up to the rounding errors
+  while(nlarge > 0) {
+    l = large[--nlarge];
+    rb->probability[l] = 1.;
+    rb->alias[l] = l;
+  }
+  while(nsmall > 0) {
+    s = small[--nsmall];
+    rb->probability[s] = 1.;
+    rb->alias[s] = s;
+  }
+
+  free(weight);
+  free(small);
+  free(large);
+}
+
+// the held-out samples are chosen by a hash of their shard and position, so they stay the same while the window moves
+static int held_out(replay_buffer *rb, int shard, int64_t index) {
+  uint64_t x;
+
+  if(rb->holdout == 0) {
+    return 0;
+  }
+  x = ((uint64_t) shard << 40) ^ (uint64_t) index;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (x % rb->holdout) == 0;
+}
+
+// the oldest shard leaves the window
+static void drop_oldest_shard(replay_buffer *rb) {
+  rb->nsamples -= rb->shards[0].reader.header.nsamples - rb->shards[0].start;
+  close_samples_reader(&rb->shards[0].reader);
+  rb->nshards--;
+  memmove(rb->shards, rb->shards + 1, rb->nshards * sizeof(replay_shard));
+}
+
+void open_replay_buffer(replay_buffer *rb, char *prefix, int64_t window, double decay) {
+  char name[300];
+  samples_reader r;
+  int64_t nsamples;
+  int nshards;
+
+  if(strlen(prefix) >= sizeof(rb->prefix)) {
+    printf("\nERROR: prefix of the samples [%s] too long!\n", prefix);
+    exit(1);
+  }
+  if((window <= 0) || (decay <= 0.) || (decay > 1.)) {
+    printf("\nERROR: wrong window %ld or decay %g of the replay buffer!\n", (long) window, decay);
+    exit(1);
+  }
+  strcpy(rb->prefix, prefix);
+  rb->window = window;
+  rb->decay = decay;
+
+  rb->shards = (replay_shard *) malloc(REPLAY_MAX_SHARDS * sizeof(replay_shard));
+  rb->probability = (double *) malloc(REPLAY_MAX_SHARDS * sizeof(double));
+  rb->alias = (int *) malloc(REPLAY_MAX_SHARDS * sizeof(int));
+  if((rb->shards == NULL) || (rb->probability == NULL) || (rb->alias == NULL)) {
+    printf("\nERROR: Malloc of the replay buffer failed.\n");
+    exit(1);
+  }
+  rb->nshards = 0;
+  rb->nsamples = 0;
+  rb->holdout = 0;
+  rb->seed[0] = (unsigned short) lrand48();
+  rb->seed[1] = (unsigned short) lrand48();
+  rb->seed[2] = (unsigned short) lrand48();
+  rb->permutation = NULL;
+  rb->offsets = NULL;
+  rb->npermutation = 0;
+  rb->next = 0;
+
+  // the shards older than the window are not read at all
+  count_samples(rb->prefix, &nshards);
+  rb->next_shard = nshards;
+  nsamples = 0;
+  while((rb->next_shard > 0) && (nsamples < window)) {
+    rb->next_shard--;
+    shard_name(name, rb->prefix, rb->next_shard);
+    open_samples_reader(&r, name);
+    nsamples += r.header.nsamples;
+    close_samples_reader(&r);
+  }
+
+  refresh_replay_buffer(rb);
+}
+
+// adds the shards written since the last refresh, returns their number
+int refresh_replay_buffer(replay_buffer *rb) {
+  char name[300];
+  samples_reader r;
+  replay_shard *shard;
+  int nnew = 0;
+
+  shard_name(name, rb->prefix, rb->next_shard);
+  while(open_samples_reader(&r, name)) {
+    check_shard(&r);
+    rb->next_shard++;
+    shard_name(name, rb->prefix, rb->next_shard);
+
+    // the shards emptied by prune_replay_buffer are skipped
+    if(r.header.nsamples == 0) {
+      close_samples_reader(&r);
+      continue;
+    }
+    if((rb->nshards > 0) && ((r.header.ninput != rb->shards[0].reader.header.ninput) || (r.header.noutput != rb->shards[0].reader.header.noutput))) {
+      printf("\nERROR: shard %d of [%s] has different sizes from the other ones!\n", rb->next_shard - 1, rb->prefix);
+      exit(1);
+    }
+
+    if(rb->nshards == REPLAY_MAX_SHARDS) {
+      drop_oldest_shard(rb);
+    }
+    shard = &rb->shards[rb->nshards];
+    shard->reader = r;
+    shard->shard = rb->next_shard - 1;
+    shard->start = 0;
+    shard->priority = 1.;
+    rb->nsamples += r.header.nsamples;
+    rb->nshards++;
+    nnew++;
+  }
+
+  if(nnew == 0) {
+    return 0;
+  }
+  // the epoch is over, the window has changed
+  rb->npermutation = 0;
+
+  // the oldest samples leave the window
+  while((rb->nshards > 1) && (rb->nsamples - (rb->shards[0].reader.header.nsamples - rb->shards[0].start) >= rb->window)) {
+    drop_oldest_shard(rb);
+  }
+  if(rb->nsamples > rb->window) {
+    rb->shards[0].start += rb->nsamples - rb->window;
+    rb->nsamples = rb->window;
+  }
+
+  build_alias_table(rb);
+
+  return nnew;
+}
+
+// are all the samples of the window held out
+static int all_held_out(replay_buffer *rb) {
+  int64_t index;
+  int s;
+
+  for(s=0; s<rb->nshards; s++) {
+    for(index=rb->shards[s].start; index<rb->shards[s].reader.header.nsamples; index++) {
+      if(held_out(rb, rb->shards[s].shard, index) == 0) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// draws a sample of the window, in constant time
+void sample_replay(replay_buffer *rb, double *input, int ninput, double *target, int noutput) {
+  replay_shard *shard;
+  int64_t index, skipped = 0;
+  int i;
+
+  if(rb->nshards == 0) {
+    printf("\nERROR: the replay buffer of [%s] is empty!\n", rb->prefix);
+    exit(1);
+  }
+
+  do {
+    i = (int)(erand48(rb->seed) * rb->nshards);
+    if(erand48(rb->seed) >= rb->probability[i]) {
+      i = rb->alias[i];
+    }
+    shard = &rb->shards[i];
+
+    index = shard->start + (int64_t)(erand48(rb->seed) * (shard->reader.header.nsamples - shard->start));
+    // the draws are random: after as many held-out draws as samples, the window is checked once
+    if((skipped++ == rb->nsamples) && all_held_out(rb)) {
+      printf("\nERROR: all the samples of the replay buffer of [%s] are held out!\n", rb->prefix);
+      exit(1);
+    }
+  } while(held_out(rb, shard->shard, index));
+  read_sample_at(&shard->reader, index, input, ninput, target, noutput);
+}
+
+// permutation and offsets of an epoch over the window
+static void alloc_epoch(replay_buffer *rb) {
+  int s;
+
+  free(rb->permutation);
+  free(rb->offsets);
+  rb->permutation = (int64_t *) malloc(rb->nsamples * sizeof(int64_t));
+  rb->offsets = (int64_t *) malloc((rb->nshards + 1) * sizeof(int64_t));
+  if((rb->permutation == NULL) || (rb->offsets == NULL)) {
+    printf("\nERROR: Malloc of the replay buffer failed.\n");
+    exit(1);
+  }
+
+  rb->offsets[0] = 0;
+  for(s=0; s<rb->nshards; s++) {
+    rb->offsets[s+1] = rb->offsets[s] + rb->shards[s].reader.header.nsamples - rb->shards[s].start;
+  }
+}
+
+// starts an epoch over the window: its samples are shuffled with Fisher-Yates
+void shuffle_replay_buffer(replay_buffer *rb) {
+  int64_t i, j, temp;
+
+  alloc_epoch(rb);
+  for(i=0; i<rb->nsamples; i++) {
+    rb->permutation[i] = i;
+  }
+  for(i=rb->nsamples-1; i>0; i--) {
+    j = (int64_t)(erand48(rb->seed) * (i + 1));
+    temp = rb->permutation[i];
+    rb->permutation[i] = rb->permutation[j];
+    rb->permutation[j] = temp;
+  }
+  rb->npermutation = rb->nsamples;
+  rb->next = 0;
+}
+
+// reads the next sample of the epoch, a new epoch starts when all the samples of the window have been read
+void next_replay_sample(replay_buffer *rb, double *input, int ninput, double *target, int noutput) {
+  int64_t index, skipped = 0;
+  int low, high, middle;
+
+  if(rb->nshards == 0) {
+    printf("\nERROR: the replay buffer of [%s] is empty!\n", rb->prefix);
+    exit(1);
+  }
+  do {
+    if(rb->next >= rb->npermutation) {
+      shuffle_replay_buffer(rb);
+    }
+    index = rb->permutation[rb->next++];
+
+    // shard of the sample
+    low = 0;
+    high = rb->nshards - 1;
+    while(low < high) {
+      middle = (low + high + 1) / 2;
+      if(rb->offsets[middle] <= index) {
+        low = middle;
+      }
+      else {
+        high = middle - 1;
+      }
+    }
+    index = rb->shards[low].start + index - rb->offsets[low];
+    if(skipped++ > rb->nsamples) {
+      printf("\nERROR: all the samples of the replay buffer of [%s] are held out!\n", rb->prefix);
+      exit(1);
+    }
+  } while(held_out(rb, rb->shards[low].shard, index));
+  read_sample_at(&rb->shards[low].reader, index, input, ninput, target, noutput);
+}
+
+// one sample out of stride is held out for the validation: the draws skip it
+void set_replay_holdout(replay_buffer *rb, int stride) {
+  if((stride != 0) && (stride < 2)) {
+    printf("\nERROR: wrong stride %d of the held-out samples!\n", stride);
+    exit(1);
+  }
+  rb->holdout = stride;
+}
+
+// reads up to n held-out samples of the window, from the newest ones; returns their number
+int read_holdout_samples(replay_buffer *rb, int n, double **inputs, int ninput, double **targets, int noutput) {
+  int64_t index;
+  int s, nread = 0;
+
+  if(rb->holdout == 0) {
+    return 0;
+  }
+  for(s=rb->nshards-1; (s>=0) && (nread<n); s--) {
+    for(index=rb->shards[s].reader.header.nsamples-1; (index>=rb->shards[s].start) && (nread<n); index--) {
+      if(held_out(rb, rb->shards[s].shard, index)) {
+        read_sample_at(&rb->shards[s].reader, index, inputs[nread], ninput, targets[nread], noutput);
+        nread++;
+      }
+    }
+  }
+  return nread;
+}
+
+// the position of the draws: the generator, the window and the epoch over it
+void save_replay_cursor(replay_buffer *rb, FILE *out) {
+  int64_t window[3];
+  int written = 1;
+
+  window[0] = (rb->nshards > 0) ? rb->shards[0].shard : -1;
+  window[1] = (rb->nshards > 0) ? rb->shards[0].start : 0;
+  window[2] = rb->next_shard;
+  written &= (fwrite(rb->seed, sizeof(unsigned short), 3, out) == 3);
+  written &= (fwrite(window, sizeof(int64_t), 3, out) == 3);
+  written &= (fwrite(&rb->nsamples, sizeof(int64_t), 1, out) == 1);
+  written &= (fwrite(&rb->npermutation, sizeof(int64_t), 1, out) == 1);
+  written &= (fwrite(&rb->next, sizeof(int64_t), 1, out) == 1);
+  if(rb->npermutation > 0) {
+    written &= (fwrite(rb->permutation, sizeof(int64_t), rb->npermutation, out) == (size_t) rb->npermutation);
+  }
+  if(written == 0) {
+    printf("\nERROR while writing the cursor of the replay buffer of [%s]!\n", rb->prefix);
+    exit(1);
+  }
+}
+
+// the epoch goes on only if the window is still the same, otherwise (new shards written meanwhile) a new epoch starts,
+// as after refresh_replay_buffer. Returns 1 if the epoch goes on
+int load_replay_cursor(replay_buffer *rb, FILE *in) {
+  int64_t window[3], nsamples, npermutation, next;
+  int read = 1, same;
+
+  read &= (fread(rb->seed, sizeof(unsigned short), 3, in) == 3);
+  read &= (fread(window, sizeof(int64_t), 3, in) == 3);
+  read &= (fread(&nsamples, sizeof(int64_t), 1, in) == 1);
+  read &= (fread(&npermutation, sizeof(int64_t), 1, in) == 1);
+  read &= (fread(&next, sizeof(int64_t), 1, in) == 1);
+  if(read == 0) {
+    printf("\nERROR: cursor of the replay buffer of [%s] truncated!\n", rb->prefix);
+    exit(1);
+  }
+  same = (rb->nshards > 0) && (window[0] == rb->shards[0].shard) && (window[1] == rb->shards[0].start);
+  same = same && (window[2] == rb->next_shard) && (nsamples == rb->nsamples) && (npermutation == rb->nsamples);
+
+  rb->npermutation = 0;
+  rb->next = 0;
+  if(same) {
+    alloc_epoch(rb);
+    if(fread(rb->permutation, sizeof(int64_t), npermutation, in) != (size_t) npermutation) {
+      printf("\nERROR: cursor of the replay buffer of [%s] truncated!\n", rb->prefix);
+      exit(1);
+    }
+    rb->npermutation = npermutation;
+    rb->next = next;
+  }
+  else if(npermutation > 0) {
+    fseek(in, npermutation * sizeof(int64_t), SEEK_CUR);
+  }
+  return same;
+}
+
+// empties the shards older than the window, returns their number. The emptied shards are kept, with no
+// samples, so that the shards are still numbered from 0 for the writers and the readers
+int prune_replay_buffer(replay_buffer *rb) {
+  char name[300], temporary_name[310];
+  samples_reader r;
+  samples_header header;
+  samples_footer footer;
+  FILE *file;
+  int shard, npruned = 0;
+
+  shard = (rb->nshards > 0) ? rb->shards[0].shard : rb->next_shard;
+  for(shard=shard-1; shard>=0; shard--) {
+    shard_name(name, rb->prefix, shard);
+    if(open_samples_reader(&r, name) == 0) {
+      break;
+    }
+    header = r.header;
+    close_samples_reader(&r);
+    // the older shards have already been emptied
+    if(header.nsamples == 0) {
+      break;
+    }
+
+    header.nsamples = 0;
+    footer.checksum = 0;
+    footer.magic = SAMPLES_MAGIC;
+    sprintf(temporary_name, "%s.%s", name, SAMPLES_TEMPORARY_EXTENSION);
+    if((file = fopen(temporary_name, "wb")) == NULL) {
+      printf("\nERROR while opening file [%s]\n", temporary_name);
+      exit(1);
+    }
+    fwrite(&header, sizeof(samples_header), 1, file);
+    fwrite(&footer, sizeof(samples_footer), 1, file);
+    fclose(file);
+    if(rename(temporary_name, name) != 0) {
+      printf("\nERROR while renaming file [%s]\n", temporary_name);
+      exit(1);
+    }
+    npruned++;
+  }
+
+  return npruned;
+}
+
+void close_replay_buffer(replay_buffer *rb) {
+  int i;
+
+  for(i=0; i<rb->nshards; i++) {
+    close_samples_reader(&rb->shards[i].reader);
+  }
+  free(rb->shards);
+  free(rb->probability);
+  free(rb->alias);
+  free(rb->permutation);
+  free(rb->offsets);
+  rb->shards = NULL;
+  rb->permutation = NULL;
+  rb->offsets = NULL;
+  rb->nshards = 0;
+  rb->nsamples = 0;
+}
@@ -0,0 +1,82 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "samples.h"
+
+/*
+  Replay buffer of the training samples.
+  A replay buffer keeps the last samples written in the shards of a prefix (see samples.h), up to a
+  window of samples: the shards are added as they are written, also while the self play is still
+  writing them, and the oldest ones leave the window. The shards stay open, and a sample is read
+  directly at its position, so that drawing a sample takes constant time whatever the size of the
+  window: the shard is drawn with an alias table, built on the number of samples of the shards in
+  the window, each multiplied by its priority, then the sample is drawn uniformly in the shard.
+  The priority of a shard is decay^(g - generation), where g is the newest generation in the window:
+  decay 1 samples the window uniformly, decay < 1 prefers the samples of the newest networks.
+  With decay 1 the window can also be read in epochs, each sample once per epoch in a shuffled order
+  (shuffle_replay_buffer and next_replay_sample).
+  The draws have their own random generator, seeded from lrand48 when the buffer is opened, so that
+  they can run on another thread than the rest of the training. The generator and the epoch can be
+  saved in a checkpoint of the training (save_replay_cursor and load_replay_cursor).
+  A fixed fraction of the samples can be held out for the validation (set_replay_holdout): the draws
+  skip them, and read_holdout_samples reads them.
+*/
+
+#define REPLAY_MAX_SHARDS 4096
+
+/************** STRUCTS ******************/
+typedef struct {
+  samples_reader reader;
+  int shard;
+  // first sample of the shard still in the window
+  int64_t start;
+  double priority;
+} replay_shard;
+
+typedef struct {
+  char prefix[256];
+  int64_t window;
+  double decay;
+
+  // shards in the window, from the oldest one
+  replay_shard *shards;
+  int nshards;
+  // first shard not read yet
+  int next_shard;
+  int64_t nsamples;
+
+  // alias table over the shards
+  double *probability;
+  int *alias;
+
+  // generator of the draws (see erand48)
+  unsigned short seed[3];
+
+  // one sample out of holdout is held out (0 for none)
+  int holdout;
+
+  // epoch: permutation of the samples of the window, next sample of the permutation, and first sample
+  // of each shard in the window
+  int64_t *permutation;
+  int64_t npermutation;
+  int64_t next;
+  int64_t *offsets;
+} replay_buffer;
+
+/*************** FUNCTIONS ***************/
+
+void open_replay_buffer(replay_buffer *rb, char *prefix, int64_t window, double decay);
+int refresh_replay_buffer(replay_buffer *rb);
+void sample_replay(replay_buffer *rb, double *input, int ninput, double *target, int noutput);
+void shuffle_replay_buffer(replay_buffer *rb);
+void next_replay_sample(replay_buffer *rb, double *input, int ninput, double *target, int noutput);
+void save_replay_cursor(replay_buffer *rb, FILE *out);
+int load_replay_cursor(replay_buffer *rb, FILE *in);
+void set_replay_holdout(replay_buffer *rb, int stride);
+int read_holdout_samples(replay_buffer *rb, int n, double **inputs, int ninput, double **targets, int noutput);
+int prune_replay_buffer(replay_buffer *rb);
+void close_replay_buffer(replay_buffer *rb);
+
+#endif
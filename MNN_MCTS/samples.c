@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "samples.h"
+
+
+// FUNCTIONS
+
+// WRITING
+
+void open_samples_writer(samples_writer *w, char *prefix, int ninput, int noutput, int input_type, int target_type, int generation, long shard_size) {
+  char name[300];
+  FILE *test;
+
+  if(strlen(prefix) >= sizeof(w->prefix)) {
+    printf("\nERROR: prefix of the samples [%s] too long!\n", prefix);
+    exit(1);
+  }
+  strcpy(w->prefix, prefix);
+
+  w->header.magic = SAMPLES_MAGIC;
+  w->header.version = SAMPLES_VERSION;
+  w->header.ninput = ninput;
+  w->header.noutput = noutput;
+  w->header.input_type = input_type;
+  w->header.target_type = target_type;
+  w->header.generation = generation;
+  w->header.reserved = 0;
+  w->header.nsamples = 0;
+
+  w->record_size = samples_values_size(input_type, ninput) + samples_values_size(target_type, noutput);
+  w->shard_size = shard_size;
+
+  // the buffer holds at least one record
+  w->buffer = (unsigned char *) malloc((w->record_size > SAMPLES_BUFFER_SIZE) ? w->record_size : SAMPLES_BUFFER_SIZE);
+  if(w->buffer == NULL) {
+    printf("\nERROR: Malloc of samples buffer failed.\n");
+    exit(1);
+  }
+  w->nbuffer = 0;
+  w->crc = 0;
+  w->file = NULL;
+
+  // never overwrite the shards already written
+  w->shard = 0;
+  shard_name(name, w->prefix, w->shard);
+  while((test = fopen(name, "rb")) != NULL) {
+    fclose(test);
+    w->shard++;
+    shard_name(name, w->prefix, w->shard);
+  }
+}
+
+// writes the buffered records to the current shard
+static void flush_samples_buffer(samples_writer *w) {
+  if(w->nbuffer == 0) {
+    return;
+  }
+  w->crc = crc32_update(w->crc, w->buffer, w->nbuffer);
+  if(fwrite(w->buffer, 1, w->nbuffer, w->file) != w->nbuffer) {
+    printf("\nERROR while writing shard %d of [%s]\n", w->shard, w->prefix);
+    exit(1);
+  }
+  w->nbuffer = 0;
+}
+
+// completes the current shard with its footer and its number of samples
+static void close_shard(samples_writer *w) {
+  samples_footer footer;
+  char name[300], temporary_name[310];
+
+  if(w->file == NULL) {
+    return;
+  }
+  flush_samples_buffer(w);
+
+  footer.checksum = w->crc;
+  footer.magic = SAMPLES_MAGIC;
+  fwrite(&footer, sizeof(samples_footer), 1, w->file);
+
+  fseek(w->file, 0, SEEK_SET);
+  fwrite(&w->header, sizeof(samples_header), 1, w->file);
+  fclose(w->file);
+
+  // the shard becomes visible to the readers only now that it is complete
+  shard_name(name, w->prefix, w->shard);
+  sprintf(temporary_name, "%s.%s", name, SAMPLES_TEMPORARY_EXTENSION);
+  if(rename(temporary_name, name) != 0) {
+    printf("\nERROR while renaming file [%s]\n", temporary_name);
+    exit(1);
+  }
+
+  w->file = NULL;
+  w->shard++;
+}
+
+static void open_shard(samples_writer *w) {
+  char name[300], temporary_name[310];
+
+  shard_name(name, w->prefix, w->shard);
+  sprintf(temporary_name, "%s.%s", name, SAMPLES_TEMPORARY_EXTENSION);
+  if((w->file = fopen(temporary_name, "wb")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", temporary_name);
+    exit(1);
+  }
+
+  // the number of samples is written when the shard is closed
+  w->header.nsamples = 0;
+  w->crc = 0;
+  fwrite(&w->header, sizeof(samples_header), 1, w->file);
+}
+
+static unsigned char *encode_values(unsigned char *p, double *values, int n, int type) {
+  int i;
+  int8_t v8;
+  int16_t v16;
+  uint16_t h;
+  float f;
+
+  if(type == SAMPLES_TERNARY) {
+    memset(p, 0, samples_values_size(type, n));
+    for(i=0; i<n; i++) {
+      if((values[i] != -1.) && (values[i] != 0.) && (values[i] != 1.)) {
+        printf("\nERROR: value %g can not be stored as ternary!\n", values[i]);
+        exit(1);
+      }
+      p[i / 4] |= (unsigned char)((int) values[i] + 1) << (2 * (i % 4));
+    }
+    return p + samples_values_size(type, n);
+  }
+
+  for(i=0; i<n; i++) {
+    switch(type) {
+      case SAMPLES_INT8:
+        v8 = (int8_t) values[i];
+        if((double) v8 != values[i]) {
+          printf("\nERROR: value %g can not be stored as int8!\n", values[i]);
+          exit(1);
+        }
+        memcpy(p, &v8, 1);
+        p += 1;
+        break;
+      case SAMPLES_INT16:
+        v16 = (int16_t) values[i];
+        if((double) v16 != values[i]) {
+          printf("\nERROR: value %g can not be stored as int16!\n", values[i]);
+          exit(1);
+        }
+        memcpy(p, &v16, 2);
+        p += 2;
+        break;
+      case SAMPLES_FLOAT16:
+        h = float_to_half((float) values[i]);
+        memcpy(p, &h, 2);
+        p += 2;
+        break;
+      case SAMPLES_FLOAT32:
+        f = (float) values[i];
+        memcpy(p, &f, 4);
+        p += 4;
+        break;
+    }
+  }
+
+  return p;
+}
+
+void write_sample(samples_writer *w, double *input, double *target) {
+  unsigned char *p;
+
+  if(w->file == NULL) {
+    open_shard(w);
+  }
+  if(w->nbuffer + w->record_size > ((w->record_size > SAMPLES_BUFFER_SIZE) ? w->record_size : SAMPLES_BUFFER_SIZE)) {
+    flush_samples_buffer(w);
+  }
+
+  p = w->buffer + w->nbuffer;
+  p = encode_values(p, input, w->header.ninput, w->header.input_type);
+  encode_values(p, target, w->header.noutput, w->header.target_type);
+  w->nbuffer += w->record_size;
+  w->header.nsamples++;
+
+  if((w->shard_size > 0) && (w->header.nsamples >= w->shard_size)) {
+    close_shard(w);
+  }
+}
+
+// completes the current shard, so that its samples can be read; the next sample starts a new shard
+void next_samples_shard(samples_writer *w) {
+  close_shard(w);
+}
+
+// the samples of a generation of the networks do not share their shards with the ones of another generation
+void set_samples_generation(samples_writer *w, int generation) {
+  if(w->header.generation == generation) {
+    return;
+  }
+  close_shard(w);
+  w->header.generation = generation;
+}
+
+void close_samples_writer(samples_writer *w) {
+  close_shard(w);
+  free(w->buffer);
+  w->buffer = NULL;
+}
+
+
+// READING
+
+// returns 0 if the shard does not exist
+int open_samples_reader(samples_reader *r, char *file_name) {
+  long size;
+
+  if((r->file = fopen(file_name, "rb")) == NULL) {
+    return 0;
+  }
+  if(fread(&r->header, sizeof(samples_header), 1, r->file) != 1) {
+    printf("\nERROR: [%s] is not a samples file!\n", file_name);
+    exit(1);
+  }
+  if(r->header.magic != SAMPLES_MAGIC) {
+    printf("\nERROR: [%s] is not a samples file!\n", file_name);
+    exit(1);
+  }
+  if(r->header.version != SAMPLES_VERSION) {
+    printf("\nERROR: [%s] has version %u, version %d expected!\n", file_name, r->header.version, SAMPLES_VERSION);
+    exit(1);
+  }
+
+  r->record_size = samples_values_size(r->header.input_type, r->header.ninput) + samples_values_size(r->header.target_type, r->header.noutput);
+
+  // a shard whose writing was interrupted has no footer, or a wrong number of samples
+  fseek(r->file, 0, SEEK_END);
+  size = ftell(r->file);
+  if(size != (long)(sizeof(samples_header) + r->header.nsamples * r->record_size + sizeof(samples_footer))) {
+    printf("\nERROR: [%s] is incomplete!\n", file_name);
+    exit(1);
+  }
+  r->map_size = (size_t) size;
+  r->map = (unsigned char *) mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fileno(r->file), 0);
+  if(r->map == MAP_FAILED) {
+    printf("\nERROR: [%s] can not be mapped in memory!\n", file_name);
+    exit(1);
+  }
+  // the samples are mostly drawn at random, reading ahead would be wasted
+  madvise(r->map, r->map_size, MADV_RANDOM);
+  r->nread = 0;
+  r->crc = 0;
+
+  return 1;
+}
+
+static unsigned char *decode_values(unsigned char *p, int nstored, int type, double *values, int n) {
+  int i;
+  int8_t v8;
+  int16_t v16;
+  uint16_t h;
+  float f;
+  double v;
+
+  for(i=0; i<nstored; i++) {
+    switch(type) {
+      case SAMPLES_TERNARY:
+        v = (double)((p[i / 4] >> (2 * (i % 4))) & 3) - 1.;
+        break;
+      case SAMPLES_INT8:
+        memcpy(&v8, p, 1);
+        v = v8;
+        p += 1;
+        break;
+      case SAMPLES_INT16:
+        memcpy(&v16, p, 2);
+        v = v16;
+        p += 2;
+        break;
+      case SAMPLES_FLOAT16:
+        memcpy(&h, p, 2);
+        v = half_to_float(h);
+        p += 2;
+        break;
+      default:
+        memcpy(&f, p, 4);
+        v = f;
+        p += 4;
+        break;
+    }
+    if(i < n) {
+      values[i] = v;
+    }
+  }
+  if(type == SAMPLES_TERNARY) {
+    p += samples_values_size(type, nstored);
+  }
+  // missing values are set to zero, as for the inputs of the networks
+  for(i=nstored; i<n; i++) {
+    values[i] = 0.;
+  }
+
+  return p;
+}
+
+// returns 0 when all the samples of the shard have been read, after checking their checksum
+int read_sample(samples_reader *r, double *input, int ninput, double *target, int noutput) {
+  samples_footer footer;
+  unsigned char *p;
+
+  if(r->nread == r->header.nsamples) {
+    memcpy(&footer, r->map + sizeof(samples_header) + r->header.nsamples * r->record_size, sizeof(samples_footer));
+    if((footer.magic != SAMPLES_MAGIC) || (footer.checksum != r->crc)) {
+      printf("\nERROR: wrong checksum of the samples!\n");
+      exit(1);
+    }
+    return 0;
+  }
+
+  p = r->map + sizeof(samples_header) + r->nread * r->record_size;
+  r->crc = crc32_update(r->crc, p, r->record_size);
+  r->nread++;
+
+  p = decode_values(p, r->header.ninput, r->header.input_type, input, ninput);
+  decode_values(p, r->header.noutput, r->header.target_type, target, noutput);
+
+  return 1;
+}
+
+// reads the sample n. index of the shard, without checking the checksum (see read_sample);
+// returns 0 if the shard has no such sample
+int read_sample_at(samples_reader *r, int64_t index, double *input, int ninput, double *target, int noutput) {
+  unsigned char *p;
+
+  if((index < 0) || (index >= r->header.nsamples)) {
+    return 0;
+  }
+
+  p = r->map + sizeof(samples_header) + index * r->record_size;
+  p = decode_values(p, r->header.ninput, r->header.input_type, input, ninput);
+  decode_values(p, r->header.noutput, r->header.target_type, target, noutput);
+
+  return 1;
+}
+
+void close_samples_reader(samples_reader *r) {
+  munmap(r->map, r->map_size);
+  fclose(r->file);
+  r->map = NULL;
+}
+
+// number of samples in the shards of a prefix
+int64_t count_samples(char *prefix, int *nshards) {
+  char name[300];
+  samples_reader r;
+  int64_t nsamples = 0;
+
+  *nshards = 0;
+  shard_name(name, prefix, *nshards);
+  while(open_samples_reader(&r, name)) {
+    nsamples += r.header.nsamples;
+    close_samples_reader(&r);
+    (*nshards)++;
+    shard_name(name, prefix, *nshards);
+  }
+
+  return nsamples;
+}
+
+
+// CONVERSION
+
+// reads the values of the next line of a text dataset, returns their number (-1 at the end of the file)
+static int read_text_line(FILE *in, char **line, size_t *size, double **values, int *capacity) {
+  char *p, *end;
+  int n = 0;
+
+  if(getline(line, size, in) == -1) {
+    return -1;
+  }
+  p = *line;
+  while(1) {
+    double v = strtod(p, &end);
+    if(end == p) {
+      break;
+    }
+    if(n == *capacity) {
+      *capacity = 2 * *capacity + 16;
+      *values = (double *) realloc(*values, *capacity * sizeof(double));
+      if(*values == NULL) {
+        printf("\nERROR: Malloc of the conversion buffer failed.\n");
+        exit(1);
+      }
+    }
+    (*values)[n++] = v;
+    p = end;
+  }
+
+  return n;
+}
+
+// the most compact encoding of the inputs of a text dataset: ternary, int16, or float32
+static int text_input_type(FILE *in, char **line, size_t *size, double **values, int *capacity) {
+  int i, n, type = SAMPLES_TERNARY;
+
+  while((n = read_text_line(in, line, size, values, capacity)) >= 0) {
+    for(i=0; i<n; i++) {
+      double v = (*values)[i];
+      if((type == SAMPLES_TERNARY) && (v != -1.) && (v != 0.) && (v != 1.)) {
+        type = SAMPLES_INT16;
+      }
+      if((type == SAMPLES_INT16) && (v != (double)(int16_t) v)) {
+        type = SAMPLES_FLOAT32;
+      }
+    }
+  }
+  rewind(in);
+
+  return type;
+}
+
+// writes the samples of the text files file_input and file_output as the shards <prefix>_*.smp, returns their number.
+// The text is parsed once, the shards are then read by the training in place of it
+int64_t convert_text_samples(char *file_input, char *file_output, char *prefix, int target_type) {
+  FILE *in, *out;
+  samples_writer w;
+  char *line = NULL;
+  size_t size = 0;
+  double *input = NULL, *target = NULL;
+  int ninput, noutput, capacity_input = 0, capacity_target = 0, input_type;
+  int64_t nsamples = 0;
+
+  if((in = fopen(file_input, "r")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", file_input);
+    exit(1);
+  }
+  if((out = fopen(file_output, "r")) == NULL) {
+    printf("\nERROR while opening file [%s]\n", file_output);
+    exit(1);
+  }
+
+  input_type = text_input_type(in, &line, &size, &input, &capacity_input);
+  while((ninput = read_text_line(in, &line, &size, &input, &capacity_input)) > 0) {
+    noutput = read_text_line(out, &line, &size, &target, &capacity_target);
+    if(noutput <= 0) {
+      printf("\nERROR: [%s] has fewer lines than [%s]!\n", file_output, file_input);
+      exit(1);
+    }
+    if(nsamples == 0) {
+      open_samples_writer(&w, prefix, ninput, noutput, input_type, target_type, 0, 0);
+    }
+    else if((ninput != w.header.ninput) || (noutput != w.header.noutput)) {
+      printf("\nERROR: line %ld of [%s] has a different size!\n", (long) nsamples + 1, file_input);
+      exit(1);
+    }
+    write_sample(&w, input, target);
+    nsamples++;
+  }
+  if(nsamples > 0) {
+    close_samples_writer(&w);
+  }
+
+  free(line);
+  free(input);
+  free(target);
+  fclose(in);
+  fclose(out);
+
+  return nsamples;
+}
+
+// TOOL FUNCTIONS
+
+void shard_name(char *name, char *prefix, int shard) {
+  sprintf(name, "%s_%05d.%s", prefix, shard, SAMPLES_EXTENSION);
+}
+
+// bytes taken by n values
+size_t samples_values_size(int type, int n) {
+  switch(type) {
+    case SAMPLES_TERNARY:
+      return (n + 3) / 4;
+    case SAMPLES_INT8:
+      return n;
+    case SAMPLES_INT16:
+    case SAMPLES_FLOAT16:
+      return 2 * n;
+    case SAMPLES_FLOAT32:
+      return 4 * n;
+  }
+  printf("\nERROR: unknown type %d of the samples!\n", type);
+  exit(1);
+}
+
+uint32_t crc32_update(uint32_t crc, unsigned char *data, size_t n) {
+  static uint32_t table[256];
+  static int table_ready = 0;
+  uint32_t c;
+  size_t i;
+  int j;
+
+  if(!table_ready) {
+    for(i=0; i<256; i++) {
+      c = (uint32_t) i;
+      for(j=0; j<8; j++) {
+        c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+      }
+      table[i] = c;
+    }
+    table_ready = 1;
+  }
+
+  crc = ~crc;
+  for(i=0; i<n; i++) {
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// IEEE half precision, rounded to the nearest even
+uint16_t float_to_half(float f) {
+  uint32_t x, sign, mantissa, half, rest, halfway;
+  int32_t exponent;
+  int shift;
+
+  memcpy(&x, &f, 4);
+  sign = (x >> 16) & 0x8000;
+  exponent = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+  mantissa = x & 0x7fffff;
+
+  // infinity and nan
+  if(((x >> 23) & 0xff) == 0xff) {
+    return (uint16_t)(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+  }
+  // overflow
+  if(exponent >= 31) {
+    return (uint16_t)(sign | 0x7c00);
+  }
+  // subnormal numbers
+  if(exponent <= 0) {
+    if(exponent < -10) {
+      return (uint16_t) sign;
+    }
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    half = mantissa >> shift;
+    rest = mantissa & ((1U << shift) - 1);
+    halfway = 1U << (shift - 1);
+    if((rest > halfway) || ((rest == halfway) && (half & 1))) {
+      half++;
+    }
+    return (uint16_t)(sign | half);
+  }
+
+  half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+  rest = mantissa & 0x1fff;
+  if((rest > 0x1000) || ((rest == 0x1000) && (half & 1))) {
+    half++;
+  }
+  return (uint16_t)(sign | half);
+}
+
+float half_to_float(uint16_t h) {
+  uint32_t sign, exponent, mantissa, x;
+  float f;
+
+  sign = ((uint32_t) h & 0x8000) << 16;
+  exponent = (h >> 10) & 0x1f;
+  mantissa = h & 0x3ff;
+
+  if(exponent == 0) {
+    if(mantissa == 0) {
+      x = sign;
+    }
+    else {
+      // subnormal numbers
+      exponent = 127 - 15 + 1;
+      while(!(mantissa & 0x400)) {
+        mantissa <<= 1;
+        exponent--;
+      }
+      mantissa &= 0x3ff;
+      x = sign | (exponent << 23) | (mantissa << 13);
+    }
+  }
+  else if(exponent == 31) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  }
+  else {
+    x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+
+  memcpy(&f, &x, 4);
+  return f;
+}
@@ -0,0 +1,99 @@
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+  Binary training samples.
+  The samples of a network are written in shards named <prefix>_00000.smp, <prefix>_00001.smp, ...
+  Each shard is made of a header, a sequence of fixed size records (the input followed by the target)
+  and a footer with the CRC32 of the records. The number of samples is written in the header when
+  the shard is closed, so that a shard left incomplete by an interrupted run is recognized.
+  A shard is written as <name>.tmp and renamed when it is closed, so that a reader running at the
+  same time as the writer (see replay.h) only finds complete shards. Since the records have a fixed
+  size, any sample of a shard can be read directly with read_sample_at: the readers map the shards
+  in memory, so that reading a sample is only decoding its record.
+  The text datasets (<name>_input.dat and <name>_output.dat) are converted once to shards by
+  convert_text_samples.
+*/
+
+#define SAMPLES_MAGIC 0x534D4E4DU
+#define SAMPLES_VERSION 1
+#define SAMPLES_EXTENSION "smp"
+#define SAMPLES_BUFFER_SIZE (1 << 20)
+#define SAMPLES_TEMPORARY_EXTENSION "tmp"
+
+// encodings of the inputs and of the targets (ternary values -1, 0, 1 are packed four in a byte)
+#define SAMPLES_TERNARY 0
+#define SAMPLES_INT8 1
+#define SAMPLES_INT16 2
+#define SAMPLES_FLOAT16 3
+#define SAMPLES_FLOAT32 4
+
+/************** STRUCTS ******************/
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t ninput, noutput;
+  int32_t input_type, target_type;
+  int32_t generation;
+  int32_t reserved;
+  int64_t nsamples;
+} samples_header;
+
+typedef struct {
+  uint32_t checksum;
+  uint32_t magic;
+} samples_footer;
+
+typedef struct {
+  FILE *file;
+  char prefix[256];
+  samples_header header;
+  int shard;
+  long shard_size;
+  size_t record_size;
+  unsigned char *buffer;
+  size_t nbuffer;
+  uint32_t crc;
+} samples_writer;
+
+typedef struct {
+  FILE *file;
+  samples_header header;
+  size_t record_size;
+  // the whole shard, mapped in memory
+  unsigned char *map;
+  size_t map_size;
+  int64_t nread;
+  uint32_t crc;
+} samples_reader;
+
+/*************** FUNCTIONS ***************/
+
+// WRITING
+void open_samples_writer(samples_writer *w, char *prefix, int ninput, int noutput, int input_type, int target_type, int generation, long shard_size);
+void write_sample(samples_writer *w, double *input, double *target);
+void next_samples_shard(samples_writer *w);
+void set_samples_generation(samples_writer *w, int generation);
+void close_samples_writer(samples_writer *w);
+
+// READING
+int open_samples_reader(samples_reader *r, char *file_name);
+int read_sample(samples_reader *r, double *input, int ninput, double *target, int noutput);
+int read_sample_at(samples_reader *r, int64_t index, double *input, int ninput, double *target, int noutput);
+void close_samples_reader(samples_reader *r);
+int64_t count_samples(char *prefix, int *nshards);
+
+// CONVERSION
+int64_t convert_text_samples(char *file_input, char *file_output, char *prefix, int target_type);
+
+// TOOL FUNCTIONS
+void shard_name(char *name, char *prefix, int shard);
+size_t samples_values_size(int type, int n);
+uint32_t crc32_update(uint32_t crc, unsigned char *data, size_t n);
+uint16_t float_to_half(float f);
+float half_to_float(uint16_t h);
+
+#endif
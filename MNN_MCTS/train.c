@@ -4,228 +4,857 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "net.h"
+#include "samples.h"
+#include "replay.h"
 
+// the examples are read in chunks of MAX_DATA. With --all the chunks of each network have its share of MAX_DATA, by its
+// number of samples, and at least MIN_DATA examples, so that the chunks of all the networks take about the memory of the
+// chunks of one network
 #define MAX_DATA 100000
-#define BUFSIZE 100000
-
-int main(int argc, char *argv[]) {
-  NN net;
-  double learning_rate, momentum, weight_decay;
-  int Niterations, batchsize;
-  int ninput, noutput, ndata, ndatain, ndataout;
-  int i, j;
-  int n, nit, ntrainings;
+#define MIN_DATA 10000
+
+// the binary shards are sampled from the last REPLAY_WINDOW samples, preferring the newest generations
+// by REPLAY_DECAY (1 to sample them uniformly); with REPLAY_PRUNE the shards older than the window are emptied
+#define REPLAY_WINDOW 2000000
+#define REPLAY_DECAY 1.
+#define REPLAY_PRUNE 0
+
+// threads sharing each minibatch (0 for one per core, at most TRAINING_SHARDS): the trained network does not depend on
+// their number. With TRAIN_SEED > 0 the samples are drawn and shuffled always in the same way, otherwise from the time
+#define TRAIN_THREADS 0
+#define TRAIN_SEED 0
+
+// solver of the training: SOLVER_SGD (learning rate 0.1, momentum 0.9), SOLVER_ADAM or SOLVER_ADAMW (learning rate
+// ADAM_RATE, see optimizer in net.h); the learning rate is halved in the last 5 of the ITERATIONS over the window
+#define SOLVER SOLVER_SGD
+#define ADAM_RATE 0.001
+#define ITERATIONS 20
+
+// one sample out of VALIDATION_STRIDE is held out of the training (0 for no validation), and the newest VALIDATION_SAMPLES
+// of them are the validation set: its loss is evaluated every VALIDATION_FREQUENCY chunks of MAX_DATA examples (every
+// VALIDATION_FREQUENCY*MAX_DATA examples with smaller chunks), instead of the loss of each chunk after training on it, and the training stops after EARLY_STOPPING_PATIENCE evaluations (0 for never) with no
+// improvement by EARLY_STOPPING_DELTA. With validation <name>_network_new.txt is the network with the best loss
+#define VALIDATION_STRIDE 50
+#define VALIDATION_SAMPLES 10000
+#define VALIDATION_FREQUENCY 5
+#define EARLY_STOPPING_PATIENCE 4
+#define EARLY_STOPPING_DELTA 0.
+
+// the state of the training (network, momenta of the solver, random generators and positions in the samples) is saved in
+// <name>_checkpoint.bin every CHECKPOINT_CHUNKS chunks of MAX_DATA examples (as for the validation) and at the end of each
+// iteration, and restored with --resume
+#define CHECKPOINT_CHUNKS 5
+#define CHECKPOINT_MAGIC "MNNCKPT3"
+
+// examples drawn from the binary shards <prefix>_*.smp; the text files <name>_input.dat and <name>_output.dat are converted
+// once to shards, the first time they are used. With REPLAY_DECAY 1 the window is read in shuffled epochs, otherwise
+// the samples are drawn according to the priorities of their generations
+typedef struct {
+  char prefix[256];
+  replay_buffer replay;
+} examples;
+
+// chunk of up to size examples, filled on a background thread while the network trains on the previous one
+typedef struct {
+  examples *data;
+  int ninput, noutput;
+  int n, size;
+  double *inputs, *targets;
   double **dataset, **target;
-  char file_data[80], file_target[80], file_network[80];
-  char buffer[BUFSIZE];
-  FILE *in, *out;
+  pthread_t thread;
+} chunk;
+
+// with --all the seven networks are trained at the same time, each as a job on its own thread. The jobs share the
+// threads of the minibatches in proportion to the weights of the networks still training, so the training takes about
+// the time of the largest network; their progress is reported every REPORT_INTERVAL seconds. Each job holds its own
+// chunks, sized by its share of the samples (see MIN_DATA): the memory of the examples is printed when they are allocated
+#define NETWORKS 7
+#define REPORT_INTERVAL 30
+
+const char *NETWORK_NAMES[NETWORKS] = {"pieces", "pawn", "rook", "knight", "bishop", "queen", "king"};
+
+// with --multi the multi-head network which replaces the seven networks (see multi_net in net.h) is trained as a job:
+// each head on the samples of the network it replaces, in the order of NETWORK_NAMES, with chunks of the same fraction
+// of the samples of each head (chunk_data examples of the first one). A new network has a trunk on the first
+// TRUNK_INPUTS inputs of the samples (the pieces, the en passant, the castlings and the player, the same for all the
+// networks) with the hidden layers of the networks, and a hidden layer of HEAD_UNITS units in each head, the sizes of
+// its inputs and outputs taken from the samples
+#define TRUNK_INPUTS 397
+#define HEAD_UNITS 64
+
+// threads shared by the jobs
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t finished;
+  int nthreads;
+  int running;
+  long weights;
+} thread_pool;
+
+// training of a network: its samples, its state (checkpointed) and its progress, read by the report under the mutex of the pool.
+// The samples are in nsets sets: the samples of the network, or of each head of the multi-head network (with multi), the
+// validation of the first set keeping the state of the validation (see train_multi)
+typedef struct {
+  char name[80];
+  char file_network[80], file_checkpoint[80], file_new[80];
+  NN net;
+  multi_net multi_net;
+  int multi, nsets;
+  examples data[MAX_HEADS];
+  chunk chunks[2][MAX_HEADS], held_out[MAX_HEADS];
+  validation v[MAX_HEADS];
+  unsigned short seed[3];
+  int ninput[MAX_HEADS], noutput[MAX_HEADS], ndata;
+  // examples of the chunks of the first set, and chunks between the checkpoints
+  int chunk_data, checkpoint_chunks;
+  // samples of the sets in the window of the iteration
+  int window[MAX_HEADS];
+  int first_nit, first_chunk;
+  long weights;
+  thread_pool *pool;
+  int verbose;
+  int nit, n, nchunks, nthreads, done;
+  long samples;
+  struct timespec start;
+  double seconds;
+  pthread_t thread;
+} job;
+
+void open_examples(examples *e, char *file_data, char *file_target);
+void rewind_examples(examples *e);
+void read_example(examples *e, double *input, int ninput, double *target, int noutput);
+void close_examples(examples *e);
+void init_chunk(chunk *c, examples *data, int size, int ninput, int noutput);
+int chunk_size(int n, int nchunks, int ndata, int chunk_data);
+void prefetch_chunk(chunk *c, int n);
+void wait_chunk(chunk *c);
+void free_chunk(chunk *c);
+int find_samples(char *prefix, size_t size, const char *directory, const char *name);
+void init_heads(multi_net *m, examples *data);
+int open_job(job *j, char *name, char *prefix, long seed, int resume, int multi, thread_pool *pool);
+double init_job_chunks(job *j, int chunk_data);
+void *train_job(void *arg);
+void close_job(job *j);
+void report_jobs(job *jobs, int njobs);
+void save_checkpoint(job *j, int nit, int n);
+void load_checkpoint(job *j);
 
-  // check if user gave file name
-  if(argc != 2) {
-    printf("\nERROR: network to load not specified!\n");
+int main(int argc, char *argv[]) {
+  job *jobs;
+  thread_pool pool;
+  int njobs, nthreads;
+  int i, h, nargs, resume, all, multi;
+  long seed, ndata;
+  double memory;
+  char *args[4];
+  char prefix[256];
+  struct timespec deadline;
+
+  // check if user gave file name; the binary shards may be read from another directory, as a replay buffer written by the self play
+  resume = 0;
+  all = 0;
+  multi = 0;
+  nargs = 0;
+  for(i=0;i<argc;i++) {
+    if(strcmp(argv[i], "--resume") == 0) {
+      resume = 1;
+    }
+    else if(strcmp(argv[i], "--all") == 0) {
+      all = 1;
+    }
+    else if(strcmp(argv[i], "--multi") == 0) {
+      multi = 1;
+    }
+    else if(nargs < 4) {
+      args[nargs++] = argv[i];
+    }
+    else {
+      nargs = 5;
+    }
+  }
+  if((all == 0) && ((nargs < 2) || (nargs > 4))) {
+    printf("\nERROR: network to load not specified!\nUsage: %s <network> [<prefix of the samples> [<threads>]] [--resume]\n       %s --all [<directory of the samples> [<threads>]] [--resume]\n       %s --multi <network> [<directory of the samples> [<threads>]] [--resume]\n", argv[0], argv[0], argv[0]);
     exit(1);
   }
-  // set names of network, dataset and target files
-  sprintf(file_network, "%s_network.txt", argv[1]);
-  sprintf(file_data, "%s_input.dat", argv[1]);
-  sprintf(file_target, "%s_output.dat", argv[1]);
-
-  // init seed for random generator
-  srand48(time(0));
+  if(all && multi) {
+    printf("\nERROR: --all and --multi train different networks!\n");
+    exit(1);
+  }
+  if((all == 1) && (nargs > 3)) {
+    printf("\nERROR: too many arguments!\nUsage: %s --all [<directory of the samples> [<threads>]] [--resume]\n", argv[0]);
+    exit(1);
+  }
+  nthreads = (nargs == 3 + (all == 0)) ? atoi(args[2 + (all == 0)]) : TRAIN_THREADS;
+  if(nthreads <= 0) {
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if((all == 0) && (nthreads > TRAINING_SHARDS)) {
+    nthreads = TRAINING_SHARDS;
+  }
 
+  // seed of the random generators, the seed of the first job increased by one for each of the next ones
+  seed = (TRAIN_SEED > 0) ? TRAIN_SEED : time(0);
 
-  // load network
-  load_net(&net, file_network);
-  print_network_structure(&net);
-  noutput = get_output_size(&net);
-  ninput = get_input_size(&net);
+  pthread_mutex_init(&pool.mutex, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+  pool.nthreads = nthreads;
+  pool.running = 0;
+  pool.weights = 0;
 
-  // read files
-  if((in = fopen(file_data, "r")) == NULL) {
-    printf("Error opening the file \"%s\", program will be arrested.", file_data);
+  // load the networks and open the windows of their shards: with --all the shards of the directory, and the text files
+  // of the networks which have none there
+  jobs = (job *)malloc(NETWORKS * sizeof(job));
+  if(jobs == NULL) {
+    printf("Error allocating the memory for the jobs, program will be arrested.\n");
     exit(EXIT_FAILURE);
   }
-  if((out = fopen(file_target, "r")) == NULL) {
-    printf("Error opening the file \"%s\", program will be arrested.", file_target);
-    exit(EXIT_FAILURE);
+  njobs = 0;
+  if(all == 0) {
+    snprintf(prefix, sizeof(prefix), "%s", (nargs >= 3) ? args[2] : (multi ? "." : args[1]));
+    if(open_job(&jobs[0], args[1], prefix, seed, resume, multi, &pool) == 0) {
+      printf("Error, number of data not enough to build a batch.\n");
+      exit(EXIT_FAILURE);
+    }
+    njobs = 1;
   }
+  else {
+    for(h=0;h<NETWORKS;h++) {
+      if(find_samples(prefix, sizeof(prefix), (nargs >= 2) ? args[1] : ".", NETWORK_NAMES[h]) == 0) {
+        printf("No samples of the %s network, it is skipped.\n", NETWORK_NAMES[h]);
+        continue;
+      }
+      if(open_job(&jobs[njobs], (char *)NETWORK_NAMES[h], prefix, seed + h, resume, 0, &pool) == 0) {
+        printf("Not enough samples to train the %s network, it is skipped.\n", NETWORK_NAMES[h]);
+        continue;
+      }
+      njobs++;
+    }
+  }
+  ndata = 0;
+  for(i=0;i<njobs;i++) {
+    ndata += jobs[i].ndata;
+  }
+  memory = 0.;
+  for(i=0;i<njobs;i++) {
+    jobs[i].verbose = (all == 0);
+    pool.running++;
+    pool.weights += jobs[i].weights;
+    memory += init_job_chunks(&jobs[i], (all == 0) ? MAX_DATA : (int)((double)MAX_DATA * jobs[i].ndata / ndata));
+  }
+  printf("\n%.2f GB of memory for the examples.\n", memory / (1 << 30));
 
-  ndatain = 0;
-  while (fgets(buffer, BUFSIZE, in) != NULL) {
-    ndatain++;
+  // train
+  if(all == 0) {
+    printf("\nFiles read.\n%d examples to process on %d threads.\n\n", jobs[0].ndata, nthreads);
+    train_job(&jobs[0]);
   }
-  fclose(in);
+  else {
+    printf("\n%d networks to train on %d threads.\n\n", njobs, nthreads);
+    for(i=0;i<njobs;i++) {
+      if(pthread_create(&jobs[i].thread, NULL, train_job, &jobs[i]) != 0) {
+        printf("Error creating the thread of a training, program will be arrested.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    pthread_mutex_lock(&pool.mutex);
+    while(pool.running > 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += REPORT_INTERVAL;
+      if(pthread_cond_timedwait(&pool.finished, &pool.mutex, &deadline) != 0) {
+        report_jobs(jobs, njobs);
+      }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    for(i=0;i<njobs;i++) {
+      pthread_join(jobs[i].thread, NULL);
+    }
+    report_jobs(jobs, njobs);
+  }
+
+  for(i=0;i<njobs;i++) {
+    close_job(&jobs[i]);
+  }
+  free(jobs);
+  pthread_cond_destroy(&pool.finished);
+  pthread_mutex_destroy(&pool.mutex);
+
+  return 0;
+}
+
+// state of the generator of lrand48 (seed48 returns it, and resets it)
+static void get_rand48_state(unsigned short state[3]) {
+  unsigned short zero[3] = {0, 0, 0};
+
+  memcpy(state, seed48(zero), 3 * sizeof(unsigned short));
+  seed48(state);
+}
+
+static double elapsed_seconds(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - start->tv_sec) + 1e-9 * (double)(now.tv_nsec - start->tv_nsec);
+}
+
+// threads of the next chunk of the job, in proportion to its share of the weights of the networks still training
+static int job_threads(job *j) {
+  thread_pool *p = j->pool;
+  int n;
+
+  pthread_mutex_lock(&p->mutex);
+  n = (int)((double)p->nthreads * j->weights / p->weights + 0.5);
+  if(n < 1) {
+    n = 1;
+  }
+  if(n > TRAINING_SHARDS) {
+    n = TRAINING_SHARDS;
+  }
+  j->nthreads = n;
+  pthread_mutex_unlock(&p->mutex);
+  return n;
+}
+
+static void update_job(job *j, int nit, int n, int nchunks, long samples) {
+  pthread_mutex_lock(&j->pool->mutex);
+  j->nit = nit;
+  j->n = n;
+  j->nchunks = nchunks;
+  j->samples += samples;
+  j->seconds = elapsed_seconds(&j->start);
+  pthread_mutex_unlock(&j->pool->mutex);
+}
+
+// weights of the layers of a network
+static long network_weights(NN *net) {
+  long weights = 0;
+  int i;
+
+  for(i=1;i<net->nl;i++) {
+    weights += (long)net->layers[i].n * (net->layers[i].nprev + 1);
+  }
+  return weights;
+}
 
-  ndataout = 0;
-  while (fgets(buffer, BUFSIZE, out) != NULL) {
-    ndataout++;
+static void save_job_network(job *j) {
+  if(j->multi) {
+    save_multi_net(&j->multi_net, j->file_new);
+  }
+  else {
+    save_net(&j->net, j->file_new);
+  }
+}
+
+// examples of the set h in the chunk n: chunk_size of the window of the first set, and the same fraction of the windows
+// of the other sets
+static int set_chunk_size(job *j, int h, int n, int nchunks) {
+  if(h == 0) {
+    return chunk_size(n, nchunks, j->window[0], j->chunk_data);
+  }
+  return (int)((long)j->window[h] * (n + 1) / nchunks - (long)j->window[h] * n / nchunks);
+}
+
+static void prefetch_chunks(job *j, int n, int nchunks) {
+  int h;
+
+  for(h=0;h<j->nsets;h++) {
+    prefetch_chunk(&j->chunks[n % 2][h], set_chunk_size(j, h, n, nchunks));
+  }
+}
+
+static void wait_chunks(job *j, int n) {
+  int h;
+
+  for(h=0;h<j->nsets;h++) {
+    wait_chunk(&j->chunks[n % 2][h]);
+  }
+}
+
+// returns 0, with nothing left open, if there are not enough samples. The network is loaded before its samples, the
+// multi-head network after them, since a new one has the sizes of the samples of its heads
+int open_job(job *j, char *name, char *prefix, long seed, int resume, int multi, thread_pool *pool) {
+  char file_data[80], file_target[80];
+  const char *set_name;
+  int h;
+
+  // set names of network, dataset and target files
+  snprintf(j->name, sizeof(j->name), "%s", name);
+  sprintf(j->file_network, "%s_network.txt", name);
+  sprintf(j->file_new, "%s_network_new.txt", name);
+  sprintf(j->file_checkpoint, "%s_checkpoint.bin", name);
+  j->multi = multi;
+  j->nsets = multi ? NETWORKS : 1;
+  j->pool = pool;
+  j->verbose = 1;
+  j->nit = j->n = j->nchunks = j->nthreads = j->done = 0;
+  j->samples = 0;
+  j->seconds = 0.;
+
+  // load network; the generator of the minibatches follows the ones drawing its weights and seeding the replay buffer
+  srand48(seed);
+  if(multi == 0) {
+    load_net(&j->net, j->file_network);
+    print_network_structure(&j->net);
   }
-  fclose(out);
 
-  if(ndatain != ndataout) {
-    printf ("Error, number of inputs different from the number of outputs, program will be arrested.\n");
+  // open the windows of the binary shards: of the network, or of the networks of the heads in the directory prefix
+  for(h=0;h<j->nsets;h++) {
+    set_name = multi ? NETWORK_NAMES[h] : name;
+    if(multi == 0) {
+      strcpy(j->data[h].prefix, prefix);
+    }
+    else if(find_samples(j->data[h].prefix, sizeof(j->data[h].prefix), prefix, set_name) == 0) {
+      printf("No samples of the %s network for its head.\n", set_name);
+      snprintf(j->data[h].prefix, sizeof(j->data[h].prefix), "%s/%s", prefix, set_name);
+    }
+    sprintf(file_data, "%s_input.dat", set_name);
+    sprintf(file_target, "%s_output.dat", set_name);
+    open_examples(&j->data[h], file_data, file_target);
+    set_replay_holdout(&j->data[h].replay, VALIDATION_STRIDE);
+  }
+  j->ndata = (int)j->data[0].replay.nsamples;
+  if(j->ndata < MAX_DATA) {
+    for(h=0;h<j->nsets;h++) {
+      close_examples(&j->data[h]);
+    }
+    if(multi == 0) {
+      free_net(&j->net);
+    }
+    return 0;
+  }
+
+  // load the multi-head network, or create it
+  if(multi && (access(j->file_network, F_OK) == 0)) {
+    load_multi_net(&j->multi_net, j->file_network);
+  }
+  else if(multi) {
+    printf("\"%s\" not found, a new network is created.\n", j->file_network);
+    init_heads(&j->multi_net, j->data);
+  }
+  if(multi && (j->multi_net.nheads != NETWORKS)) {
+    printf("Error, the network has %d heads instead of %d.\n", j->multi_net.nheads, NETWORKS);
     exit(EXIT_FAILURE);
   }
-  ndata = ndatain;
-
-
-  if(ndata < MAX_DATA) {
-  	printf("Error, number of data not enough to build a batch.\n");
-  	exit(EXIT_FAILURE);
-  }
-  
-  printf("\nFiles read.\n%d examples to process.\n\n", ndata);
-	  
-  init_training(&net);
-  
-  for(nit = 0; nit<20;nit++) {printf("\n\nNit = %d\n", (nit+1));
-	  	if((in = fopen(file_data, "r")) == NULL) {
-			printf("Error opening the file \"%s\", program will be arrested.", file_data);
-			exit(EXIT_FAILURE);
-	  	}
-	  	if((out = fopen(file_target, "r")) == NULL) {
-			printf("Error opening the file \"%s\", program will be arrested.", file_target);
-			exit(EXIT_FAILURE);
-	  	}
-
-
-	  ntrainings = (ndata / MAX_DATA);
-		  
-	  if((dataset = (double**)malloc(MAX_DATA * sizeof(double*))) == NULL) {
-		printf("Error reallocating the memory for the dataset, program will be arrested.\n");
-		exit(EXIT_FAILURE);
-	  }
+  get_rand48_state(j->seed);
+
+  if(multi) {
+    printf("\nTrunk:");
+    print_network_structure(&j->multi_net.trunk);
+    init_training(&j->multi_net.trunk);
+    j->weights = network_weights(&j->multi_net.trunk);
+    for(h=0;h<j->nsets;h++) {
+      printf("\nHead of the %s network:", NETWORK_NAMES[h]);
+      print_network_structure(&j->multi_net.heads[h]);
+      init_training(&j->multi_net.heads[h]);
+      j->weights += network_weights(&j->multi_net.heads[h]);
+      j->ninput[h] = get_input_size(&j->multi_net.heads[h]);
+      j->noutput[h] = get_output_size(&j->multi_net.heads[h]);
+    }
+  }
+  else {
+    init_training(&j->net);
+    j->weights = network_weights(&j->net);
+    j->ninput[0] = get_input_size(&j->net);
+    j->noutput[0] = get_output_size(&j->net);
+  }
 
-	  for(i=0;i<MAX_DATA;i++) {
-	    if((dataset[i] = (double*)malloc(ninput * sizeof(double))) == NULL) {
-	      printf("Error allocating the memory for the %d-th line of dataset, program will be arrested.\n", i);
-	      exit(EXIT_FAILURE);
-	    }
-	  }
+  // validation sets
+  for(h=0;h<j->nsets;h++) {
+    init_chunk(&j->held_out[h], &j->data[h], (VALIDATION_STRIDE > 0) ? VALIDATION_SAMPLES : 1, j->ninput[h], j->noutput[h]);
+    j->held_out[h].n = read_holdout_samples(&j->data[h].replay, VALIDATION_SAMPLES, j->held_out[h].dataset, j->ninput[h], j->held_out[h].target, j->noutput[h]);
+    init_validation(&j->v[h], j->held_out[h].n, j->held_out[h].dataset, j->held_out[h].target, VALIDATION_FREQUENCY, EARLY_STOPPING_PATIENCE, EARLY_STOPPING_DELTA);
+    if(j->held_out[h].n > 0) {
+      printf("%d examples of the %s network held out for the validation.\n", j->held_out[h].n, multi ? NETWORK_NAMES[h] : name);
+    }
+  }
 
-	  if((target = (double**)malloc(MAX_DATA * sizeof(double*))) == NULL) {
-	    printf("Error reallocating the memory for the target, program will be arrested.\n");
-	    exit(EXIT_FAILURE);
-	  }
+  // resume the training at the chunk after the checkpoint
+  j->first_nit = 0;
+  j->first_chunk = 0;
+  j->chunk_data = 0;
+  if(resume) {
+    load_checkpoint(j);
+    printf("Training of the %s network resumed from iteration %d, chunk %d.\n", name, j->first_nit + 1, j->first_chunk + 1);
+  }
+  return 1;
+}
+
+// allocates the chunks of the job, of chunk_data examples of the first set (between MIN_DATA and MAX_DATA) unless resumed
+// from a checkpoint, with the validation and the checkpoints as often in examples as with chunks of MAX_DATA. The chunks
+// of the other sets have their share of the samples, and grow if it grows. Returns the bytes of the examples
+double init_job_chunks(job *j, int chunk_data) {
+  double memory = 0.;
+  int h, size;
+
+  if(j->chunk_data == 0) {
+    j->chunk_data = (chunk_data < MIN_DATA) ? MIN_DATA : (chunk_data > MAX_DATA) ? MAX_DATA : chunk_data;
+  }
+  j->v[0].frequency = (VALIDATION_FREQUENCY > 0) ? (int)(((long)VALIDATION_FREQUENCY * MAX_DATA + j->chunk_data / 2) / j->chunk_data) : 0;
+  j->checkpoint_chunks = (CHECKPOINT_CHUNKS > 0) ? (int)(((long)CHECKPOINT_CHUNKS * MAX_DATA + j->chunk_data / 2) / j->chunk_data) : 0;
+  for(h=0;h<j->nsets;h++) {
+    size = (int)(((long)j->chunk_data * j->data[h].replay.nsamples + j->ndata - 1) / j->ndata);
+    init_chunk(&j->chunks[0][h], &j->data[h], size, j->ninput[h], j->noutput[h]);
+    init_chunk(&j->chunks[1][h], &j->data[h], size, j->ninput[h], j->noutput[h]);
+    memory += (2. * size + j->held_out[h].n) * (j->ninput[h] + j->noutput[h]) * sizeof(double);
+  }
+
+  return memory;
+}
 
-	  for(i=0;i<MAX_DATA;i++) {
-	    if((target[i] = (double*)malloc(noutput * sizeof(double))) == NULL) {
-	      printf("Error allocating the memory for the %d-th line of target, program will be arrested.\n", i);
-	      exit(EXIT_FAILURE);
+void *train_job(void *arg) {
+  job *j = (job *) arg;
+  double learning_rate, momentum, weight_decay;
+  int Niterations, batchsize;
+  int h, n, nit, nchunks;
+  int ntrain[MAX_HEADS];
+  double **dataset[MAX_HEADS], **target[MAX_HEADS];
+  long samples;
+  chunk *current;
+  optimizer o;
+
+  clock_gettime(CLOCK_MONOTONIC, &j->start);
+  for(nit = j->first_nit; (nit<ITERATIONS) && (j->v[0].stop == 0);nit++) {
+	  if(j->verbose) {
+	    printf("\n\nNit = %d\n", (nit+1));
+	  }
+	  if((nit != j->first_nit) || (j->first_chunk == 0)) {
+	    // the shards written meanwhile by the self play enter the window
+	    for(h=0;h<j->nsets;h++) {
+	      rewind_examples(&j->data[h]);
+	      j->window[h] = (int)j->data[h].replay.nsamples;
 	    }
+	    j->first_chunk = 0;
 	  }
 
+	  // chunks of chunk_data examples, and the last one with the rest: the next chunk is read while training on this one,
+	  // apart from the chunks before a checkpoint, so that the checkpoint has the position of the next chunk
+	  nchunks = (j->window[0] + j->chunk_data - 1) / j->chunk_data;
+	  if(j->first_chunk < nchunks) {
+	    prefetch_chunks(j, j->first_chunk, nchunks);
+	  }
+	  for(n=j->first_chunk;(n<nchunks) && (j->v[0].stop == 0);n++) {
+		  int checkpoint = (j->checkpoint_chunks > 0) && ((n + 1) % j->checkpoint_chunks == 0) && (n + 1 < nchunks);
 
-	  for(n=0;n<(ntrainings);n++) { 
-		  for(i=0;i<MAX_DATA;i++) {
-		    for(j=0;j<ninput;j++) {
-		      fscanf(in, "%lf ", &(dataset[i][j]));
-		    }
-		    fscanf(in, "\n");
-		  }
-
-		  for(i=0;i<MAX_DATA;i++) {
-		    for(j=0;j<noutput;j++) {
-		      fscanf(out, "%lf ", &(target[i][j]));
-		    }
-		    fscanf(out, "\n");
+		  current = j->chunks[n % 2];
+		  wait_chunks(j, n);
+		  if((n + 1 < nchunks) && (checkpoint == 0)) {
+		    prefetch_chunks(j, n + 1, nchunks);
 		  }
 
 		  // init training
-		  learning_rate = 0.1;
-		  if(nit > 14) {
-		  	learning_rate = 0.05;
+		  learning_rate = (SOLVER == SOLVER_SGD) ? 0.1 : ADAM_RATE;
+		  if(nit >= ITERATIONS - 5) {
+		  	learning_rate /= 2.;
 		  }
 		  momentum = 0.9;
 		  weight_decay = 0.0001;
 		  batchsize = 500;
 		  Niterations = 1;
+		  init_optimizer(&o, SOLVER, learning_rate, weight_decay);
+		  o.momentum = momentum;
+		  o.seed = j->seed;
+		  o.label = j->verbose ? NULL : j->name;
+
+		  // train, and save the best network so far
+		  if(j->multi) {
+		    for(h=0;h<j->nsets;h++) {
+		      ntrain[h] = current[h].n;
+		      dataset[h] = current[h].dataset;
+		      target[h] = current[h].target;
+		    }
+		    Niterations = train_multi(&j->multi_net, ntrain, dataset, target, &o, (j->held_out[0].n > 0) ? j->v : NULL, batchsize, Niterations, job_threads(j));
+		  }
+		  else if(j->held_out[0].n > 0) {
+		    Niterations = train_validated(&j->net, current->n, current->dataset, current->target, &o, &j->v[0], batchsize, Niterations, job_threads(j));
+		  }
+		  else {
+		    train_optimizer(&j->net, current->n, current->dataset, current->target, &o, batchsize, Niterations, job_threads(j));
+		  }
+		  if((j->held_out[0].n > 0) && j->v[0].improved) {
+		    save_job_network(j);
+		  }
+		  samples = 0;
+		  for(h=0;h<j->nsets;h++) {
+		    samples += (long)current[h].n * Niterations;
+		  }
+		  update_job(j, nit, n + 1, nchunks, samples);
 
-		  // train
-		  train(&net, MAX_DATA, dataset, target, learning_rate, momentum, weight_decay, batchsize, Niterations);
-	  }
-
-	  for(i=0;i<MAX_DATA;i++) {
-	    free(dataset[i]);
-	  }
-	  free(dataset);
-	  
-	  for(i=0;i<MAX_DATA;i++) {
-		free(target[i]);
+		  if(checkpoint && (j->v[0].stop == 0)) {
+		    save_checkpoint(j, nit, n + 1);
+		    prefetch_chunks(j, n + 1, nchunks);
+		  }
 	  }
-	  free(target);
-		  
-	  if((dataset = (double**)malloc((ndata % MAX_DATA) * sizeof(double*))) == NULL) {
-		printf("Error reallocating the memory for the dataset, program will be arrested.\n");
-		exit(EXIT_FAILURE);
+	  // the chunk read for the training stopped is not used
+	  if(j->v[0].stop && (n < nchunks) && ((j->checkpoint_chunks == 0) || (n % j->checkpoint_chunks != 0))) {
+	    wait_chunks(j, n);
 	  }
 
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-	    if((dataset[i] = (double*)malloc(ninput * sizeof(double))) == NULL) {
-	      printf("Error allocating the memory for the %d-th line of dataset, program will be arrested.\n", i);
-	      exit(EXIT_FAILURE);
-	    }
+	  // save trained network, unless a better one has already been saved
+	  if((j->held_out[0].n == 0) || (j->v[0].best_loss == HUGE_VAL)) {
+	    save_job_network(j);
 	  }
+	  save_checkpoint(j, j->v[0].stop ? ITERATIONS : nit + 1, 0);
+  }
 
-	  if((target = (double**)malloc((ndata % MAX_DATA) * sizeof(double*))) == NULL) {
-	    printf("Error reallocating the memory for the target, program will be arrested.\n");
-	    exit(EXIT_FAILURE);
-	  }
+  if(REPLAY_PRUNE) {
+    for(h=0;h<j->nsets;h++) {
+      printf("%d shards of the %s network out of the window emptied.\n", prune_replay_buffer(&j->data[h].replay), j->multi ? NETWORK_NAMES[h] : j->name);
+    }
+  }
 
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-	    if((target[i] = (double*)malloc(noutput * sizeof(double))) == NULL) {
-	      printf("Error allocating the memory for the %d-th line of target, program will be arrested.\n", i);
-	      exit(EXIT_FAILURE);
-	    }
-	  }
+  // the threads of the job go to the networks still training
+  pthread_mutex_lock(&j->pool->mutex);
+  j->done = 1;
+  j->seconds = elapsed_seconds(&j->start);
+  j->pool->running--;
+  j->pool->weights -= j->weights;
+  pthread_cond_signal(&j->pool->finished);
+  pthread_mutex_unlock(&j->pool->mutex);
+  return NULL;
+}
 
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-	    for(j=0;j<ninput;j++) {
-	      fscanf(in, "%lf ", &(dataset[i][j]));
-	    }
-	    fscanf(in, "\n");
-	  }
+void close_job(job *j) {
+  int h;
 
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-	    for(j=0;j<noutput;j++) {
-	      fscanf(out, "%lf ", &(target[i][j]));
-	    }
-	    fscanf(out, "\n");
-	  }
+  for(h=0;h<j->nsets;h++) {
+    free_chunk(&j->chunks[0][h]);
+    free_chunk(&j->chunks[1][h]);
+    free_chunk(&j->held_out[h]);
+    close_examples(&j->data[h]);
+  }
+  if(j->multi) {
+    free_multi_net(&j->multi_net);
+  }
+  else {
+    free_net(&j->net);
+  }
+}
 
-	  // init training
-	  learning_rate = 0.1;
-	  if(nit > 14) {
-	  	learning_rate = 0.05;
-	  }
-	  momentum = 0.9;
-	  weight_decay = 0.0001;
-	  batchsize = 500;
-	  Niterations = 1;
-
-	  // train
-	  train(&net, (ndata % MAX_DATA), dataset, target, learning_rate, momentum, weight_decay, batchsize, Niterations);
-	  
-	  // save trained network
-	  sprintf(file_network, "%s_network_new.txt", argv[1]);
-	  save_net(&net, file_network);
-
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-	    free(dataset[i]);
-	  }
-	  free(dataset);
-	  
-	  for(i=0;i<(ndata % MAX_DATA);i++) {
-		free(target[i]);
-	  }
-	  free(target);
+// progress and throughput of the jobs, called with the mutex of the pool locked (or after the jobs)
+void report_jobs(job *jobs, int njobs) {
+  long samples = 0;
+  double seconds = 0.;
+  char threads[16];
+  int i;
+
+  printf("\n%-8s %10s %10s %8s %12s %10s\n", "network", "iteration", "chunk", "threads", "samples", "samples/s");
+  for(i=0;i<njobs;i++) {
+    job *j = &jobs[i];
+    if(j->done) {
+      sprintf(threads, "done");
+    }
+    else {
+      sprintf(threads, "%d", j->nthreads);
+    }
+    printf("%-8s %6d/%-3d %6d/%-3d %8s %12ld %10.0f\n", j->name, j->nit + 1, ITERATIONS, j->n, j->nchunks, threads, j->samples, (j->seconds > 0.) ? j->samples / j->seconds : 0.);
+    samples += j->samples;
+    if(j->seconds > seconds) {
+      seconds = j->seconds;
+    }
+  }
+  printf("%-8s %34s %12ld %10.0f\n\n", "total", "", samples, (seconds > 0.) ? samples / seconds : 0.);
+  fflush(stdout);
+}
+
+// prefix of the shards of the network name in the directory, or of its text samples in the working directory (converted
+// by open_examples) if it has no shards there. Returns 0 if it has neither
+int find_samples(char *prefix, size_t size, const char *directory, const char *name) {
+  char file_data[80];
+  int nshards;
+
+  snprintf(prefix, size, "%s/%s", directory, name);
+  count_samples(prefix, &nshards);
+  if(nshards > 0) {
+    return 1;
+  }
+  snprintf(prefix, size, "%s", name);
+  snprintf(file_data, sizeof(file_data), "%s_input.dat", name);
+  count_samples(prefix, &nshards);
+  return (nshards > 0) || (access(file_data, F_OK) == 0);
+}
 
-	  fclose(in);
-	  fclose(out);
+// new multi-head network, with the layers of the separate networks in the trunk and a small hidden layer in each head,
+// on the samples of the heads
+void init_heads(multi_net *m, examples *data) {
+  samples_header *header;
+  int h;
+
+  init_net(&m->trunk, "tanh", "tanh", 4, TRUNK_INPUTS, 300, 200, 100);
+  m->nheads = NETWORKS;
+  for(h=0; h<NETWORKS; h++) {
+    if(data[h].replay.nshards == 0) {
+      printf("Error, no samples of the %s network for the size of its head.\n", NETWORK_NAMES[h]);
+      exit(EXIT_FAILURE);
+    }
+    header = &data[h].replay.shards[0].reader.header;
+    init_net(&m->heads[h], "tanh", (h == 0) ? "mcts" : "softmax", 3, get_output_size(&m->trunk) + header->ninput - TRUNK_INPUTS, HEAD_UNITS, header->noutput);
+    m->heads[h].trunk = &m->trunk;
   }
+}
 
-  free_net(&net);
+void open_examples(examples *e, char *file_data, char *file_target) {
+  int nshards;
 
-  return 0;
+  count_samples(e->prefix, &nshards);
+  if((nshards == 0) && (access(file_data, F_OK) == 0)) {
+    printf("Converting \"%s\" and \"%s\" to binary samples.\n", file_data, file_target);
+    convert_text_samples(file_data, file_target, e->prefix, SAMPLES_FLOAT32);
+  }
+  open_replay_buffer(&e->replay, e->prefix, REPLAY_WINDOW, REPLAY_DECAY);
+}
+
+// the window of the shards is updated
+void rewind_examples(examples *e) {
+  refresh_replay_buffer(&e->replay);
+}
+
+void read_example(examples *e, double *input, int ninput, double *target, int noutput) {
+  if(REPLAY_DECAY == 1.) {
+    next_replay_sample(&e->replay, input, ninput, target, noutput);
+    return;
+  }
+
+  sample_replay(&e->replay, input, ninput, target, noutput);
+}
+
+void close_examples(examples *e) {
+  close_replay_buffer(&e->replay);
+}
+
+void init_chunk(chunk *c, examples *data, int size, int ninput, int noutput) {
+  int i;
+
+  c->data = data;
+  c->ninput = ninput;
+  c->noutput = noutput;
+  c->n = 0;
+  c->size = size;
+  c->inputs = (double*)malloc((size_t)size * ninput * sizeof(double));
+  c->targets = (double*)malloc((size_t)size * noutput * sizeof(double));
+  c->dataset = (double**)malloc(size * sizeof(double*));
+  c->target = (double**)malloc(size * sizeof(double*));
+  if((c->inputs == NULL) || (c->targets == NULL) || (c->dataset == NULL) || (c->target == NULL)) {
+    printf("Error allocating the memory for the dataset, program will be arrested.\n");
+    exit(EXIT_FAILURE);
+  }
+  for(i=0;i<size;i++) {
+    c->dataset[i] = c->inputs + (size_t)i * ninput;
+    c->target[i] = c->targets + (size_t)i * noutput;
+  }
+}
+
+static void *read_chunk(void *arg) {
+  chunk *c = (chunk *) arg;
+  int i;
+
+  for(i=0;i<c->n;i++) {
+    read_example(c->data, c->dataset[i], c->ninput, c->target[i], c->noutput);
+  }
+  return NULL;
+}
+
+// examples of the chunk n: chunk_data, and the rest in the last one
+int chunk_size(int n, int nchunks, int ndata, int chunk_data) {
+  return (n + 1 < nchunks) ? chunk_data : ndata - n * chunk_data;
+}
+
+// the examples are read on a background thread, until wait_chunk; the chunk grows if they are more than its size
+void prefetch_chunk(chunk *c, int n) {
+  if(n > c->size) {
+    free_chunk(c);
+    init_chunk(c, c->data, n, c->ninput, c->noutput);
+  }
+  c->n = n;
+  if(pthread_create(&c->thread, NULL, read_chunk, c) != 0) {
+    printf("Error creating the thread reading the examples, program will be arrested.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void wait_chunk(chunk *c) {
+  pthread_join(c->thread, NULL);
+}
+
+void free_chunk(chunk *c) {
+  free(c->inputs);
+  free(c->targets);
+  free(c->dataset);
+  free(c->target);
+}
+
+// the checkpoint is written to a temporary file and renamed, so an interruption leaves the previous one
+void save_checkpoint(job *j, int nit, int n) {
+  char temporary_name[100];
+  int position[6] = {nit, n, j->window[0], j->v[0].iterations, j->v[0].stale, j->chunk_data};
+  double losses[2] = {j->v[0].loss, j->v[0].best_loss};
+  int h;
+  FILE *out;
+
+  sprintf(temporary_name, "%s.tmp", j->file_checkpoint);
+  if((out = fopen(temporary_name, "wb")) == NULL) {
+    printf("Error opening the checkpoint \"%s\", program will be arrested.\n", temporary_name);
+    exit(EXIT_FAILURE);
+  }
+  if((fwrite(CHECKPOINT_MAGIC, 1, 8, out) != 8) || (fwrite(position, sizeof(int), 6, out) != 6) || (fwrite(&j->window[1], sizeof(int), j->nsets - 1, out) != (size_t)(j->nsets - 1)) || (fwrite(losses, sizeof(double), 2, out) != 2) || (fwrite(j->seed, sizeof(unsigned short), 3, out) != 3)) {
+    printf("Error writing the checkpoint \"%s\", program will be arrested.\n", temporary_name);
+    exit(EXIT_FAILURE);
+  }
+  if(j->multi) {
+    save_training_state(&j->multi_net.trunk, out);
+    for(h=0;h<j->nsets;h++) {
+      save_training_state(&j->multi_net.heads[h], out);
+    }
+  }
+  else {
+    save_training_state(&j->net, out);
+  }
+  for(h=0;h<j->nsets;h++) {
+    save_replay_cursor(&j->data[h].replay, out);
+  }
+  if(fclose(out) != 0 || rename(temporary_name, j->file_checkpoint) != 0) {
+    printf("Error writing the checkpoint \"%s\", program will be arrested.\n", j->file_checkpoint);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void load_checkpoint(job *j) {
+  char magic[8];
+  int position[6];
+  double losses[2];
+  int h;
+  FILE *in;
+
+  if((in = fopen(j->file_checkpoint, "rb")) == NULL) {
+    printf("Error, no checkpoint \"%s\" to resume the training.\n", j->file_checkpoint);
+    exit(EXIT_FAILURE);
+  }
+  if((fread(magic, 1, 8, in) != 8) || (memcmp(magic, CHECKPOINT_MAGIC, 8) != 0) || (fread(position, sizeof(int), 6, in) != 6) || (fread(&j->window[1], sizeof(int), j->nsets - 1, in) != (size_t)(j->nsets - 1)) || (fread(losses, sizeof(double), 2, in) != 2) || (fread(j->seed, sizeof(unsigned short), 3, in) != 3)) {
+    printf("Error, \"%s\" is not a checkpoint of the training.\n", j->file_checkpoint);
+    exit(EXIT_FAILURE);
+  }
+  if(j->multi) {
+    load_training_state(&j->multi_net.trunk, in);
+    for(h=0;h<j->nsets;h++) {
+      load_training_state(&j->multi_net.heads[h], in);
+    }
+  }
+  else {
+    load_training_state(&j->net, in);
+  }
+  for(h=0;h<j->nsets;h++) {
+    if(load_replay_cursor(&j->data[h].replay, in) == 0) {
+      printf("New samples since the checkpoint: the examples of the %s network are read in a new order.\n", j->multi ? NETWORK_NAMES[h] : j->name);
+    }
+  }
+  fclose(in);
+  j->first_nit = position[0];
+  j->first_chunk = position[1];
+  j->window[0] = position[2];
+  j->v[0].iterations = position[3];
+  j->v[0].stale = position[4];
+  j->v[0].loss = losses[0];
+  j->v[0].best_loss = losses[1];
+  j->chunk_data = position[5];
 }